@@ -0,0 +1,47 @@
+# Runs the instrumented dither on the example images, with every dither mode and output format.
+# Usage: cmake -DDITHER=<exe> -DEXAMPLES_DIR=<dir> -DWORK_DIR=<dir> -DPROFILE_DIR=<dir> -DCOMPILER_ID=<id> [-DLLVM_PROFDATA=<exe>] -P PgoTrain.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# The outputs are written next to the inputs, so work on copies
+file(GLOB images ${EXAMPLES_DIR}/*.png)
+list(FILTER images EXCLUDE REGEX "\\.dither\\.")
+if(NOT images)
+    message(FATAL_ERROR "No training images in ${EXAMPLES_DIR}")
+endif()
+file(COPY ${images} DESTINATION ${WORK_DIR})
+
+set(modes ign bayer bluenoise fs jjn stucki sierra)
+set(formats png ktx ktx2 dds)
+foreach(mode ${modes})
+    foreach(format ${formats})
+        execute_process(COMMAND ${DITHER} -d ${mode} -f ${format} --mipmaps ${WORK_DIR}
+                        RESULT_VARIABLE result OUTPUT_QUIET)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "Training run failed: dither -d ${mode} -f ${format}")
+        endif()
+    endforeach()
+endforeach()
+
+# Single image path, with the thread pool
+file(GLOB inputs ${WORK_DIR}/*.png)
+list(FILTER inputs EXCLUDE REGEX "\\.dither\\.")
+foreach(input ${inputs})
+    execute_process(COMMAND ${DITHER} ${input} RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Training run failed: dither ${input}")
+    endif()
+endforeach()
+
+if(COMPILER_ID MATCHES "Clang")
+    if(NOT LLVM_PROFDATA)
+        message(FATAL_ERROR "llvm-profdata is needed to merge the clang profiles")
+    endif()
+    file(GLOB raw_profiles ${PROFILE_DIR}/*.profraw)
+    execute_process(COMMAND ${LLVM_PROFDATA} merge -o ${PROFILE_DIR}/dither.profdata ${raw_profiles}
+                    RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "llvm-profdata merge failed")
+    endif()
+endif()
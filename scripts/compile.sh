@@ -3,4 +3,7 @@
 BUILD_DIR=./build
 mkdir -p $BUILD_DIR
 
-clang++ -O0 -o $BUILD_DIR/dither ./src/dither.cpp
\ No newline at end of file
+clang++ -O0 -pthread -c -o $BUILD_DIR/dither.o ./src/dither.cpp
+ar rcs $BUILD_DIR/libdither.a $BUILD_DIR/dither.o
+clang++ -O0 -pthread -o $BUILD_DIR/dither ./src/main.cpp -L$BUILD_DIR -ldither
+clang++ -O2 -pthread -o $BUILD_DIR/dither_bench ./src/bench.cpp
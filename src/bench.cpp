@@ -0,0 +1,487 @@
+// Benchmarks the pixel kernels on synthetic images and prints the results as JSON
+//
+//    $ ./build/dither_bench > bench.json
+//    $ ./build/dither_bench --sizes 256,1024 --patterns noise --filter ign
+//
+// The kernels are timed single threaded, on the whole image. The dither_image_* benchmarks go through the
+// public api with the requested number of threads. Each benchmark reports the fastest of its iterations.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// The kernels are internal to the library
+#include "dither.cpp"
+
+#include <chrono>
+#include <string>
+
+enum BenchPattern
+{
+    BENCH_PATTERN_GRADIENT,
+    BENCH_PATTERN_NOISE,
+    BENCH_PATTERN_FLAT,
+    BENCH_PATTERN_PHOTO,
+    BENCH_PATTERN_COUNT,
+};
+
+static const char* getBenchPatternName(BenchPattern pattern)
+{
+    switch (pattern)
+    {
+    case BENCH_PATTERN_GRADIENT:    return "gradient";
+    case BENCH_PATTERN_NOISE:       return "noise";
+    case BENCH_PATTERN_FLAT:        return "flat";
+    case BENCH_PATTERN_PHOTO:       return "photo";
+    default:                        return "unknown";
+    }
+}
+
+static inline uint32_t xorshift32(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Smooth value noise, used to make the "photo" pattern: a few octaves of soft shapes plus some sensor grain.
+// It compresses and dithers roughly like a real photo, without shipping large images with the repo.
+static float valueNoise(const float* lattice, uint32_t lattice_size, float u, float v)
+{
+    uint32_t x0 = (uint32_t)u, y0 = (uint32_t)v;
+    float fx = u - x0, fy = v - y0;
+    fx = fx * fx * (3.0f - 2.0f * fx);
+    fy = fy * fy * (3.0f - 2.0f * fy);
+    uint32_t x1 = (x0 + 1) % lattice_size, y1 = (y0 + 1) % lattice_size;
+    x0 %= lattice_size;
+    y0 %= lattice_size;
+    float a = lattice[y0 * lattice_size + x0] + (lattice[y0 * lattice_size + x1] - lattice[y0 * lattice_size + x0]) * fx;
+    float b = lattice[y1 * lattice_size + x0] + (lattice[y1 * lattice_size + x1] - lattice[y1 * lattice_size + x0]) * fx;
+    return a + (b - a) * fy;
+}
+
+static void generatePattern(BenchPattern pattern, uint32_t width, uint32_t height, uint8_t* rgba)
+{
+    uint32_t seed = 0x12345678;
+    if (pattern == BENCH_PATTERN_PHOTO)
+    {
+        const uint32_t lattice_size = 64;
+        float lattice[3][lattice_size * lattice_size];
+        for (uint32_t c = 0; c < 3; ++c)
+        {
+            for (uint32_t i = 0; i < lattice_size * lattice_size; ++i)
+                lattice[c][i] = (xorshift32(&seed) & 0xFFFF) / 65535.0f;
+        }
+        // The features keep the same size in pixels, whatever the image size
+        const float scale = 1.0f / 128.0f;
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            uint8_t* row = rgba + (size_t)y * width * 4;
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                for (uint32_t c = 0; c < 3; ++c)
+                {
+                    float v = 0.6f * valueNoise(lattice[c], lattice_size, x * scale, y * scale)
+                            + 0.3f * valueNoise(lattice[c], lattice_size, x * scale * 4.0f, y * scale * 4.0f)
+                            + 0.1f * valueNoise(lattice[c], lattice_size, x * scale * 16.0f, y * scale * 16.0f);
+                    int grain = (int)(xorshift32(&seed) & 7) - 4;
+                    int value = (int)(v * 255.0f) + grain;
+                    row[x*4+c] = (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+                }
+                row[x*4+3] = (uint8_t)(255 - (x * 255 / width) / 2);
+            }
+        }
+        return;
+    }
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        uint8_t* row = rgba + (size_t)y * width * 4;
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            switch (pattern)
+            {
+            case BENCH_PATTERN_GRADIENT:
+                row[x*4+0] = (uint8_t)((uint64_t)x * 255 / width);
+                row[x*4+1] = (uint8_t)((uint64_t)y * 255 / height);
+                row[x*4+2] = (uint8_t)((uint64_t)(x + y) * 255 / (width + height));
+                row[x*4+3] = (uint8_t)(255 - (uint64_t)x * 255 / width);
+                break;
+            case BENCH_PATTERN_NOISE:
+                {
+                    uint32_t r = xorshift32(&seed);
+                    memcpy(row + x*4, &r, 4);
+                }
+                break;
+            default:
+                row[x*4+0] = 93;
+                row[x*4+1] = 130;
+                row[x*4+2] = 201;
+                row[x*4+3] = 255;
+                break;
+            }
+        }
+    }
+}
+
+// *****************************************************************************************************
+// Timing
+
+static double getTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t getCycles()
+{
+#if defined(DITHER_X86)
+    return __rdtsc(); // reference cycles, i.e. at the nominal frequency
+#else
+    return 0;
+#endif
+}
+
+struct BenchSettings
+{
+    uint32_t    num_threads;
+    double      min_time;       // seconds spent per benchmark (at least one iteration)
+    uint32_t    png_max_size;   // the png benchmarks are slow, skip the larger images
+    const char* filter;         // only the benchmarks with this substring in their name
+};
+
+struct BenchImage
+{
+    BenchPattern    pattern;
+    uint32_t        width;
+    uint32_t        height;
+    uint8_t*        rgba;       // the source image
+    uint8_t*        rgb;        // same, without alpha
+    uint8_t*        work;       // scratch for the kernels that work in place
+    uint16_t*       packed;
+    uint8_t*        png;        // encoded once, for the decode benchmark
+    int             png_size;
+};
+
+struct BenchResult
+{
+    uint32_t    iterations;
+    double      seconds;        // fastest iteration
+    uint64_t    cycles;         // of the fastest iteration
+};
+
+static bool g_FirstResult = true;
+
+static void printResult(const char* name, const BenchImage& image, const BenchResult& result)
+{
+    double pixels = (double)image.width * image.height;
+    printf("%s    {\"name\": \"%s\", \"pattern\": \"%s\", \"width\": %u, \"height\": %u, \"iterations\": %u, \"seconds\": %.9f, \"mpix_per_s\": %.3f, ",
+                g_FirstResult ? "" : ",\n", name, getBenchPatternName(image.pattern), image.width, image.height,
+                result.iterations, result.seconds, pixels / result.seconds / 1000000.0);
+#if defined(DITHER_X86)
+    printf("\"cycles_per_pixel\": %.4f}", result.cycles / pixels);
+#else
+    printf("\"cycles_per_pixel\": null}");
+#endif
+    fflush(stdout);
+    g_FirstResult = false;
+}
+
+// Runs setup (untimed) and fn (timed) until min_time has passed
+template<typename Setup, typename Fn>
+static void runBench(const BenchSettings& settings, const char* name, const BenchImage& image, const Setup& setup, const Fn& fn)
+{
+    if (settings.filter && !strstr(name, settings.filter))
+        return;
+
+    BenchResult result;
+    result.iterations = 0;
+    result.seconds = 1e30;
+    result.cycles = 0;
+    double total = 0.0;
+    while (result.iterations == 0 || total < settings.min_time)
+    {
+        setup();
+        double start = getTime();
+        uint64_t start_cycles = getCycles();
+        fn();
+        uint64_t cycles = getCycles() - start_cycles;
+        double seconds = getTime() - start;
+        if (seconds < result.seconds)
+        {
+            result.seconds = seconds;
+            result.cycles = cycles;
+        }
+        total += seconds;
+        result.iterations++;
+    }
+    printResult(name, image, result);
+}
+
+static void noSetup()
+{
+}
+
+// *****************************************************************************************************
+// Benchmarks
+
+struct PngTask
+{
+    stbi_write_parallel_task* m_Task;
+    void*                     m_Data;
+};
+
+static void pngTaskTrampoline(void* data, uint32_t index)
+{
+    const PngTask* task = (const PngTask*)data;
+    task->m_Task(task->m_Data, (int)index);
+}
+
+static void pngParallelFor(void* context, int count, stbi_write_parallel_task* task, void* data)
+{
+    PngTask args = { task, data };
+    dither_parallel_for((dither_context*)context, (uint32_t)count, pngTaskTrampoline, &args);
+}
+
+static void benchImage(const BenchSettings& settings, dither_context* ctx, BenchImage& image)
+{
+    const uint32_t w = image.width;
+    const uint32_t h = image.height;
+    const size_t rgba_size = (size_t)w * h * 4;
+    uint8_t* work = image.work;
+    uint16_t* packed = image.packed;
+    auto copyInput = [&]() { memcpy(work, image.rgba, rgba_size); };
+
+    // Dither kernels
+    DitherRowFn ign_rgba4444 = getDitherInterleavedGradientRGBA4444Row();
+    runBench(settings, "ign_rgba4444", image, copyInput, [&]() {
+        for (uint32_t y = 0; y < h; ++y)
+            ign_rgba4444(work + (size_t)y * w * 4, w, y);
+    });
+    DitherPackRowFn ign_rgb565 = getDitherPackInterleavedGradientRGB565Row();
+    runBench(settings, "ign_pack_rgb565_from_rgb", image, noSetup, [&]() {
+        for (uint32_t y = 0; y < h; ++y)
+            ign_rgb565(image.rgb + (size_t)y * w * 3, 3, packed + (size_t)y * w, w, y);
+    });
+    runBench(settings, "ign_pack_rgb565_from_rgba", image, noSetup, [&]() {
+        for (uint32_t y = 0; y < h; ++y)
+            ign_rgb565(image.rgba + (size_t)y * w * 4, 4, packed + (size_t)y * w, w, y);
+    });
+
+    const uint8_t bits4444[4] = { 4, 4, 4, 4 };
+    DitherOrderedRowFn ordered = getDitherOrderedRow();
+    const ThresholdTable* bayer = getThresholdTable(THRESHOLD_MAP_BAYER, 8, bits4444, 0);
+    runBench(settings, "bayer8_rgba4444", image, copyInput, [&]() {
+        for (uint32_t y = 0; y < h; ++y)
+            ordered(work + (size_t)y * w * 4, 4, w, y, bayer);
+    });
+    const ThresholdTable* blue_noise = getThresholdTable(THRESHOLD_MAP_BLUE_NOISE, 64, bits4444, 0);
+    runBench(settings, "bluenoise64_rgba4444", image, copyInput, [&]() {
+        for (uint32_t y = 0; y < h; ++y)
+            ordered(work + (size_t)y * w * 4, 4, w, y, blue_noise);
+    });
+    runBench(settings, "fs_rgba4444", image, noSetup, [&]() {
+        ErrorDiffusionJob* job = errorDiffusionBegin(0, &g_FloydSteinberg, 4, w, h, bits4444, packed);
+        errorDiffusionRows(0, job, image.rgba, w * 4, h);
+        errorDiffusionEnd(job);
+    });
+
+    // Converters
+    runBench(settings, "rgba8888_to_rgb565", image, noSetup, [&]() {
+        RGBA8888ToRGB565(image.rgba, w, h, packed, 4);
+    });
+    runBench(settings, "rgba8888_to_rgba4444", image, noSetup, [&]() {
+        RGBA8888ToRGBA4444(image.rgba, w, h, packed);
+    });
+    runBench(settings, "rgb565_to_rgba8888", image, noSetup, [&]() {
+        RGB565ToRGBA8888(packed, w, h, work);
+    });
+    runBench(settings, "rgba4444_to_rgba8888", image, noSetup, [&]() {
+        RGBA4444ToRGBA8888(packed, w, h, work);
+    });
+    runBench(settings, "rgb_to_rgba", image, noSetup, [&]() {
+        copyRowsToRGBA8(image.rgb, w * 3, 3, w, 0, h, work);
+    });
+
+    // The whole pipeline, through the public api
+    const dither_mode modes[] = { DITHER_MODE_INTERLEAVED_GRADIENT, DITHER_MODE_BAYER, DITHER_MODE_BLUE_NOISE, DITHER_MODE_FLOYD_STEINBERG };
+    for (uint32_t i = 0; i < sizeof(modes)/sizeof(modes[0]); ++i)
+    {
+        dither_params params;
+        dither_default_params(&params);
+        params.mode = modes[i];
+        char name[64];
+        snprintf(name, sizeof(name), "dither_image_%s_rgba4444", dither_mode_name(modes[i]));
+        runBench(settings, name, image, noSetup, [&]() {
+            dither_image(ctx, image.rgba, w, h, w * 4, DITHER_SRC_RGBA8, DITHER_DST_RGBA4444, &params, packed);
+        });
+        snprintf(name, sizeof(name), "dither_image_%s_rgb565", dither_mode_name(modes[i]));
+        runBench(settings, name, image, noSetup, [&]() {
+            dither_image(ctx, image.rgb, w, h, w * 3, DITHER_SRC_RGB8, DITHER_DST_RGB565, &params, packed);
+        });
+    }
+
+    // Png encode and decode of the 8 bit preview, as written by the tool
+    if (w > settings.png_max_size || h > settings.png_max_size)
+        return;
+    dither_params params;
+    dither_default_params(&params);
+    dither_image(ctx, image.rgba, w, h, w * 4, DITHER_SRC_RGBA8, DITHER_DST_RGBA4444, &params, packed);
+    dither_expand_rgba8(ctx, packed, w, h, DITHER_DST_RGBA4444, work);
+    image.png = stbi_write_png_to_mem(work, w * 4, w, h, 4, &image.png_size);
+    runBench(settings, "png_encode", image, [&]() { free(image.png); image.png = 0; }, [&]() {
+        image.png = stbi_write_png_to_mem(work, w * 4, w, h, 4, &image.png_size);
+    });
+    runBench(settings, "png_encode_parallel", image, [&]() { free(image.png); image.png = 0; }, [&]() {
+        image.png = stbi_write_png_to_mem_parallel(work, w * 4, w, h, 4, &image.png_size, pngParallelFor, ctx);
+    });
+    runBench(settings, "png_decode", image, noSetup, [&]() {
+        int x, y, n;
+        free(stbi_load_from_memory(image.png, image.png_size, &x, &y, &n, 4));
+    });
+    runBench(settings, "png_decode_into", image, noSetup, [&]() {
+        int x, y, n;
+        stbi_load_from_memory_into(image.png, image.png_size, work, (size_t)w * h * 4, 0, &x, &y, &n, 4);
+    });
+    free(image.png);
+    image.png = 0;
+}
+
+static bool parseList(const char* list, std::vector<std::string>& items)
+{
+    items.clear();
+    std::string item;
+    for (const char* p = list; ; ++p)
+    {
+        if (*p == ',' || *p == 0)
+        {
+            if (item.empty())
+                return false;
+            items.push_back(item);
+            item.clear();
+            if (*p == 0)
+                break;
+        }
+        else
+        {
+            item += *p;
+        }
+    }
+    return true;
+}
+
+static void printUsage()
+{
+    fprintf(stderr, "Usage: dither_bench [options]\n");
+    fprintf(stderr, "  --sizes <n,...>      Image sizes (default: 256,1024,4096,16384)\n");
+    fprintf(stderr, "  --patterns <p,...>   Patterns: gradient, noise, flat, photo (default: all)\n");
+    fprintf(stderr, "  --filter <str>       Only run the benchmarks whose name contains <str>\n");
+    fprintf(stderr, "  --min-time <s>       Time spent per benchmark (default: 0.25)\n");
+    fprintf(stderr, "  --png-max-size <n>   Skip png encode/decode above this size (default: 4096)\n");
+    fprintf(stderr, "  -j, --threads <n>    Threads used by the dither_image benchmarks (default: one per hardware thread)\n");
+}
+
+int main(int argc, char const *argv[])
+{
+    BenchSettings settings;
+    settings.num_threads = 0;
+    settings.min_time = 0.25;
+    settings.png_max_size = 4096;
+    settings.filter = 0;
+
+    std::vector<uint32_t> sizes = { 256, 1024, 4096, 16384 };
+    std::vector<BenchPattern> patterns = { BENCH_PATTERN_GRADIENT, BENCH_PATTERN_NOISE, BENCH_PATTERN_FLAT, BENCH_PATTERN_PHOTO };
+    std::vector<std::string> items;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc && parseList(argv[++i], items))
+        {
+            sizes.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+                sizes.push_back((uint32_t)atoi(items[j].c_str()));
+        }
+        else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc && parseList(argv[++i], items))
+        {
+            patterns.clear();
+            for (size_t j = 0; j < items.size(); ++j)
+            {
+                int p = 0;
+                while (p < BENCH_PATTERN_COUNT && items[j] != getBenchPatternName((BenchPattern)p))
+                    ++p;
+                if (p == BENCH_PATTERN_COUNT)
+                {
+                    fprintf(stderr, "Unknown pattern '%s'\n", items[j].c_str());
+                    return 1;
+                }
+                patterns.push_back((BenchPattern)p);
+            }
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            settings.filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+        {
+            settings.min_time = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--png-max-size") == 0 && i + 1 < argc)
+        {
+            settings.png_max_size = (uint32_t)atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc)
+        {
+            settings.num_threads = (uint32_t)atoi(argv[++i]);
+        }
+        else
+        {
+            printUsage();
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    dither_context* ctx = dither_create(settings.num_threads);
+    uint32_t features = getCpuFeatures();
+    printf("{\n  \"simd\": \"%s\",\n  \"threads\": %u,\n  \"results\": [\n",
+                (features & CPU_FEATURE_AVX2) ? "avx2" : ((features & CPU_FEATURE_SSE41) ? "sse4.1" : "none"),
+                threadPoolGetNumThreads(ctx->m_Pool));
+
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        BenchImage image;
+        memset(&image, 0, sizeof(image));
+        image.width = sizes[s];
+        image.height = sizes[s];
+        size_t num_pixels = (size_t)image.width * image.height;
+        image.rgba = (uint8_t*)malloc(num_pixels * 4);
+        image.rgb = (uint8_t*)malloc(num_pixels * 3);
+        image.work = (uint8_t*)malloc(num_pixels * 4);
+        image.packed = (uint16_t*)malloc(num_pixels * 2);
+        if (!image.rgba || !image.rgb || !image.work || !image.packed)
+        {
+            fprintf(stderr, "Out of memory for %ux%u\n", image.width, image.height);
+            return 1;
+        }
+
+        for (size_t p = 0; p < patterns.size(); ++p)
+        {
+            image.pattern = patterns[p];
+            generatePattern(image.pattern, image.width, image.height, image.rgba);
+            for (size_t i = 0; i < num_pixels; ++i)
+                memcpy(image.rgb + i * 3, image.rgba + i * 4, 3);
+            benchImage(settings, ctx, image);
+        }
+
+        free(image.rgba);
+        free(image.rgb);
+        free(image.work);
+        free(image.packed);
+    }
+
+    printf("\n  ]\n}\n");
+    dither_destroy(ctx);
+    return 0;
+}
@@ -1,14 +1,29 @@
+#include "dither.h"
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <memory.h>
+#include <string.h>
+#include <math.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-#include <math.h>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define DITHER_X86
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define DITHER_TARGET(_X)
+    #else
+        #define DITHER_TARGET(_X) __attribute__((target(_X)))
+    #endif
+#endif
 
 // https://en.wikipedia.org/wiki/Ordered_dithering
 // https://bartwronski.com/2016/10/30/dithering-part-three-real-world-2d-quantization-dithering/
@@ -16,37 +31,41 @@
 // http://loopit.dk/banding_in_games.pdf + https://www.shadertoy.com/view/MslGR8
 // https://ubm-twvideo01.s3.amazonaws.com/o1/vault/gdc2016/Presentations/Gjoel_Svendsen_Rendering_of_Inside.pdf
 
-static void computeBayerThresholdMap(int n, float* M)
+// Computes the Bayer index matrix (values [0, n*n)) for any power of two n, recursively:
+//   M(2n) = | 4*M(n) + 0   4*M(n) + 2 |
+//           | 4*M(n) + 3   4*M(n) + 1 |
+static void computeBayerIndexMap(int n, uint32_t* M)
 {
-    if (n == 4)
-    {
-        const float m[] = {
-             0,  8,  2, 10,
-            12,  4, 14,  6,
-             3, 11,  1,  9,
-            15,  7, 13,  5
-        };
-        memcpy(M, m, sizeof(float) * n * n);
-    }
-    else if (n == 8)
-    {
-        const float m[] = {
-             0,  32,  8, 40,  2, 34, 10, 42,
-             48, 16, 56, 24, 50, 18, 58, 26,
-             12, 44,  4, 36, 14, 46,  6, 38,
-             60, 28, 52, 20, 62, 30, 54, 22,
-              3, 35, 11, 43,  1, 33,  9, 41,
-             51, 19, 59, 27, 49, 17, 57, 25,
-             15, 47,  7, 39, 13, 45,  5, 37,
-             63, 31, 55, 23, 61, 29, 53, 21
-        };
-        memcpy(M, m, sizeof(float) * n * n);
+    if (n <= 1)
+    {
+        M[0] = 0;
+        return;
+    }
+    const uint32_t m2[] = { 0, 2, 3, 1 };
+    int half = n / 2;
+    uint32_t* sub = (uint32_t*)malloc(sizeof(uint32_t) * half * half);
+    computeBayerIndexMap(half, sub);
+    for (int y = 0; y < n; ++y)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            M[y * n + x] = 4 * sub[(y % half) * half + (x % half)] + m2[(y / half) * 2 + (x / half)];
+        }
     }
+    free(sub);
+}
+
+// Thresholds in the range [-0.5, 0.5)
+static void computeBayerThresholdMap(int n, float* M)
+{
+    uint32_t* indices = (uint32_t*)malloc(sizeof(uint32_t) * n * n);
+    computeBayerIndexMap(n, indices);
     float div = 1.0f / (n*n);
     for (int i = 0; i < n*n; ++i)
     {
-        M[i] = M[i] * div - 0.5f;
+        M[i] = indices[i] * div - 0.5f;
     }
+    free(indices);
 }
 
 static void printM(int n, const float* M)
@@ -79,7 +98,7 @@ static void RGB565ToRGBA8888(const uint16_t* data, const uint32_t width, const u
     }
 }
 
-static void RGBA8888ToRGB565(const uint8_t* data, const uint32_t width, const uint32_t height, uint16_t* color_rgb)
+static void RGBA8888ToRGB565(const uint8_t* data, const uint32_t width, const uint32_t height, uint16_t* color_rgb, const uint32_t numchannels)
 {
     for(uint32_t i = 0; i < width*height; ++i)
     {
@@ -91,7 +110,7 @@ static void RGBA8888ToRGB565(const uint8_t* data, const uint32_t width, const ui
         uint16_t b = ((blue >> 3) & 0x1f);
 
         *(color_rgb++) = (r | g | b);
-        data += 4;
+        data += numchannels;
     }
 }
 
@@ -126,48 +145,165 @@ static void RGBA8888ToRGBA4444(const uint8_t* data, const uint32_t width, const
     }
 }
 
-static inline float clamp255(float v)
+// A small thread pool for running data parallel loops (e.g. rows of an image).
+// The calling thread also participates, so a pool with N threads uses N-1 workers.
+// Work is handed out in fixed size ranges, and since each range only depends on its own
+// indices, the result doesn't depend on the number of threads or the scheduling.
+typedef void (*ThreadPoolRangeFn)(void* ctx, uint32_t begin, uint32_t end);
+
+struct ThreadPool
 {
-    if (v < 0)
-        v = 0.0f;
-    else if (v > 255)
-        v = 255.0f;
-    return v;
+    std::vector<std::thread> m_Workers;
+    std::mutex               m_Mutex;       // protects the job and the generation
+    std::mutex               m_JobMutex;    // serializes parallel for calls from different threads
+    std::condition_variable  m_WorkAvailable;
+    std::condition_variable  m_WorkDone;
+    ThreadPoolRangeFn        m_Fn;
+    void*                    m_Ctx;
+    uint32_t                 m_Count;
+    uint32_t                 m_Grain;
+    std::atomic<uint32_t>    m_Next;
+    uint32_t                 m_Busy;        // number of workers still in the current job
+    uint64_t                 m_Generation;
+    bool                     m_Quit;
+};
+
+static void threadPoolRunRanges(ThreadPool* pool)
+{
+    uint32_t begin;
+    while ((begin = pool->m_Next.fetch_add(pool->m_Grain)) < pool->m_Count)
+    {
+        uint32_t end = pool->m_Count - begin < pool->m_Grain ? pool->m_Count : begin + pool->m_Grain;
+        pool->m_Fn(pool->m_Ctx, begin, end);
+    }
 }
 
-//https://en.wikipedia.org/wiki/Ordered_dithering
-static float getM(int n, const float* M, uint32_t x, uint32_t y)
+static void threadPoolWorker(ThreadPool* pool)
 {
-    x = x % n;
-    y = y % n;
-    return M[y * n + x];
+    uint64_t generation = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->m_Mutex);
+            pool->m_WorkAvailable.wait(lock, [&] { return pool->m_Quit || pool->m_Generation != generation; });
+            if (pool->m_Quit)
+                return;
+            generation = pool->m_Generation;
+        }
+
+        threadPoolRunRanges(pool);
+
+        std::lock_guard<std::mutex> lock(pool->m_Mutex);
+        if (--pool->m_Busy == 0)
+            pool->m_WorkDone.notify_one();
+    }
 }
 
-static inline uint8_t ditherBayerValue(uint8_t uv, float m, float r)
+// num_threads: total number of threads, including the caller. 0 means one per hardware thread
+static ThreadPool* threadPoolCreate(uint32_t num_threads)
 {
-    float v = ((float)uv) + r * m;
-    v = clamp255(v);
-    return (uint8_t)round(v);
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+
+    ThreadPool* pool = new ThreadPool;
+    pool->m_Fn = 0;
+    pool->m_Ctx = 0;
+    pool->m_Count = 0;
+    pool->m_Grain = 1;
+    pool->m_Next = 0;
+    pool->m_Busy = 0;
+    pool->m_Generation = 0;
+    pool->m_Quit = false;
+    for (uint32_t i = 1; i < num_threads; ++i)
+    {
+        pool->m_Workers.push_back(std::thread(threadPoolWorker, pool));
+    }
+    return pool;
 }
 
-static void ditherBayer(uint8_t* data, uint32_t width, uint32_t height, int n, float* M)
+static void threadPoolDestroy(ThreadPool* pool)
 {
-    const float r = 255.0f / n;
+    if (!pool)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pool->m_Mutex);
+        pool->m_Quit = true;
+    }
+    pool->m_WorkAvailable.notify_all();
+    for (size_t i = 0; i < pool->m_Workers.size(); ++i)
+    {
+        pool->m_Workers[i].join();
+    }
+    delete pool;
+}
 
-    for (uint32_t y = 0; y < height; ++y)
+static uint32_t threadPoolGetNumThreads(const ThreadPool* pool)
+{
+    return pool ? (uint32_t)pool->m_Workers.size() + 1 : 1;
+}
+
+// Calls fn(ctx, begin, end) for ranges of at most grain items, covering [0, count). Returns when all are done.
+// A null pool runs everything on the calling thread.
+static void threadPoolParallelFor(ThreadPool* pool, uint32_t count, uint32_t grain, ThreadPoolRangeFn fn, void* ctx)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+    if (!pool || pool->m_Workers.empty() || count <= grain)
     {
-        for (uint32_t x = 0; x < width; ++x)
+        for (uint32_t begin = 0; begin < count; begin += grain)
         {
-            float m = getM(n, M, x, y);
-            data[0] = ditherBayerValue(data[0], m, r);
-            data[1] = ditherBayerValue(data[1], m, r);
-            data[2] = ditherBayerValue(data[2], m, r);
-            data[3] = ditherBayerValue(data[3], m, r);
-            data+=4;
+            fn(ctx, begin, count - begin < grain ? count : begin + grain);
         }
+        return;
     }
+
+    std::lock_guard<std::mutex> job_lock(pool->m_JobMutex);
+    {
+        std::lock_guard<std::mutex> lock(pool->m_Mutex);
+        pool->m_Fn = fn;
+        pool->m_Ctx = ctx;
+        pool->m_Count = count;
+        pool->m_Grain = grain;
+        pool->m_Next = 0;
+        pool->m_Busy = (uint32_t)pool->m_Workers.size();
+        pool->m_Generation++;
+    }
+    pool->m_WorkAvailable.notify_all();
+
+    threadPoolRunRanges(pool);
+
+    std::unique_lock<std::mutex> lock(pool->m_Mutex);
+    pool->m_WorkDone.wait(lock, [&] { return pool->m_Busy == 0; });
+}
+
+// Splits the rows of an image into bands that fit in the L2 cache (but enough of them to keep all threads busy)
+static uint32_t getRowBandSize(const ThreadPool* pool, uint32_t height, size_t row_bytes)
+{
+    const size_t band_bytes = 256 * 1024;
+    uint32_t rows = row_bytes ? (uint32_t)(band_bytes / row_bytes) : height;
+    uint32_t min_bands = threadPoolGetNumThreads(pool) * 4;
+    if (rows * min_bands > height)
+        rows = height / min_bands;
+    return rows ? rows : 1;
 }
 
+template<typename Fn>
+static void parallelForRowsTrampoline(void* ctx, uint32_t begin, uint32_t end)
+{
+    const Fn& fn = *(const Fn*)ctx;
+    fn(begin, end);
+}
+
+// Calls fn(y_begin, y_end) for bands of rows, in parallel
+template<typename Fn>
+static void parallelForRows(ThreadPool* pool, uint32_t height, size_t row_bytes, const Fn& fn)
+{
+    threadPoolParallelFor(pool, height, getRowBandSize(pool, height, row_bytes), parallelForRowsTrampoline<Fn>, (void*)&fn);
+}
 
 // #define BITS_PER_PIXEL 4
 // #define BPP_MUL (256 / ((1 << BITS_PER_PIXEL) - 1))
@@ -209,126 +345,1291 @@ static inline uint8_t addNoise(uint8_t v_in, int8_t noise)
 }
 
 
-static void ditherInterleavedGradientRGBA4444(uint8_t* data, uint32_t width, uint32_t height)
+static void ditherInterleavedGradientRGBA4444Row_Scalar(uint8_t* data, uint32_t x, uint32_t width, uint32_t y)
 {
     // Since we are going to convert this data to rgba4444 we the minimal value for a
     // color change is 2^8 / 2^4 = 16
     uint8_t bpp_mul = 16;
     uint8_t bpp_bias = bpp_mul / 2;
 
-    float oowidth = 1.0f / width;
-    float ooheight = 1.0f / height;
-    for (uint32_t y = 0; y < height; ++y)
+    data += x * 4;
+    for (; x < width; ++x)
     {
-        for (uint32_t x = 0; x < width; ++x)
+        float rnd = InterleavedGradientNoise(x, y);
+        data[0] = addNoise(data[0], rnd * bpp_mul - bpp_bias);
+        data[1] = addNoise(data[1], (1.0f - rnd) * bpp_mul - bpp_bias); // As seen in the shadertoy by Mikkel Gjoel
+        //data[1] = addNoise(data[1], rnd * bpp_mul - bpp_bias);
+        data[2] = addNoise(data[2], rnd * bpp_mul - bpp_bias);
+        data[3] = addNoise(data[3], rnd * bpp_mul - bpp_bias);
+        data+=4;
+    }
+}
+
+#if defined(DITHER_X86)
+
+// The vector kernels must match the scalar path bit for bit, so the noise is computed
+// with the exact same sequence of float operations (mul, mul, add, truncate, no fma),
+// and the noise is then applied to the bytes with saturating adds/subs.
+
+// Per pixel noise layout (r, g, b, a) = (n, 1-n, n, n), from the packed bytes [n0 n1 n2 n3 g0 g1 g2 g3]
+#define DITHER_SHUFFLE_RGBA_NOISE 0, 4, 0, 0, 1, 5, 1, 1, 2, 6, 2, 2, 3, 7, 3, 3
+
+DITHER_TARGET("sse4.1")
+static inline __m128 InterleavedGradientNoise_SSE41(__m128 u, __m128 v)
+{
+    __m128 f = _mm_add_ps(_mm_mul_ps(u, _mm_set1_ps(0.06711056f)), _mm_mul_ps(v, _mm_set1_ps(0.00583715f)));
+    f = _mm_sub_ps(f, _mm_cvtepi32_ps(_mm_cvttps_epi32(f)));
+    f = _mm_mul_ps(f, _mm_set1_ps(52.9829189f));
+    return _mm_sub_ps(f, _mm_cvtepi32_ps(_mm_cvttps_epi32(f)));
+}
+
+// Adds signed noise to unsigned bytes, clamping to [0,255]
+DITHER_TARGET("sse4.1")
+static inline __m128i addNoise_SSE41(__m128i v, __m128i noise)
+{
+    const __m128i zero = _mm_setzero_si128();
+    v = _mm_adds_epu8(v, _mm_max_epi8(noise, zero));
+    return _mm_subs_epu8(v, _mm_max_epi8(_mm_sub_epi8(zero, noise), zero));
+}
+
+DITHER_TARGET("sse4.1")
+static void ditherInterleavedGradientRGBA4444Row_SSE41(uint8_t* data, uint32_t width, uint32_t y)
+{
+    const __m128 mul = _mm_set1_ps(16.0f);
+    const __m128 bias = _mm_set1_ps(8.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128i shuffle = _mm_setr_epi8(DITHER_SHUFFLE_RGBA_NOISE);
+    const __m128 v = _mm_set1_ps((float)y);
+    __m128i xi = _mm_setr_epi32(0, 1, 2, 3);
+
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128 rnd = InterleavedGradientNoise_SSE41(_mm_cvtepi32_ps(xi), v);
+        __m128i n = _mm_cvttps_epi32(_mm_sub_ps(_mm_mul_ps(rnd, mul), bias));
+        __m128i g = _mm_cvttps_epi32(_mm_sub_ps(_mm_mul_ps(_mm_sub_ps(one, rnd), mul), bias));
+        __m128i noise = _mm_packs_epi32(n, g);
+        noise = _mm_shuffle_epi8(_mm_packs_epi16(noise, noise), shuffle);
+
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(data + x * 4));
+        _mm_storeu_si128((__m128i*)(data + x * 4), addNoise_SSE41(pixels, noise));
+        xi = _mm_add_epi32(xi, _mm_set1_epi32(4));
+    }
+    ditherInterleavedGradientRGBA4444Row_Scalar(data, x, width, y);
+}
+
+DITHER_TARGET("avx2")
+static inline __m256 InterleavedGradientNoise_AVX2(__m256 u, __m256 v)
+{
+    __m256 f = _mm256_add_ps(_mm256_mul_ps(u, _mm256_set1_ps(0.06711056f)), _mm256_mul_ps(v, _mm256_set1_ps(0.00583715f)));
+    f = _mm256_sub_ps(f, _mm256_cvtepi32_ps(_mm256_cvttps_epi32(f)));
+    f = _mm256_mul_ps(f, _mm256_set1_ps(52.9829189f));
+    return _mm256_sub_ps(f, _mm256_cvtepi32_ps(_mm256_cvttps_epi32(f)));
+}
+
+DITHER_TARGET("avx2")
+static inline __m256i addNoise_AVX2(__m256i v, __m256i noise)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    v = _mm256_adds_epu8(v, _mm256_max_epi8(noise, zero));
+    return _mm256_subs_epu8(v, _mm256_max_epi8(_mm256_sub_epi8(zero, noise), zero));
+}
+
+DITHER_TARGET("avx2")
+static void ditherInterleavedGradientRGBA4444Row_AVX2(uint8_t* data, uint32_t width, uint32_t y)
+{
+    const __m256 mul = _mm256_set1_ps(16.0f);
+    const __m256 bias = _mm256_set1_ps(8.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    // The packs and shuffles operate per 128 bit lane, so each lane ends up holding 4 consecutive pixels
+    const __m256i shuffle = _mm256_setr_epi8(DITHER_SHUFFLE_RGBA_NOISE, DITHER_SHUFFLE_RGBA_NOISE);
+    const __m256 v = _mm256_set1_ps((float)y);
+    __m256i xi = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256 rnd = InterleavedGradientNoise_AVX2(_mm256_cvtepi32_ps(xi), v);
+        __m256i n = _mm256_cvttps_epi32(_mm256_sub_ps(_mm256_mul_ps(rnd, mul), bias));
+        __m256i g = _mm256_cvttps_epi32(_mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(one, rnd), mul), bias));
+        __m256i noise = _mm256_packs_epi32(n, g);
+        noise = _mm256_shuffle_epi8(_mm256_packs_epi16(noise, noise), shuffle);
+
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(data + x * 4));
+        _mm256_storeu_si256((__m256i*)(data + x * 4), addNoise_AVX2(pixels, noise));
+        xi = _mm256_add_epi32(xi, _mm256_set1_epi32(8));
+    }
+    ditherInterleavedGradientRGBA4444Row_Scalar(data, x, width, y);
+}
+
+#endif // DITHER_X86
+
+enum CpuFeature
+{
+    CPU_FEATURE_SSE41 = 1,
+    CPU_FEATURE_AVX2  = 2,
+};
+
+static uint32_t detectCpuFeatures()
+{
+    uint32_t features = 0;
+#if defined(DITHER_X86)
+    #if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int max_leaf = info[0];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (info[2] & (1 << 19))
+            features |= CPU_FEATURE_SSE41;
+        if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
         {
-            float rnd = InterleavedGradientNoise(x, y);
-            data[0] = addNoise(data[0], rnd * bpp_mul - bpp_bias);
-            data[1] = addNoise(data[1], (1.0f - rnd) * bpp_mul - bpp_bias); // As seen in the shadertoy by Mikkel Gjoel
-            //data[1] = addNoise(data[1], rnd * bpp_mul - bpp_bias);
-            data[2] = addNoise(data[2], rnd * bpp_mul - bpp_bias);
-            data[3] = addNoise(data[3], rnd * bpp_mul - bpp_bias);
-            data+=4;
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5))
+                features |= CPU_FEATURE_AVX2;
         }
-    }
+    #else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1"))
+            features |= CPU_FEATURE_SSE41;
+        if (__builtin_cpu_supports("avx2"))
+            features |= CPU_FEATURE_AVX2;
+    #endif
+#endif
+    return features;
+}
+
+// Set DITHER_NO_SIMD=1 in the environment to force the scalar kernels (e.g. to compare outputs)
+static uint32_t computeCpuFeatures()
+{
+    const char* no_simd = getenv("DITHER_NO_SIMD");
+    return (no_simd && no_simd[0] == '1') ? 0 : detectCpuFeatures();
+}
+
+static uint32_t getCpuFeatures()
+{
+    // Initialized on the first call, which is thread safe since the kernels are picked from several threads
+    static const uint32_t features = computeCpuFeatures();
+    return features;
+}
+
+typedef void (*DitherRowFn)(uint8_t* data, uint32_t width, uint32_t y);
+
+static void ditherInterleavedGradientRGBA4444Row(uint8_t* data, uint32_t width, uint32_t y)
+{
+    ditherInterleavedGradientRGBA4444Row_Scalar(data, 0, width, y);
 }
 
-static void ditherInterleavedGradientRGBx565(uint8_t* data, uint32_t width, uint32_t height)
+static DitherRowFn getDitherInterleavedGradientRGBA4444Row()
+{
+#if defined(DITHER_X86)
+    uint32_t features = getCpuFeatures();
+    if (features & CPU_FEATURE_AVX2)
+        return ditherInterleavedGradientRGBA4444Row_AVX2;
+    if (features & CPU_FEATURE_SSE41)
+        return ditherInterleavedGradientRGBA4444Row_SSE41;
+#endif
+    return ditherInterleavedGradientRGBA4444Row;
+}
+
+// Fused dither + pack: reads interleaved RGB8/RGBA8 once and writes the dithered RGB565 directly.
+// Produces the same result as adding the noise in 8 bit steps of the 5/6/5 bit channels, followed by RGBA8888ToRGB565()
+static void ditherPackInterleavedGradientRGB565Row_Scalar(const uint8_t* src, uint32_t numchannels, uint16_t* dst, uint32_t x, uint32_t width, uint32_t y)
 {
-    // Since we are going to convert this data to rgba4444 we the minimal value for a color change is
     uint8_t bpp_mul_5 = 8; // (1<<8)/(1<<5)
     uint8_t bpp_bias_5 = bpp_mul_5 / 2;
     uint8_t bpp_mul_6 = 4; // (1<<8)/(1<<6)
     uint8_t bpp_bias_6 = bpp_mul_6 / 2;
 
-    float oowidth = 1.0f / width;
-    float ooheight = 1.0f / height;
-    for (uint32_t y = 0; y < height; ++y)
+    src += x * numchannels;
+    for (; x < width; ++x)
     {
-        for (uint32_t x = 0; x < width; ++x)
+        float rnd = InterleavedGradientNoise(x, y);
+        uint8_t red = addNoise(src[0], rnd * bpp_mul_5 - bpp_bias_5);
+        uint8_t green = addNoise(src[1], (1.0f - rnd) * bpp_mul_6 - bpp_bias_6);
+        uint8_t blue = addNoise(src[2], rnd * bpp_mul_5 - bpp_bias_5);
+        uint16_t r = ((red >> 3) & 0x1f) << 11;
+        uint16_t g = ((green >> 2) & 0x3f) << 5;
+        uint16_t b = ((blue >> 3) & 0x1f);
+        dst[x] = (r | g | b);
+        src += numchannels;
+    }
+}
+
+#if defined(DITHER_X86)
+
+// Per pixel noise layout (r, g, b, a) = (n5, n6, n5, 0), from the packed bytes [n0 n1 n2 n3 g0 g1 g2 g3]
+#define DITHER_SHUFFLE_RGBX_NOISE 0, 4, 0, -1, 1, 5, 1, -1, 2, 6, 2, -1, 3, 7, 3, -1
+// Expands 4 RGB pixels (12 bytes) to RGBx
+#define DITHER_SHUFFLE_RGB_TO_RGBX 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+
+DITHER_TARGET("sse4.1")
+static inline __m128i packRGBX8888ToRGB565_SSE41(__m128i p)
+{
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xF8)), 8);
+    __m128i g = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xFC00)), 5);
+    __m128i b = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xF80000)), 19);
+    return _mm_or_si128(_mm_or_si128(r, g), b); // 4 x 565 in the low 16 bits of each 32 bit word
+}
+
+DITHER_TARGET("sse4.1")
+static void ditherPackInterleavedGradientRGB565Row_SSE41(const uint8_t* src, uint32_t numchannels, uint16_t* dst, uint32_t width, uint32_t y)
+{
+    const __m128 mul5 = _mm_set1_ps(8.0f);
+    const __m128 bias5 = _mm_set1_ps(4.0f);
+    const __m128 mul6 = _mm_set1_ps(4.0f);
+    const __m128 bias6 = _mm_set1_ps(2.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128i shuffle = _mm_setr_epi8(DITHER_SHUFFLE_RGBX_NOISE);
+    const __m128i expand = _mm_setr_epi8(DITHER_SHUFFLE_RGB_TO_RGBX);
+    const __m128 v = _mm_set1_ps((float)y);
+    __m128i xi = _mm_setr_epi32(0, 1, 2, 3);
+
+    // With 3 channels we load 16 bytes but only use 12, so stay clear of the end of the row
+    uint32_t end = numchannels == 4 ? width : (width >= 2 ? width - 2 : 0);
+
+    uint32_t x = 0;
+    for (; x + 4 <= end; x += 4)
+    {
+        __m128 rnd = InterleavedGradientNoise_SSE41(_mm_cvtepi32_ps(xi), v);
+        __m128i n = _mm_cvttps_epi32(_mm_sub_ps(_mm_mul_ps(rnd, mul5), bias5));
+        __m128i g = _mm_cvttps_epi32(_mm_sub_ps(_mm_mul_ps(_mm_sub_ps(one, rnd), mul6), bias6));
+        __m128i noise = _mm_packs_epi32(n, g);
+        noise = _mm_shuffle_epi8(_mm_packs_epi16(noise, noise), shuffle);
+
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + x * numchannels));
+        if (numchannels == 3)
+            pixels = _mm_shuffle_epi8(pixels, expand);
+        __m128i packed = packRGBX8888ToRGB565_SSE41(addNoise_SSE41(pixels, noise));
+        _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi32(packed, packed));
+        xi = _mm_add_epi32(xi, _mm_set1_epi32(4));
+    }
+    ditherPackInterleavedGradientRGB565Row_Scalar(src, numchannels, dst, x, width, y);
+}
+
+DITHER_TARGET("avx2")
+static inline __m256i packRGBX8888ToRGB565_AVX2(__m256i p)
+{
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xF8)), 8);
+    __m256i g = _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xFC00)), 5);
+    __m256i b = _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xF80000)), 19);
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+DITHER_TARGET("avx2")
+static void ditherPackInterleavedGradientRGB565Row_AVX2(const uint8_t* src, uint32_t numchannels, uint16_t* dst, uint32_t width, uint32_t y)
+{
+    const __m256 mul5 = _mm256_set1_ps(8.0f);
+    const __m256 bias5 = _mm256_set1_ps(4.0f);
+    const __m256 mul6 = _mm256_set1_ps(4.0f);
+    const __m256 bias6 = _mm256_set1_ps(2.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i shuffle = _mm256_setr_epi8(DITHER_SHUFFLE_RGBX_NOISE, DITHER_SHUFFLE_RGBX_NOISE);
+    const __m256i expand = _mm256_setr_epi8(DITHER_SHUFFLE_RGB_TO_RGBX, DITHER_SHUFFLE_RGB_TO_RGBX);
+    const __m256 v = _mm256_set1_ps((float)y);
+    __m256i xi = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // With 3 channels the upper lane is loaded from byte 12 and reads 4 bytes past the 8 pixels
+    uint32_t end = numchannels == 4 ? width : (width >= 2 ? width - 2 : 0);
+
+    uint32_t x = 0;
+    for (; x + 8 <= end; x += 8)
+    {
+        __m256 rnd = InterleavedGradientNoise_AVX2(_mm256_cvtepi32_ps(xi), v);
+        __m256i n = _mm256_cvttps_epi32(_mm256_sub_ps(_mm256_mul_ps(rnd, mul5), bias5));
+        __m256i g = _mm256_cvttps_epi32(_mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(one, rnd), mul6), bias6));
+        __m256i noise = _mm256_packs_epi32(n, g);
+        noise = _mm256_shuffle_epi8(_mm256_packs_epi16(noise, noise), shuffle);
+
+        __m256i pixels;
+        if (numchannels == 3)
+        {
+            const uint8_t* p = src + x * 3;
+            pixels = _mm256_set_m128i(_mm_loadu_si128((const __m128i*)(p + 12)), _mm_loadu_si128((const __m128i*)p));
+            pixels = _mm256_shuffle_epi8(pixels, expand);
+        }
+        else
+        {
+            pixels = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+        }
+        __m256i packed = packRGBX8888ToRGB565_AVX2(addNoise_AVX2(pixels, noise));
+        // packus works per lane: [p0..p3 p0..p3 | p4..p7 p4..p7] -> select qwords 0 and 2
+        packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(packed, packed), 0x08);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm256_castsi256_si128(packed));
+        xi = _mm256_add_epi32(xi, _mm256_set1_epi32(8));
+    }
+    ditherPackInterleavedGradientRGB565Row_Scalar(src, numchannels, dst, x, width, y);
+}
+
+#endif // DITHER_X86
+
+typedef void (*DitherPackRowFn)(const uint8_t* src, uint32_t numchannels, uint16_t* dst, uint32_t width, uint32_t y);
+
+static void ditherPackInterleavedGradientRGB565Row(const uint8_t* src, uint32_t numchannels, uint16_t* dst, uint32_t width, uint32_t y)
+{
+    ditherPackInterleavedGradientRGB565Row_Scalar(src, numchannels, dst, 0, width, y);
+}
+
+static DitherPackRowFn getDitherPackInterleavedGradientRGB565Row()
+{
+#if defined(DITHER_X86)
+    uint32_t features = getCpuFeatures();
+    if (features & CPU_FEATURE_AVX2)
+        return ditherPackInterleavedGradientRGB565Row_AVX2;
+    if (features & CPU_FEATURE_SSE41)
+        return ditherPackInterleavedGradientRGB565Row_SSE41;
+#endif
+    return ditherPackInterleavedGradientRGB565Row;
+}
+
+// src is RGB8 or RGBA8 (numchannels 3 or 4) and starts at row y_begin, dst is the whole RGB565 image
+static void ditherPackInterleavedGradientRGB565(ThreadPool* pool, const uint8_t* src, uint32_t src_stride, uint32_t numchannels, uint32_t width,
+                                                uint32_t y_begin, uint32_t y_end, uint16_t* dst)
+{
+    DitherPackRowFn row_fn = getDitherPackInterleavedGradientRGB565Row();
+    parallelForRows(pool, y_end - y_begin, width * (numchannels + 2), [=](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            uint32_t y = y_begin + i;
+            row_fn(src + (size_t)i * src_stride, numchannels, dst + (size_t)y * width, width, y);
+        }
+    });
+}
+
+
+// *****************************************************************************************************
+// Blue noise threshold maps
+//
+// Generated with the void-and-cluster method:
+// Robert Ulichney, "The void-and-cluster method for dither array generation", 1993
+// http://cv.ulichney.com/papers/1993-void-cluster.pdf
+// https://blog.demofox.org/2019/06/25/generating-blue-noise-textures-with-void-and-cluster/
+//
+// The tiles are toroidal, so they can be repeated over the image. Since generating a 256x256 tile
+// takes a while, the ranks are stored in the cache directory (if any) and reused by later runs.
+
+#define BLUE_NOISE_SIGMA        1.5f
+#define BLUE_NOISE_RADIUS       6       // the gaussian is ~0 beyond 4 sigma
+#define BLUE_NOISE_FILE_VERSION 1
+
+// The energy field of the current binary pattern, with a cache of the tightest cluster (max energy of a 1)
+// and the largest void (min energy of a 0) per row, so only the rows touched by an update are rescanned.
+struct BlueNoiseField
+{
+    uint32_t    n;
+    float*      energy;
+    uint8_t*    pattern;
+    uint32_t*   row_cluster;    // index of the max energy 1 in each row, or ~0u
+    uint32_t*   row_void;       // index of the min energy 0 in each row, or ~0u
+    float       kernel[(2*BLUE_NOISE_RADIUS+1) * (2*BLUE_NOISE_RADIUS+1)];
+};
+
+static void blueNoiseUpdateRow(BlueNoiseField* field, uint32_t y)
+{
+    const uint32_t n = field->n;
+    uint32_t cluster = ~0u;
+    uint32_t hole = ~0u;
+    for (uint32_t i = y * n; i < (y + 1) * n; ++i)
+    {
+        if (field->pattern[i])
+        {
+            if (cluster == ~0u || field->energy[i] > field->energy[cluster])
+                cluster = i;
+        }
+        else
+        {
+            if (hole == ~0u || field->energy[i] < field->energy[hole])
+                hole = i;
+        }
+    }
+    field->row_cluster[y] = cluster;
+    field->row_void[y] = hole;
+}
+
+static void blueNoiseSet(BlueNoiseField* field, uint32_t index, uint8_t value)
+{
+    const uint32_t n = field->n;
+    const int r = BLUE_NOISE_RADIUS;
+    const float sign = value ? 1.0f : -1.0f;
+    field->pattern[index] = value;
+
+    int px = (int)(index % n);
+    int py = (int)(index / n);
+    for (int dy = -r; dy <= r; ++dy)
+    {
+        uint32_t y = (uint32_t)(py + dy + (int)n) % n;
+        float* row = field->energy + y * n;
+        const float* k = field->kernel + (dy + r) * (2*r+1);
+        for (int dx = -r; dx <= r; ++dx)
         {
-            float rnd = InterleavedGradientNoise(x, y);
-            data[0] = addNoise(data[0], rnd * bpp_mul_5 - bpp_bias_5);
-            data[1] = addNoise(data[1], (1.0f - rnd) * bpp_mul_6 - bpp_bias_6); // As seen in the shadertoy by Mikkel Gjoel
-            //data[1] = addNoise(data[1], rnd * bpp_mul - bpp_bias);
-            data[2] = addNoise(data[2], rnd * bpp_mul_5 - bpp_bias_5);
-            // the
-            data+=4;
+            row[(uint32_t)(px + dx + (int)n) % n] += sign * k[dx + r];
         }
     }
+    for (int dy = -r; dy <= r; ++dy)
+    {
+        blueNoiseUpdateRow(field, (uint32_t)(py + dy + (int)n) % n);
+    }
 }
 
+static uint32_t blueNoiseFindCluster(const BlueNoiseField* field)
+{
+    uint32_t best = ~0u;
+    for (uint32_t y = 0; y < field->n; ++y)
+    {
+        uint32_t i = field->row_cluster[y];
+        if (i != ~0u && (best == ~0u || field->energy[i] > field->energy[best]))
+            best = i;
+    }
+    return best;
+}
 
-int main(int argc, char const *argv[])
+static uint32_t blueNoiseFindVoid(const BlueNoiseField* field)
 {
-    const char* path = 0;
-    if (argc > 1)
+    uint32_t best = ~0u;
+    for (uint32_t y = 0; y < field->n; ++y)
     {
-        path = argv[1];
+        uint32_t i = field->row_void[y];
+        if (i != ~0u && (best == ~0u || field->energy[i] < field->energy[best]))
+            best = i;
     }
+    return best;
+}
 
-    if (!path) {
-        fprintf(stderr, "You must supply an image path");
-        return 1;
+static void blueNoiseInitField(BlueNoiseField* field, uint32_t n)
+{
+    field->n = n;
+    field->energy = (float*)calloc(n * n, sizeof(float));
+    field->pattern = (uint8_t*)calloc(n * n, 1);
+    field->row_cluster = (uint32_t*)malloc(n * sizeof(uint32_t));
+    field->row_void = (uint32_t*)malloc(n * sizeof(uint32_t));
+    const int r = BLUE_NOISE_RADIUS;
+    for (int dy = -r; dy <= r; ++dy)
+    {
+        for (int dx = -r; dx <= r; ++dx)
+        {
+            field->kernel[(dy + r) * (2*r+1) + (dx + r)] = expf(-(float)(dx*dx + dy*dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+    for (uint32_t y = 0; y < n; ++y)
+    {
+        blueNoiseUpdateRow(field, y);
     }
+}
 
-    int width, height, numchannels;
-    uint8_t* image_input = stbi_load(path, &width, &height, &numchannels, 0);
-    if (!image_input) {
-        fprintf(stderr, "Failed to load '%s'", path);
-        return 1;
+static void blueNoiseFreeField(BlueNoiseField* field)
+{
+    free(field->energy);
+    free(field->pattern);
+    free(field->row_cluster);
+    free(field->row_void);
+}
+
+// Computes the rank (in [0, n*n)) of each pixel of an n x n tile
+static void computeBlueNoiseRankMap(uint32_t n, uint32_t* ranks)
+{
+    const uint32_t count = n * n;
+    BlueNoiseField field;
+    blueNoiseInitField(&field, n);
+
+    // Initial binary pattern: ~10% randomly placed points (fixed seed, so the tiles are reproducible)
+    uint32_t seed = 0x9E3779B9u;
+    uint32_t num_ones = count / 10;
+    for (uint32_t i = 0; i < num_ones;)
+    {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; // xorshift32
+        uint32_t index = seed % count;
+        if (!field.pattern[index])
+        {
+            blueNoiseSet(&field, index, 1);
+            ++i;
+        }
     }
 
-    // int N = 8;
-    // float* M = (float*)malloc(sizeof(float) * N * N);
+    // Move the point in the tightest cluster to the largest void, until that doesn't change anything
+    while (true)
+    {
+        uint32_t cluster = blueNoiseFindCluster(&field);
+        blueNoiseSet(&field, cluster, 0);
+        uint32_t hole = blueNoiseFindVoid(&field);
+        blueNoiseSet(&field, hole, 1);
+        if (hole == cluster)
+            break;
+    }
 
-    // computeBayerThresholdMap(N, M);
+    uint8_t* prototype = (uint8_t*)malloc(count);
+    float* prototype_energy = (float*)malloc(count * sizeof(float));
+    memcpy(prototype, field.pattern, count);
+    memcpy(prototype_energy, field.energy, count * sizeof(float));
 
-    // printf("M:\n");
-    // printM(N, M);
+    // Phase 1: remove the tightest clusters from the prototype, ranking them from num_ones-1 down to 0
+    for (uint32_t rank = num_ones; rank-- > 0;)
+    {
+        uint32_t cluster = blueNoiseFindCluster(&field);
+        blueNoiseSet(&field, cluster, 0);
+        ranks[cluster] = rank;
+    }
 
-    //ditherBayer(image_input, width, height, N, M);
+    // Phase 2 and 3: fill the largest voids of the prototype, ranking them from num_ones up to count-1
+    // (the tightest cluster of 0s is the 0 with the lowest energy, so the last phase is the same loop)
+    memcpy(field.pattern, prototype, count);
+    memcpy(field.energy, prototype_energy, count * sizeof(float));
+    for (uint32_t y = 0; y < n; ++y)
+    {
+        blueNoiseUpdateRow(&field, y);
+    }
+    for (uint32_t rank = num_ones; rank < count; ++rank)
+    {
+        uint32_t hole = blueNoiseFindVoid(&field);
+        blueNoiseSet(&field, hole, 1);
+        ranks[hole] = rank;
+    }
 
-    uint8_t* image_output_16bit = (uint8_t*)malloc(width*height*2);
-    uint8_t* image_output_32bit = (uint8_t*)malloc(width*height*4);
+    free(prototype);
+    free(prototype_energy);
+    blueNoiseFreeField(&field);
+}
 
+static bool loadBlueNoiseRankMap(const char* path, uint32_t n, uint32_t* ranks)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+    uint32_t header[3];
+    uint16_t* data = (uint16_t*)malloc((size_t)n * n * sizeof(uint16_t));
+    bool ok = fread(header, sizeof(header), 1, f) == 1 && fread(data, (size_t)n * n * sizeof(uint16_t), 1, f) == 1 && fgetc(f) == EOF;
+    ok = ok && header[0] == 0x45534F4E && header[1] == BLUE_NOISE_FILE_VERSION && header[2] == n; // 'NOSE'
+    for (uint32_t i = 0; ok && i < n * n; ++i)
+    {
+        ranks[i] = data[i];
+        ok = data[i] < n * n;
+    }
+    free(data);
+    fclose(f);
+    return ok;
+}
+
+static void saveBlueNoiseRankMap(const char* path, uint32_t n, const uint32_t* ranks)
+{
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp%llx", path, (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f)
+        return;
+    uint32_t header[3] = { 0x45534F4E, BLUE_NOISE_FILE_VERSION, n };
+    uint16_t* data = (uint16_t*)malloc((size_t)n * n * sizeof(uint16_t));
+    for (uint32_t i = 0; i < n * n; ++i)
+    {
+        data[i] = (uint16_t)ranks[i];
+    }
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(data, (size_t)n * n * sizeof(uint16_t), 1, f) == 1;
+    free(data);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+        remove(tmp_path); // on Windows rename also fails if another thread saved the map first, which is fine
+}
+
+// Thresholds in the range [-0.5, 0.5). n is a power of two from 64 to 256 (the ranks are stored as 16 bit)
+static void computeBlueNoiseThresholdMap(uint32_t n, float* M, const char* cache_dir)
+{
+    uint32_t* ranks = (uint32_t*)malloc(sizeof(uint32_t) * n * n);
+    char path[1024] = {0};
+    if (cache_dir)
+        snprintf(path, sizeof(path), "%s/bluenoise_%u.bin", cache_dir, n);
+    if (!path[0] || !loadBlueNoiseRankMap(path, n, ranks))
+    {
+        computeBlueNoiseRankMap(n, ranks);
+        if (path[0])
+            saveBlueNoiseRankMap(path, n, ranks);
+    }
+    float div = 1.0f / (n*n);
+    for (uint32_t i = 0; i < n*n; ++i)
+    {
+        M[i] = (ranks[i] + 0.5f) * div - 0.5f;
+    }
+    free(ranks);
+}
+
+// *****************************************************************************************************
+// Ordered dithering (Bayer and blue noise threshold maps)
+//
+// The threshold map is pre-scaled to integer offsets for the bit depth of each channel, so the
+// kernel is a table lookup and a saturating add per channel.
+// https://en.wikipedia.org/wiki/Ordered_dithering
+
+enum ThresholdMapType
+{
+    THRESHOLD_MAP_BAYER,
+    THRESHOLD_MAP_BLUE_NOISE,
+};
+
+struct ThresholdTable
+{
+    ThresholdMapType type;
+    uint32_t    n;          // power of two
+    uint8_t     bits[4];    // target bits per channel (r, g, b, a)
+    int8_t*     offsets;    // n*n pixels with 4 interleaved channel offsets each
+};
+
+static ThresholdTable* createThresholdTable(ThresholdMapType type, uint32_t n, const uint8_t bits[4], const char* cache_dir)
+{
+    ThresholdTable* table = new ThresholdTable;
+    table->type = type;
+    table->n = n;
+    memcpy(table->bits, bits, sizeof(table->bits));
+    table->offsets = (int8_t*)malloc(n * n * 4);
+
+    float* M = (float*)malloc(sizeof(float) * n * n);
+    if (type == THRESHOLD_MAP_BLUE_NOISE)
+        computeBlueNoiseThresholdMap(n, M, cache_dir);
+    else
+        computeBayerThresholdMap(n, M);
+    for (uint32_t i = 0; i < n * n; ++i)
+    {
+        for (uint32_t c = 0; c < 4; ++c)
+        {
+            // The quantization step of the channel is 2^8 / 2^bits
+            float step = bits[c] < 8 ? (float)(256 >> bits[c]) : 0.0f;
+            table->offsets[i * 4 + c] = (int8_t)roundf(M[i] * step);
+        }
+    }
+    free(M);
+    return table;
+}
+
+// The tables are created on first use and kept for the lifetime of the process
+static const ThresholdTable* getThresholdTable(ThresholdMapType type, uint32_t n, const uint8_t bits[4], const char* cache_dir)
+{
+    static std::mutex mutex;
+    static std::vector<ThresholdTable*> tables;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < tables.size(); ++i)
+    {
+        if (tables[i]->type == type && tables[i]->n == n && memcmp(tables[i]->bits, bits, sizeof(tables[i]->bits)) == 0)
+            return tables[i];
+    }
+    tables.push_back(createThresholdTable(type, n, bits, cache_dir));
+    return tables.back();
+}
+
+static void ditherOrderedRow_Scalar(uint8_t* data, uint32_t numchannels, uint32_t x, uint32_t width, uint32_t y, const ThresholdTable* table)
+{
+    const uint32_t mask = table->n - 1;
+    const int8_t* row = table->offsets + (size_t)(y & mask) * table->n * 4;
+
+    data += x * numchannels;
+    for (; x < width; ++x)
+    {
+        const int8_t* t = row + (x & mask) * 4;
+        for (uint32_t c = 0; c < numchannels; ++c)
+        {
+            data[c] = addNoise(data[c], t[c]);
+        }
+        data += numchannels;
+    }
+}
+
+#if defined(DITHER_X86)
+
+DITHER_TARGET("sse4.1")
+static void ditherOrderedRow_SSE41(uint8_t* data, uint32_t numchannels, uint32_t width, uint32_t y, const ThresholdTable* table)
+{
+    uint32_t x = 0;
+    // The offsets of 4 consecutive pixels are contiguous in the table since n is a multiple of 4
+    if (numchannels == 4 && table->n >= 4)
+    {
+        const uint32_t mask = table->n - 1;
+        const int8_t* row = table->offsets + (size_t)(y & mask) * table->n * 4;
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i offsets = _mm_loadu_si128((const __m128i*)(row + (x & mask) * 4));
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(data + x * 4));
+            _mm_storeu_si128((__m128i*)(data + x * 4), addNoise_SSE41(pixels, offsets));
+        }
+    }
+    ditherOrderedRow_Scalar(data, numchannels, x, width, y, table);
+}
+
+DITHER_TARGET("avx2")
+static void ditherOrderedRow_AVX2(uint8_t* data, uint32_t numchannels, uint32_t width, uint32_t y, const ThresholdTable* table)
+{
+    if (table->n < 8)
+    {
+        ditherOrderedRow_SSE41(data, numchannels, width, y, table);
+        return;
+    }
+    uint32_t x = 0;
     if (numchannels == 4)
     {
-        ditherInterleavedGradientRGBA4444(image_input, width, height);
+        const uint32_t mask = table->n - 1;
+        const int8_t* row = table->offsets + (size_t)(y & mask) * table->n * 4;
+        for (; x + 8 <= width; x += 8)
+        {
+            __m256i offsets = _mm256_loadu_si256((const __m256i*)(row + (x & mask) * 4));
+            __m256i pixels = _mm256_loadu_si256((const __m256i*)(data + x * 4));
+            _mm256_storeu_si256((__m256i*)(data + x * 4), addNoise_AVX2(pixels, offsets));
+        }
+    }
+    ditherOrderedRow_Scalar(data, numchannels, x, width, y, table);
+}
+
+#endif // DITHER_X86
+
+typedef void (*DitherOrderedRowFn)(uint8_t* data, uint32_t numchannels, uint32_t width, uint32_t y, const ThresholdTable* table);
+
+static void ditherOrderedRow(uint8_t* data, uint32_t numchannels, uint32_t width, uint32_t y, const ThresholdTable* table)
+{
+    ditherOrderedRow_Scalar(data, numchannels, 0, width, y, table);
+}
+
+static DitherOrderedRowFn getDitherOrderedRow()
+{
+#if defined(DITHER_X86)
+    uint32_t features = getCpuFeatures();
+    if (features & CPU_FEATURE_AVX2)
+        return ditherOrderedRow_AVX2;
+    if (features & CPU_FEATURE_SSE41)
+        return ditherOrderedRow_SSE41;
+#endif
+    return ditherOrderedRow;
+}
+
+// *****************************************************************************************************
+// Error diffusion
+//
+// Error diffusion is serial by nature, but a pixel only depends on the pixels to its left and on the
+// rows above up to `max_dx` pixels to its right. So the rows are processed as a diagonal wavefront:
+// each row runs on its own thread, lagging behind the row above by a few pixels.
+//
+// The lag is 2*max_dx+1 pixels rather than max_dx+1, so that two rows never add error to the same
+// pixel of a row below at the same time. The errors are integers (scaled by the kernel divisor), so
+// the result doesn't depend on the order of the additions, i.e. it's deterministic.
+//
+// The accumulated errors are kept in a ring of a few rows: one per active row plus the rows below it.
+// https://tannerhelland.com/2012/12/28/dithering-eleven-algorithms-source-code.html
+
+struct DiffusionTap
+{
+    int8_t  dx;
+    int8_t  dy;
+    uint8_t weight;
+};
+
+struct DiffusionKernel
+{
+    int32_t             divisor;
+    int32_t             max_dx;
+    int32_t             max_dy;
+    uint32_t            num_taps;
+    DiffusionTap        taps[12];
+};
+
+static const DiffusionKernel g_FloydSteinberg = { 16, 1, 1, 4, {
+                                                            {1,0,7},
+                                        {-1,1,3}, {0,1,5}, {1,1,1} } };
+
+static const DiffusionKernel g_JarvisJudiceNinke = { 48, 2, 2, 12, {
+                                                            {1,0,7}, {2,0,5},
+                              {-2,1,3}, {-1,1,5}, {0,1,7}, {1,1,5}, {2,1,3},
+                              {-2,2,1}, {-1,2,3}, {0,2,5}, {1,2,3}, {2,2,1} } };
+
+static const DiffusionKernel g_Stucki = { 42, 2, 2, 12, {
+                                                            {1,0,8}, {2,0,4},
+                              {-2,1,2}, {-1,1,4}, {0,1,8}, {1,1,4}, {2,1,2},
+                              {-2,2,1}, {-1,2,2}, {0,2,4}, {1,2,2}, {2,2,1} } };
+
+static const DiffusionKernel g_Sierra = { 32, 2, 2, 10, {
+                                                            {1,0,5}, {2,0,3},
+                              {-2,1,2}, {-1,1,4}, {0,1,5}, {1,1,4}, {2,1,2},
+                                        {-1,2,2}, {0,2,3}, {1,2,2} } };
+
+struct ErrorDiffusionJob
+{
+    const DiffusionKernel*  kernel;
+    const uint8_t*          src;            // starts at row src_row
+    uint32_t                src_row;
+    uint32_t                src_stride;
+    uint16_t*               dst;
+    uint32_t                numchannels;
+    uint32_t                width;
+    uint32_t                height;
+    uint8_t                 bits[4];        // target bits per channel, 0 means the channel is dropped
+    uint32_t                shifts[4];      // bit position of each channel in the packed 16 bit pixel
+    uint32_t                ring_size;      // number of error rows
+    uint32_t                ring_stride;    // int32 per error row
+    int32_t*                errors;         // ring_size rows of (width + 2*max_dx) pixels * 4 channels
+    uint32_t                lag;
+    std::atomic<uint32_t>   next_row;
+    uint32_t                end_row;        // the rows before it are available in src
+    std::atomic<uint32_t>*  progress;       // number of finished pixels per row
+};
+
+static inline int32_t roundedDivide(int32_t v, int32_t d)
+{
+    return v >= 0 ? (v + d / 2) / d : -((-v + d / 2) / d);
+}
+
+static void errorDiffusionRow(ErrorDiffusionJob* job, uint32_t y)
+{
+    const DiffusionKernel* kernel = job->kernel;
+    const uint32_t width = job->width;
+    const uint32_t numchannels = job->numchannels;
+    const uint32_t publish_interval = 16;
+    const uint8_t* src = job->src + (size_t)(y - job->src_row) * job->src_stride;
+    uint16_t* dst = job->dst + (size_t)y * width;
+
+    int32_t* rows[3];
+    for (int32_t dy = 0; dy <= kernel->max_dy; ++dy)
+    {
+        rows[dy] = job->errors + (size_t)((y + dy) % job->ring_size) * job->ring_stride + kernel->max_dx * 4;
+    }
+
+    uint32_t max_q[4];
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+        max_q[c] = (1u << job->bits[c]) - 1;
+    }
+
+    // How far the row above has come
+    uint32_t above = y > 0 ? job->progress[y-1].load(std::memory_order_acquire) : width;
+
+    for (uint32_t x = 0; x < width; ++x)
+    {
+        if (above < width && x + job->lag > above)
+        {
+            job->progress[y].store(x, std::memory_order_release);
+            do
+            {
+                std::this_thread::yield();
+                above = job->progress[y-1].load(std::memory_order_acquire);
+            } while (above < width && x + job->lag > above);
+        }
+
+        int32_t* acc = rows[0] + x * 4;
+        uint16_t packed = 0;
+        for (uint32_t c = 0; c < numchannels; ++c)
+        {
+            if (job->bits[c] == 0)
+                continue;
+            int32_t v = (int32_t)src[c] + roundedDivide(acc[c], kernel->divisor);
+            v = v < 0 ? 0 : (v > 255 ? 255 : v);
+            // Quantize to the nearest level, and reconstruct the value like the 8888 expansion does
+            uint32_t q = ((uint32_t)v * max_q[c] + 127) / 255;
+            int32_t reconstructed = (int32_t)((q * 255 + max_q[c] / 2) / max_q[c]);
+            int32_t error = v - reconstructed;
+            packed |= (uint16_t)(q << job->shifts[c]);
+
+            for (uint32_t t = 0; t < kernel->num_taps; ++t)
+            {
+                const DiffusionTap& tap = kernel->taps[t];
+                rows[tap.dy][((int32_t)x + tap.dx) * 4 + (int32_t)c] += error * tap.weight;
+            }
+        }
+        // With 3 channels the alpha of a 4444 target is opaque
+        if (numchannels == 3 && job->bits[3])
+            packed |= (uint16_t)(max_q[3] << job->shifts[3]);
+        dst[x] = packed;
+        src += numchannels;
+
+        if ((x % publish_interval) == publish_interval - 1)
+            job->progress[y].store(x + 1, std::memory_order_release);
+    }
+
+    // This row of errors is now consumed, and is reused for row y + ring_size
+    memset(rows[0] - kernel->max_dx * 4, 0, job->ring_stride * sizeof(int32_t));
+    job->progress[y].store(width, std::memory_order_release);
+}
+
+static void errorDiffusionWorker(void* ctx, uint32_t begin, uint32_t end)
+{
+    (void)begin; (void)end;
+    ErrorDiffusionJob* job = (ErrorDiffusionJob*)ctx;
+    // The rows are taken in order, one at a time. So when a thread takes row y, all rows before
+    // y - num_threads are finished, and their error rows are free to be reused.
+    uint32_t y;
+    while ((y = job->next_row.fetch_add(1)) < job->end_row)
+    {
+        errorDiffusionRow(job, y);
+    }
+}
+
+// Sets up the error diffusion of an RGB8/RGBA8 image into the packed 16 bit pixels. Returns 0 when out of memory.
+// bits are the target bits per channel, from the most significant bits (e.g. 5,6,5,0 or 4,4,4,4)
+static ErrorDiffusionJob* errorDiffusionBegin(ThreadPool* pool, const DiffusionKernel* kernel, uint32_t numchannels,
+                                                uint32_t width, uint32_t height, const uint8_t bits[4], uint16_t* dst)
+{
+    const uint32_t num_threads = threadPoolGetNumThreads(pool);
+
+    ErrorDiffusionJob* job = new ErrorDiffusionJob;
+    job->kernel = kernel;
+    job->src = 0;
+    job->src_row = 0;
+    job->src_stride = 0;
+    job->dst = dst;
+    job->numchannels = numchannels;
+    job->width = width;
+    job->height = height;
+    uint32_t shift = 16;
+    for (uint32_t c = 0; c < 4; ++c)
+    {
+        job->bits[c] = bits[c];
+        shift -= bits[c];
+        job->shifts[c] = shift;
+    }
+    job->ring_size = num_threads + kernel->max_dy + 1;
+    job->ring_stride = (width + 2 * kernel->max_dx) * 4;
+    job->errors = (int32_t*)calloc((size_t)job->ring_size * job->ring_stride, sizeof(int32_t));
+    job->lag = 2 * kernel->max_dx + 1;
+    job->next_row = 0;
+    job->end_row = 0;
+    job->progress = new std::atomic<uint32_t>[height];
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        job->progress[y] = 0;
+    }
+    if (!job->errors)
+    {
+        delete[] job->progress;
+        delete job;
+        return 0;
+    }
+    return job;
+}
+
+// Diffuses the next rows, up to y_end. src starts at the first of them.
+// The error rows of the rows below are kept, so the result is the same as doing all rows at once.
+static void errorDiffusionRows(ThreadPool* pool, ErrorDiffusionJob* job, const uint8_t* src, uint32_t src_stride, uint32_t y_end)
+{
+    job->src = src;
+    job->src_row = job->end_row;
+    job->src_stride = src_stride;
+    job->end_row = y_end;
+
+    threadPoolParallelFor(pool, threadPoolGetNumThreads(pool), 1, errorDiffusionWorker, job);
+
+    // Each thread took one row past the end before it stopped
+    job->next_row = y_end;
+}
+
+static void errorDiffusionEnd(ErrorDiffusionJob* job)
+{
+    delete[] job->progress;
+    free(job->errors);
+    delete job;
+}
+
+
+// *****************************************************************************************************
+// Public api
+
+static const DiffusionKernel* getDiffusionKernel(dither_mode mode)
+{
+    switch (mode)
+    {
+    case DITHER_MODE_FLOYD_STEINBERG:       return &g_FloydSteinberg;
+    case DITHER_MODE_JARVIS_JUDICE_NINKE:   return &g_JarvisJudiceNinke;
+    case DITHER_MODE_STUCKI:                return &g_Stucki;
+    case DITHER_MODE_SIERRA:                return &g_Sierra;
+    default:                                return 0;
+    }
+}
+
+// The image between dither_begin and dither_end
+struct DitherImage
+{
+    uint32_t                m_Width;
+    uint32_t                m_Height;
+    uint32_t                m_NumChannels;
+    dither_dst_format       m_DstFormat;
+    dither_mode             m_Mode;
+    uint16_t*               m_Dst;
+    uint32_t                m_NextRow;      // the rows before it are dithered
+    const ThresholdTable*   m_Table;        // for the ordered modes
+    ErrorDiffusionJob*      m_Job;          // for the error diffusion modes
+    bool                    m_Active;
+};
+
+struct dither_context
+{
+    ThreadPool* m_Pool;
+    uint8_t*    m_Scratch;      // RGBA8 copy of the source rows, for the kernels that dither in place
+    size_t      m_ScratchSize;
+    DitherImage m_Image;
+};
+
+void dither_default_params(dither_params* params)
+{
+    memset(params, 0, sizeof(*params));
+    params->mode = DITHER_MODE_INTERLEAVED_GRADIENT;
+    params->bayer_size = 8;
+    params->blue_noise_size = 64;
+}
+
+const char* dither_mode_name(dither_mode mode)
+{
+    switch (mode)
+    {
+    case DITHER_MODE_INTERLEAVED_GRADIENT:  return "ign";
+    case DITHER_MODE_BAYER:                 return "bayer";
+    case DITHER_MODE_BLUE_NOISE:            return "bluenoise";
+    case DITHER_MODE_FLOYD_STEINBERG:       return "fs";
+    case DITHER_MODE_JARVIS_JUDICE_NINKE:   return "jjn";
+    case DITHER_MODE_STUCKI:                return "stucki";
+    case DITHER_MODE_SIERRA:                return "sierra";
+    default:                                return "unknown";
+    }
+}
+
+dither_mode dither_mode_from_name(const char* name)
+{
+    int mode = 0;
+    while (mode < DITHER_MODE_COUNT && strcmp(name, dither_mode_name((dither_mode)mode)) != 0)
+        ++mode;
+    return (dither_mode)mode;
+}
+
+dither_context* dither_create(uint32_t num_threads)
+{
+    dither_context* ctx = new dither_context;
+    ctx->m_Pool = threadPoolCreate(num_threads);
+    ctx->m_Scratch = 0;
+    ctx->m_ScratchSize = 0;
+    memset(&ctx->m_Image, 0, sizeof(ctx->m_Image));
+    return ctx;
+}
+
+void dither_destroy(dither_context* ctx)
+{
+    if (!ctx)
+        return;
+    dither_end(ctx);
+    threadPoolDestroy(ctx->m_Pool);
+    free(ctx->m_Scratch);
+    delete ctx;
+}
+
+struct ParallelForArgs
+{
+    void (*m_Fn)(void* data, uint32_t index);
+    void* m_Data;
+};
+
+static void parallelForTrampoline(void* ctx, uint32_t begin, uint32_t end)
+{
+    const ParallelForArgs* args = (const ParallelForArgs*)ctx;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        args->m_Fn(args->m_Data, i);
+    }
+}
 
-        RGBA8888ToRGBA4444(image_input, width, height, (uint16_t*)image_output_16bit);
+void dither_parallel_for(dither_context* ctx, uint32_t count, void (*fn)(void* data, uint32_t index), void* data)
+{
+    ParallelForArgs args = { fn, data };
+    threadPoolParallelFor(ctx ? ctx->m_Pool : 0, count, 1, parallelForTrampoline, &args);
+}
 
-        RGBA4444ToRGBA8888((uint16_t*)image_output_16bit, width, height, image_output_32bit);
+static uint8_t* getScratch(dither_context* ctx, size_t size)
+{
+    if (ctx->m_ScratchSize < size)
+    {
+        free(ctx->m_Scratch);
+        ctx->m_Scratch = (uint8_t*)malloc(size);
+        ctx->m_ScratchSize = ctx->m_Scratch ? size : 0;
+    }
+    return ctx->m_Scratch;
+}
+
+static void copyRowsToRGBA8(const uint8_t* src, uint32_t stride, uint32_t numchannels, uint32_t width, uint32_t y_begin, uint32_t y_end, uint8_t* dst)
+{
+    for (uint32_t y = y_begin; y < y_end; ++y)
+    {
+        const uint8_t* s = src + (size_t)y * stride;
+        uint8_t* d = dst + (size_t)y * width * 4;
+        if (numchannels == 4)
+        {
+            memcpy(d, s, width * 4);
+            continue;
+        }
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            d[x*4+0] = s[x*3+0];
+            d[x*4+1] = s[x*3+1];
+            d[x*4+2] = s[x*3+2];
+            d[x*4+3] = 255;
+        }
     }
-    else if (numchannels == 3)
+}
+
+static void packRows(const uint8_t* rgba, uint32_t width, uint32_t y_begin, uint32_t y_end, dither_dst_format dst_format, uint16_t* dst)
+{
+    const uint8_t* src = rgba + (size_t)y_begin * width * 4;
+    if (dst_format == DITHER_DST_RGBA4444)
+        RGBA8888ToRGBA4444(src, width, y_end - y_begin, dst + (size_t)y_begin * width);
+    else
+        RGBA8888ToRGB565(src, width, y_end - y_begin, dst + (size_t)y_begin * width, 4);
+}
+
+dither_result dither_begin(dither_context* ctx, uint32_t width, uint32_t height, dither_src_format src_format,
+                            dither_dst_format dst_format, const dither_params* params, uint16_t* dst)
+{
+    const uint32_t numchannels = (uint32_t)src_format;
+    if (!ctx || !dst || !params || (numchannels != 3 && numchannels != 4))
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    if (dst_format != DITHER_DST_RGB565 && dst_format != DITHER_DST_RGBA4444)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    if (params->mode == DITHER_MODE_BAYER && (params->bayer_size < 2 || params->bayer_size > 256 || (params->bayer_size & (params->bayer_size - 1)) != 0))
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    if (params->mode == DITHER_MODE_BLUE_NOISE && params->blue_noise_size != 64 && params->blue_noise_size != 128 && params->blue_noise_size != 256)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    if (params->mode < 0 || params->mode >= DITHER_MODE_COUNT)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+
+    dither_end(ctx);
+
+    DitherImage* image = &ctx->m_Image;
+    image->m_Width = width;
+    image->m_Height = height;
+    image->m_NumChannels = numchannels;
+    image->m_DstFormat = dst_format;
+    image->m_Mode = params->mode;
+    image->m_Dst = dst;
+    image->m_NextRow = 0;
+    image->m_Table = 0;
+    image->m_Job = 0;
+
+    if (width != 0 && height != 0)
     {
-        // make it into rgba8888 since that's what out functions operate on
-        uint8_t* image_input8888 = (uint8_t*)malloc(width*height*4);
-        for (int i = 0; i < width*height; ++i)
+        if (const DiffusionKernel* kernel = getDiffusionKernel(params->mode))
         {
-            image_input8888[i*4+0] = image_input[i*3 + 0];
-            image_input8888[i*4+1] = image_input[i*3 + 1];
-            image_input8888[i*4+2] = image_input[i*3 + 2];
-            image_input8888[i*4+3] = 255;
+            const uint8_t bits4444[4] = { 4, 4, 4, 4 };
+            const uint8_t bits565[4] = { 5, 6, 5, 0 };
+            image->m_Job = errorDiffusionBegin(ctx->m_Pool, kernel, numchannels, width, height, dst_format == DITHER_DST_RGBA4444 ? bits4444 : bits565, dst);
+            if (!image->m_Job)
+                return DITHER_RESULT_OUT_OF_MEMORY;
         }
-        free(image_input);
-        image_input = image_input8888;
+        else if (params->mode == DITHER_MODE_BAYER || params->mode == DITHER_MODE_BLUE_NOISE)
+        {
+            const uint8_t bits4444[4] = { 4, 4, 4, 4 };
+            const uint8_t bits565[4] = { 5, 6, 5, 8 };
+            const uint8_t* bits = dst_format == DITHER_DST_RGBA4444 ? bits4444 : bits565;
+            image->m_Table = params->mode == DITHER_MODE_BAYER
+                                ? getThresholdTable(THRESHOLD_MAP_BAYER, params->bayer_size, bits, 0)
+                                : getThresholdTable(THRESHOLD_MAP_BLUE_NOISE, params->blue_noise_size, bits, params->cache_dir);
+        }
+    }
+    image->m_Active = true;
+    return DITHER_RESULT_OK;
+}
 
-        ditherInterleavedGradientRGBx565(image_input, width, height);
+dither_result dither_rows(dither_context* ctx, const uint8_t* src, uint32_t stride, uint32_t count)
+{
+    if (!ctx || !ctx->m_Image.m_Active)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    DitherImage* image = &ctx->m_Image;
+    const uint32_t width = image->m_Width;
+    const uint32_t numchannels = image->m_NumChannels;
+    if (!src || stride < width * numchannels || count > image->m_Height - image->m_NextRow)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    if (width == 0 || count == 0)
+    {
+        image->m_NextRow += count;
+        return DITHER_RESULT_OK;
+    }
+
+    ThreadPool* pool = ctx->m_Pool;
+    const uint32_t y_begin = image->m_NextRow;
+    const uint32_t y_end = y_begin + count;
+    const dither_dst_format dst_format = image->m_DstFormat;
+
+    if (image->m_Job)
+    {
+        errorDiffusionRows(pool, image->m_Job, src, stride, y_end);
+        image->m_NextRow = y_end;
+        return DITHER_RESULT_OK;
+    }
+
+    if (image->m_Mode == DITHER_MODE_INTERLEAVED_GRADIENT && dst_format == DITHER_DST_RGB565)
+    {
+        ditherPackInterleavedGradientRGB565(pool, src, stride, numchannels, width, y_begin, y_end, image->m_Dst);
+        image->m_NextRow = y_end;
+        return DITHER_RESULT_OK;
+    }
 
-        RGBA8888ToRGB565(image_input, width, height, (uint16_t*)image_output_16bit);
+    // The other kernels dither RGBA8 in place. Each band of rows is copied to the scratch buffer,
+    // dithered and packed while it is still in the cache.
+    uint8_t* scratch = getScratch(ctx, (size_t)width * count * 4);
+    if (!scratch)
+        return DITHER_RESULT_OUT_OF_MEMORY;
 
-        RGB565ToRGBA8888((uint16_t*)image_output_16bit, width, height, image_output_32bit);
+    // The bands are relative to y_begin
+    uint16_t* dst = image->m_Dst + (size_t)y_begin * width;
+    if (image->m_Mode == DITHER_MODE_INTERLEAVED_GRADIENT)
+    {
+        DitherRowFn row_fn = getDitherInterleavedGradientRGBA4444Row();
+        parallelForRows(pool, count, width * 4, [=](uint32_t begin, uint32_t end) {
+            copyRowsToRGBA8(src, stride, numchannels, width, begin, end, scratch);
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                row_fn(scratch + (size_t)i * width * 4, width, y_begin + i);
+            }
+            packRows(scratch, width, begin, end, dst_format, dst);
+        });
+    }
+    else
+    {
+        const ThresholdTable* table = image->m_Table;
+        DitherOrderedRowFn row_fn = getDitherOrderedRow();
+        parallelForRows(pool, count, width * 4, [=](uint32_t begin, uint32_t end) {
+            copyRowsToRGBA8(src, stride, numchannels, width, begin, end, scratch);
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                row_fn(scratch + (size_t)i * width * 4, 4, width, y_begin + i, table);
+            }
+            packRows(scratch, width, begin, end, dst_format, dst);
+        });
     }
+    image->m_NextRow = y_end;
+    return DITHER_RESULT_OK;
+}
 
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer), "%s.dither.png", path);
-    stbi_write_png(buffer, width, height, 4, image_output_32bit, width*4);
-    printf("Wrote '%s'\n", buffer);
+dither_result dither_end(dither_context* ctx)
+{
+    if (!ctx || !ctx->m_Image.m_Active)
+        return DITHER_RESULT_INVALID_ARGUMENT;
+    DitherImage* image = &ctx->m_Image;
+    if (image->m_Job)
+        errorDiffusionEnd(image->m_Job);
+    image->m_Job = 0;
+    image->m_Active = false;
+    return image->m_NextRow == image->m_Height ? DITHER_RESULT_OK : DITHER_RESULT_INVALID_ARGUMENT;
+}
 
-    //free(M);
-    free(image_input);
-    free(image_output_16bit);
-    free(image_output_32bit);
-    return 0;
-}
\ No newline at end of file
+dither_result dither_image(dither_context* ctx, const uint8_t* src, uint32_t width, uint32_t height, uint32_t stride,
+                            dither_src_format src_format, dither_dst_format dst_format, const dither_params* params, uint16_t* dst)
+{
+    dither_result result = dither_begin(ctx, width, height, src_format, dst_format, params, dst);
+    if (result != DITHER_RESULT_OK)
+        return result;
+    result = dither_rows(ctx, src, stride, height);
+    dither_end(ctx);
+    return result;
+}
+
+dither_result dither_expand_rgba8(dither_context* ctx, const uint16_t* src, uint32_t width, uint32_t height,
+                                    dither_dst_format format, uint8_t* dst)
+{
+    if (!ctx || !src || !dst || (format != DITHER_DST_RGB565 && format != DITHER_DST_RGBA4444))
+        return DITHER_RESULT_INVALID_ARGUMENT;
+
+    parallelForRows(ctx->m_Pool, height, width * 6, [=](uint32_t y_begin, uint32_t y_end) {
+        const uint16_t* s = src + (size_t)y_begin * width;
+        uint8_t* d = dst + (size_t)y_begin * width * 4;
+        if (format == DITHER_DST_RGBA4444)
+            RGBA4444ToRGBA8888(s, width, y_end - y_begin, d);
+        else
+            RGB565ToRGBA8888(s, width, y_end - y_begin, d);
+    });
+    return DITHER_RESULT_OK;
+}
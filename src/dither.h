@@ -0,0 +1,108 @@
+// dither - dithers 8 bit images before making them rgb565/rgba4444
+//
+// Usage:
+//
+//    dither_context* ctx = dither_create(0); // one thread per hardware thread
+//
+//    dither_params params;
+//    dither_default_params(&params);
+//    params.mode = DITHER_MODE_BLUE_NOISE;
+//
+//    uint16_t* packed = (uint16_t*)malloc(width * height * 2);
+//    dither_image(ctx, pixels, width, height, width * 4, DITHER_SRC_RGBA8, DITHER_DST_RGBA4444, &params, packed);
+//    ...
+//    dither_destroy(ctx);
+//
+// A context owns the worker threads and the scratch memory, and is reused between images.
+// A context must only be used by one thread at a time, but several contexts can be used concurrently.
+// The output of a given image and set of parameters doesn't depend on the number of threads.
+
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dither_context dither_context;
+
+typedef enum dither_mode
+{
+    DITHER_MODE_INTERLEAVED_GRADIENT,   // interleaved gradient noise (default)
+    DITHER_MODE_BAYER,                  // ordered dithering with a Bayer matrix
+    DITHER_MODE_BLUE_NOISE,             // ordered dithering with a blue noise tile
+    DITHER_MODE_FLOYD_STEINBERG,        // error diffusion
+    DITHER_MODE_JARVIS_JUDICE_NINKE,    // error diffusion
+    DITHER_MODE_STUCKI,                 // error diffusion
+    DITHER_MODE_SIERRA,                 // error diffusion
+    DITHER_MODE_COUNT,
+} dither_mode;
+
+// The value is the number of channels
+typedef enum dither_src_format
+{
+    DITHER_SRC_RGB8     = 3,
+    DITHER_SRC_RGBA8    = 4,
+} dither_src_format;
+
+// Packed 16 bit pixels, with r in the most significant bits
+typedef enum dither_dst_format
+{
+    DITHER_DST_RGB565,
+    DITHER_DST_RGBA4444,
+} dither_dst_format;
+
+typedef enum dither_result
+{
+    DITHER_RESULT_OK,
+    DITHER_RESULT_INVALID_ARGUMENT,
+    DITHER_RESULT_OUT_OF_MEMORY,
+} dither_result;
+
+typedef struct dither_params
+{
+    dither_mode mode;
+    uint32_t    bayer_size;         // power of two from 2 to 256 (default 8)
+    uint32_t    blue_noise_size;    // 64, 128 or 256 (default 64)
+    const char* cache_dir;          // if set, the generated blue noise tiles are stored here (default null)
+} dither_params;
+
+void            dither_default_params(dither_params* params);
+
+// Short name of the mode, e.g. "ign", "bayer", "fs"
+const char*     dither_mode_name(dither_mode mode);
+// Returns DITHER_MODE_COUNT for unknown names
+dither_mode     dither_mode_from_name(const char* name);
+
+// num_threads is the total number of threads used, including the calling thread. 0 means one per hardware thread
+dither_context* dither_create(uint32_t num_threads);
+void            dither_destroy(dither_context* ctx);
+
+// Calls fn(data, i) for each i in [0, count) on the threads of the context, and returns when all calls are done.
+// Lets the caller use the same threads for other work on the image (e.g. encoding it)
+void            dither_parallel_for(dither_context* ctx, uint32_t count, void (*fn)(void* data, uint32_t index), void* data);
+
+// Dithers the 8 bit image and writes the packed pixels to dst (width * height pixels, tightly packed).
+// stride is the number of bytes between the rows of src. The source image is not modified.
+dither_result   dither_image(dither_context* ctx, const uint8_t* src, uint32_t width, uint32_t height, uint32_t stride,
+                                dither_src_format src_format, dither_dst_format dst_format, const dither_params* params, uint16_t* dst);
+
+// Dithers an image that arrives a few rows at a time (e.g. while it is being decoded), with the same result as dither_image.
+// dither_rows() dithers the next count rows, starting at src. The rows must be given in order, and dither_end() returns
+// DITHER_RESULT_INVALID_ARGUMENT if some are missing. The context can't be used for other images (or dither_image) in between.
+dither_result   dither_begin(dither_context* ctx, uint32_t width, uint32_t height, dither_src_format src_format,
+                                dither_dst_format dst_format, const dither_params* params, uint16_t* dst);
+dither_result   dither_rows(dither_context* ctx, const uint8_t* src, uint32_t stride, uint32_t count);
+dither_result   dither_end(dither_context* ctx);
+
+// Expands the packed pixels to RGBA8 (e.g. for a preview image)
+dither_result   dither_expand_rgba8(dither_context* ctx, const uint16_t* src, uint32_t width, uint32_t height,
+                                        dither_dst_format format, uint8_t* dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DITHER_H
@@ -0,0 +1,1475 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "dither.h"
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+    #include <direct.h>
+    #define strcasecmp _stricmp
+#else
+    #include <sys/stat.h>
+    #include <dirent.h>
+    #include <unistd.h>
+    #include <strings.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// *****************************************************************************************************
+// Platform helpers
+
+static bool isDirectory(const char* path)
+{
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static bool makeDirectory(const char* path)
+{
+#if defined(_WIN32)
+    return _mkdir(path) == 0;
+#else
+    return mkdir(path, 0755) == 0;
+#endif
+}
+
+// Gets the names of the entries in a directory, except the hidden ones (and "." and "..")
+static bool listDirectory(const char* path, std::vector<std::string>& names)
+{
+#if defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((std::string(path) + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+        return false;
+    do
+    {
+        if (data.cFileName[0] != '.')
+            names.push_back(data.cFileName);
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR* dir = opendir(path);
+    if (!dir)
+        return false;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != 0)
+    {
+        if (entry->d_name[0] != '.')
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
+    return true;
+}
+
+static bool hardLinkFile(const char* src_path, const char* dst_path)
+{
+#if defined(_WIN32)
+    return CreateHardLinkA(dst_path, src_path, 0) != 0;
+#else
+    return link(src_path, dst_path) == 0;
+#endif
+}
+
+// Renames the file, replacing dst_path if it exists
+static bool replaceFile(const char* src_path, const char* dst_path)
+{
+#if defined(_WIN32)
+    return MoveFileExA(src_path, dst_path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(src_path, dst_path) == 0;
+#endif
+}
+
+// *****************************************************************************************************
+// File helpers
+
+static uint8_t* readFile(const char* path, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = file_size >= 0 ? (uint8_t*)malloc(file_size ? file_size : 1) : 0;
+    if (data && fread(data, 1, file_size, f) != (size_t)file_size)
+    {
+        free(data);
+        data = 0;
+    }
+    fclose(f);
+    *size = (size_t)file_size;
+    return data;
+}
+
+static bool writeData(FILE* f, const void* data, size_t size)
+{
+    return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+static bool writeU32(FILE* f, uint32_t v)
+{
+    return writeData(f, &v, sizeof(v));
+}
+
+static bool writeU64(FILE* f, uint64_t v)
+{
+    return writeData(f, &v, sizeof(v));
+}
+
+static bool writePadding(FILE* f, size_t size)
+{
+    const uint8_t zeros[8] = {0};
+    return writeData(f, zeros, size);
+}
+
+// *****************************************************************************************************
+// Texture containers
+//
+// Writes the packed 16 bit data as is (i.e. the actual gpu payload), with an optional mip chain.
+// The 16 bit pixels are stored in host byte order, which is assumed to be little endian for KTX2 and DDS.
+
+enum TextureFormat
+{
+    TEXTURE_FORMAT_RGB565,      // r in the top 5 bits
+    TEXTURE_FORMAT_RGBA4444,    // r in the top 4 bits
+};
+
+enum OutputFormat
+{
+    OUTPUT_FORMAT_PNG,          // 8 bit preview of the quantized image
+    OUTPUT_FORMAT_KTX,
+    OUTPUT_FORMAT_KTX2,
+    OUTPUT_FORMAT_DDS,
+};
+
+static const char* getOutputFormatExtension(OutputFormat format)
+{
+    switch (format)
+    {
+    case OUTPUT_FORMAT_KTX:     return "ktx";
+    case OUTPUT_FORMAT_KTX2:    return "ktx2";
+    case OUTPUT_FORMAT_DDS:     return "dds";
+    default:                    return "png";
+    }
+}
+
+struct TextureLevel
+{
+    uint32_t    width;
+    uint32_t    height;
+    uint16_t*   data;
+};
+
+static uint32_t getMipCount(uint32_t width, uint32_t height)
+{
+    uint32_t count = 1;
+    while (width > 1 || height > 1)
+    {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        ++count;
+    }
+    return count;
+}
+
+// 2x2 box filter. Odd sizes clamp the last row/column.
+static void downsample2x2(const uint8_t* src, uint32_t src_width, uint32_t src_height, uint32_t numchannels, uint8_t* dst, uint32_t dst_width, uint32_t dst_height)
+{
+    for (uint32_t y = 0; y < dst_height; ++y)
+    {
+        uint32_t y0 = y * 2 < src_height ? y * 2 : src_height - 1;
+        uint32_t y1 = y0 + 1 < src_height ? y0 + 1 : y0;
+        const uint8_t* row0 = src + (size_t)y0 * src_width * numchannels;
+        const uint8_t* row1 = src + (size_t)y1 * src_width * numchannels;
+        for (uint32_t x = 0; x < dst_width; ++x)
+        {
+            uint32_t x0 = x * 2 < src_width ? x * 2 : src_width - 1;
+            uint32_t x1 = x0 + 1 < src_width ? x0 + 1 : x0;
+            for (uint32_t c = 0; c < numchannels; ++c)
+            {
+                uint32_t sum = row0[x0*numchannels + c] + row0[x1*numchannels + c] + row1[x0*numchannels + c] + row1[x1*numchannels + c];
+                *(dst++) = (uint8_t)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// https://registry.khronos.org/KTX/specs/1.0/ktxspec.v1.html
+static bool writeKTX(FILE* f, TextureFormat format, const TextureLevel* levels, uint32_t num_levels)
+{
+    const uint8_t identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+    const uint32_t GL_UNSIGNED_SHORT_4_4_4_4 = 0x8033;
+    const uint32_t GL_UNSIGNED_SHORT_5_6_5 = 0x8363;
+    const uint32_t GL_RGB = 0x1907;
+    const uint32_t GL_RGBA = 0x1908;
+    const uint32_t GL_RGBA4 = 0x8056;
+    const uint32_t GL_RGB565 = 0x8D62;
+
+    bool is565 = format == TEXTURE_FORMAT_RGB565;
+    bool ok = writeData(f, identifier, sizeof(identifier));
+    ok = ok && writeU32(f, 0x04030201);                                 // endianness
+    ok = ok && writeU32(f, is565 ? GL_UNSIGNED_SHORT_5_6_5 : GL_UNSIGNED_SHORT_4_4_4_4); // glType
+    ok = ok && writeU32(f, 2);                                          // glTypeSize
+    ok = ok && writeU32(f, is565 ? GL_RGB : GL_RGBA);                   // glFormat
+    ok = ok && writeU32(f, is565 ? GL_RGB565 : GL_RGBA4);               // glInternalFormat
+    ok = ok && writeU32(f, is565 ? GL_RGB : GL_RGBA);                   // glBaseInternalFormat
+    ok = ok && writeU32(f, levels[0].width);
+    ok = ok && writeU32(f, levels[0].height);
+    ok = ok && writeU32(f, 0);                                          // pixelDepth
+    ok = ok && writeU32(f, 0);                                          // numberOfArrayElements
+    ok = ok && writeU32(f, 1);                                          // numberOfFaces
+    ok = ok && writeU32(f, num_levels);
+    ok = ok && writeU32(f, 0);                                          // bytesOfKeyValueData
+
+    for (uint32_t i = 0; ok && i < num_levels; ++i)
+    {
+        // Rows are aligned to 4 bytes (GL_UNPACK_ALIGNMENT)
+        uint32_t row_size = levels[i].width * 2;
+        uint32_t row_padding = (4 - (row_size & 3)) & 3;
+        ok = writeU32(f, (row_size + row_padding) * levels[i].height);
+        if (row_padding == 0)
+        {
+            ok = ok && writeData(f, levels[i].data, (size_t)row_size * levels[i].height);
+        }
+        else
+        {
+            for (uint32_t y = 0; ok && y < levels[i].height; ++y)
+            {
+                ok = writeData(f, levels[i].data + (size_t)y * levels[i].width, row_size) && writePadding(f, row_padding);
+            }
+        }
+        // image size is a multiple of 4 already, so no mip padding is needed
+    }
+    return ok;
+}
+
+// https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html
+static bool writeKTX2(FILE* f, TextureFormat format, const TextureLevel* levels, uint32_t num_levels)
+{
+    const uint8_t identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+    const uint32_t VK_FORMAT_R4G4B4A4_UNORM_PACK16 = 2;
+    const uint32_t VK_FORMAT_R5G6B5_UNORM_PACK16 = 4;
+
+    // Data format descriptor: one basic block with a sample per channel, ordered by bit offset
+    // https://registry.khronos.org/DataFormat/specs/1.3/dataformat.1.3.html
+    struct Sample { uint32_t offset, length, channel; };
+    const Sample samples565[] = { {0, 5, 2}, {5, 6, 1}, {11, 5, 0} };
+    const Sample samples4444[] = { {0, 4, 15}, {4, 4, 2}, {8, 4, 1}, {12, 4, 0} };
+    bool is565 = format == TEXTURE_FORMAT_RGB565;
+    const Sample* samples = is565 ? samples565 : samples4444;
+    uint32_t num_samples = is565 ? 3 : 4;
+
+    uint32_t dfd_block_size = 24 + 16 * num_samples;
+    uint32_t dfd_size = 4 + dfd_block_size;
+    uint32_t header_size = 80 + 24 * num_levels;
+    uint32_t dfd_offset = header_size;
+
+    // The mip levels are stored smallest first, each aligned to lcm(texel size, 4) = 4 bytes
+    uint64_t* level_offsets = (uint64_t*)malloc(sizeof(uint64_t) * num_levels);
+    uint64_t offset = dfd_offset + dfd_size;
+    for (uint32_t i = num_levels; i-- > 0;)
+    {
+        offset = (offset + 3) & ~(uint64_t)3;
+        level_offsets[i] = offset;
+        offset += (uint64_t)levels[i].width * levels[i].height * 2;
+    }
+
+    bool ok = writeData(f, identifier, sizeof(identifier));
+    ok = ok && writeU32(f, is565 ? VK_FORMAT_R5G6B5_UNORM_PACK16 : VK_FORMAT_R4G4B4A4_UNORM_PACK16);
+    ok = ok && writeU32(f, 2);                                          // typeSize
+    ok = ok && writeU32(f, levels[0].width);
+    ok = ok && writeU32(f, levels[0].height);
+    ok = ok && writeU32(f, 0);                                          // pixelDepth
+    ok = ok && writeU32(f, 0);                                          // layerCount
+    ok = ok && writeU32(f, 1);                                          // faceCount
+    ok = ok && writeU32(f, num_levels);
+    ok = ok && writeU32(f, 0);                                          // supercompressionScheme
+    ok = ok && writeU32(f, dfd_offset);
+    ok = ok && writeU32(f, dfd_size);
+    ok = ok && writeU32(f, 0);                                          // kvdByteOffset
+    ok = ok && writeU32(f, 0);                                          // kvdByteLength
+    ok = ok && writeU64(f, 0);                                          // sgdByteOffset
+    ok = ok && writeU64(f, 0);                                          // sgdByteLength
+    for (uint32_t i = 0; ok && i < num_levels; ++i)
+    {
+        uint64_t size = (uint64_t)levels[i].width * levels[i].height * 2;
+        ok = writeU64(f, level_offsets[i]) && writeU64(f, size) && writeU64(f, size);
+    }
+
+    ok = ok && writeU32(f, dfd_size);
+    ok = ok && writeU32(f, 0);                                          // vendorId = KHR, descriptorType = basic
+    ok = ok && writeU32(f, 2 | (dfd_block_size << 16));                 // versionNumber 1.3, descriptorBlockSize
+    ok = ok && writeU32(f, 1 | (1 << 8) | (1 << 16));                   // colorModel RGBSDA, primaries BT709, transfer linear, flags
+    ok = ok && writeU32(f, 0);                                          // texelBlockDimension 1x1x1x1
+    ok = ok && writeU32(f, 2);                                          // bytesPlane0
+    ok = ok && writeU32(f, 0);                                          // bytesPlane4-7
+    for (uint32_t i = 0; ok && i < num_samples; ++i)
+    {
+        ok = writeU32(f, samples[i].offset | ((samples[i].length - 1) << 16) | (samples[i].channel << 24));
+        ok = ok && writeU32(f, 0);                                      // samplePosition
+        ok = ok && writeU32(f, 0);                                      // sampleLower
+        ok = ok && writeU32(f, (1u << samples[i].length) - 1);          // sampleUpper
+    }
+
+    offset = dfd_offset + dfd_size;
+    for (uint32_t i = num_levels; ok && i-- > 0;)
+    {
+        ok = writePadding(f, (size_t)(level_offsets[i] - offset));
+        ok = ok && writeData(f, levels[i].data, (size_t)levels[i].width * levels[i].height * 2);
+        offset = level_offsets[i] + (uint64_t)levels[i].width * levels[i].height * 2;
+    }
+    free(level_offsets);
+    return ok;
+}
+
+// https://learn.microsoft.com/en-us/windows/win32/direct3ddds/dx-graphics-dds-pguide
+static bool writeDDS(FILE* f, TextureFormat format, const TextureLevel* levels, uint32_t num_levels)
+{
+    const uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PITCH = 0x8, DDSD_PIXELFORMAT = 0x1000, DDSD_MIPMAPCOUNT = 0x20000;
+    const uint32_t DDPF_ALPHAPIXELS = 0x1, DDPF_RGB = 0x40;
+    const uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS_MIPMAP = 0x400000;
+
+    bool is565 = format == TEXTURE_FORMAT_RGB565;
+    uint32_t flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | (num_levels > 1 ? DDSD_MIPMAPCOUNT : 0);
+    uint32_t caps = DDSCAPS_TEXTURE | (num_levels > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0);
+
+    bool ok = writeData(f, "DDS ", 4);
+    ok = ok && writeU32(f, 124);                                        // dwSize
+    ok = ok && writeU32(f, flags);
+    ok = ok && writeU32(f, levels[0].height);
+    ok = ok && writeU32(f, levels[0].width);
+    ok = ok && writeU32(f, levels[0].width * 2);                        // dwPitchOrLinearSize
+    ok = ok && writeU32(f, 0);                                          // dwDepth
+    ok = ok && writeU32(f, num_levels);
+    for (int i = 0; i < 11; ++i)
+        ok = ok && writeU32(f, 0);                                      // dwReserved1
+    ok = ok && writeU32(f, 32);                                         // ddspf.dwSize
+    ok = ok && writeU32(f, is565 ? DDPF_RGB : DDPF_RGB | DDPF_ALPHAPIXELS);
+    ok = ok && writeU32(f, 0);                                          // dwFourCC
+    ok = ok && writeU32(f, 16);                                         // dwRGBBitCount
+    // RGBA4444 is written as A4R4G4B4 (D3DFMT_A4R4G4B4 / DXGI_FORMAT_B4G4R4A4_UNORM) which all loaders recognize
+    ok = ok && writeU32(f, is565 ? 0xF800 : 0x0F00);
+    ok = ok && writeU32(f, is565 ? 0x07E0 : 0x00F0);
+    ok = ok && writeU32(f, is565 ? 0x001F : 0x000F);
+    ok = ok && writeU32(f, is565 ? 0x0000 : 0xF000);
+    ok = ok && writeU32(f, caps);
+    for (int i = 0; i < 4; ++i)
+        ok = ok && writeU32(f, 0);                                      // dwCaps2, dwCaps3, dwCaps4, dwReserved2
+
+    uint16_t* swizzled = 0;
+    for (uint32_t i = 0; ok && i < num_levels; ++i)
+    {
+        size_t count = (size_t)levels[i].width * levels[i].height;
+        if (is565)
+        {
+            ok = writeData(f, levels[i].data, count * 2);
+            continue;
+        }
+        if (!swizzled)
+            swizzled = (uint16_t*)malloc(count * 2); // the first level is the largest
+        for (size_t p = 0; p < count; ++p)
+        {
+            uint16_t c = levels[i].data[p];
+            swizzled[p] = (uint16_t)((c >> 4) | (c << 12));
+        }
+        ok = writeData(f, swizzled, count * 2);
+    }
+    free(swizzled);
+    return ok;
+}
+
+static bool writeTexture(const char* path, OutputFormat output_format, TextureFormat format, const TextureLevel* levels, uint32_t num_levels)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    bool ok = false;
+    switch (output_format)
+    {
+    case OUTPUT_FORMAT_KTX:     ok = writeKTX(f, format, levels, num_levels); break;
+    case OUTPUT_FORMAT_KTX2:    ok = writeKTX2(f, format, levels, num_levels); break;
+    case OUTPUT_FORMAT_DDS:     ok = writeDDS(f, format, levels, num_levels); break;
+    default:                    break;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        remove(path); // don't leave a truncated file behind
+    return ok;
+}
+
+
+struct DitherOptions
+{
+    dither_params params;
+    uint32_t      num_threads;
+    const char*   cache_dir;          // if set, results are cached by content hash
+    OutputFormat  output_format;
+    bool          mipmaps;            // generate a full mip chain (texture containers only)
+};
+
+// *****************************************************************************************************
+// Result cache
+//
+// The cache key is a hash of the input file bytes and of all settings that affect the output.
+// On a hit, the cached output is hard linked (or copied) to the output path without decoding anything.
+// Bump the version when the output of the dither kernels or the writers change.
+
+#define DITHER_CACHE_VERSION 2
+
+// XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxhRotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t xxhRead64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // assumes little endian
+    return v;
+}
+
+static inline uint32_t xxhRead32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = xxhRotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val)
+{
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxHash64(const void* data, size_t len, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const uint8_t* limit = end - 32;
+        do
+        {
+            v1 = xxhRound(v1, xxhRead64(p)); p += 8;
+            v2 = xxhRound(v2, xxhRead64(p)); p += 8;
+            v3 = xxhRound(v3, xxhRead64(p)); p += 8;
+            v4 = xxhRound(v4, xxhRead64(p)); p += 8;
+        } while (p <= limit);
+
+        h = xxhRotl64(v1, 1) + xxhRotl64(v2, 7) + xxhRotl64(v3, 12) + xxhRotl64(v4, 18);
+        h = xxhMergeRound(h, v1);
+        h = xxhMergeRound(h, v2);
+        h = xxhMergeRound(h, v3);
+        h = xxhMergeRound(h, v4);
+    }
+    else
+    {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxhRound(0, xxhRead64(p));
+        h = xxhRotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)xxhRead32(p) * XXH_PRIME64_1;
+        h = xxhRotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxhRotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// All settings that affect the output bytes
+static void getSettingsKey(const DitherOptions& options, char* buffer, size_t buffer_size)
+{
+    const dither_params& params = options.params;
+    uint32_t size = params.mode == DITHER_MODE_BAYER ? params.bayer_size : (params.mode == DITHER_MODE_BLUE_NOISE ? params.blue_noise_size : 0);
+    snprintf(buffer, buffer_size, "version=%d;dither=%s;size=%u;format=auto;output=%s;mipmaps=%d",
+                DITHER_CACHE_VERSION, dither_mode_name(params.mode), size,
+                getOutputFormatExtension(options.output_format), options.mipmaps ? 1 : 0);
+}
+
+static uint64_t getCacheKey(const DitherOptions& options, const void* file_data, size_t file_size)
+{
+    char settings[256];
+    getSettingsKey(options, settings, sizeof(settings));
+    uint64_t settings_hash = xxHash64(settings, strlen(settings), 0);
+    return xxHash64(file_data, file_size, settings_hash);
+}
+
+static void getCachePath(const DitherOptions& options, uint64_t key, char* buffer, size_t buffer_size)
+{
+    snprintf(buffer, buffer_size, "%s/%016llx", options.cache_dir, (unsigned long long)key);
+}
+
+static bool copyFile(const char* src_path, const char* dst_path)
+{
+    FILE* src = fopen(src_path, "rb");
+    if (!src)
+        return false;
+    FILE* dst = fopen(dst_path, "wb");
+    if (!dst)
+    {
+        fclose(src);
+        return false;
+    }
+    char buffer[64*1024];
+    size_t n;
+    bool ok = true;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), src)) > 0)
+    {
+        ok = fwrite(buffer, 1, n, dst) == n;
+    }
+    ok = !ferror(src) && ok;
+    fclose(src);
+    ok = fclose(dst) == 0 && ok;
+    return ok;
+}
+
+// A name next to path that no other thread writes to
+static void getTempPath(const char* path, char* buffer, size_t buffer_size)
+{
+    snprintf(buffer, buffer_size, "%s.tmp%llx", path, (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+// Hard links the file if possible (same file system), otherwise copies it.
+// The destination is replaced atomically, so concurrent readers never see a partial file.
+static bool linkOrCopyFile(const char* src_path, const char* dst_path)
+{
+    char tmp_path[1100];
+    getTempPath(dst_path, tmp_path, sizeof(tmp_path));
+    remove(tmp_path);
+    if (!hardLinkFile(src_path, tmp_path) && !copyFile(src_path, tmp_path))
+    {
+        remove(tmp_path);
+        return false;
+    }
+    if (!replaceFile(tmp_path, dst_path))
+    {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+struct DitherFileResult
+{
+    bool        ok;
+    const char* error;
+    int         width;
+    int         height;
+    int         numchannels;
+    double      seconds;
+    bool        cached;
+    char        output_path[1024];
+    char        tmp_path[1100];     // the output is written here, then renamed to output_path
+};
+
+static double getTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// *****************************************************************************************************
+// Tracing
+//
+// With --trace <file>, each pipeline stage is recorded with its duration and the number of bytes it processed,
+// and written as Chrome trace-event JSON (load it in chrome://tracing or https://ui.perfetto.dev).
+
+struct TraceEvent
+{
+    const char* name;
+    uint32_t    tid;
+    double      start;
+    double      duration;
+    uint64_t    bytes;
+    std::string path;           // set on the per file events
+};
+
+struct Trace
+{
+    std::mutex              m_Mutex;
+    std::vector<TraceEvent> m_Events;
+    double                  m_Start;
+};
+
+static Trace* g_Trace = 0;
+static std::atomic<uint32_t> g_TraceNextThreadId(0);
+static thread_local uint32_t g_TraceThreadId = ~0u;
+
+static uint32_t getTraceThreadId()
+{
+    if (g_TraceThreadId == ~0u)
+        g_TraceThreadId = g_TraceNextThreadId++;
+    return g_TraceThreadId;
+}
+
+// Records the enclosing scope. Does nothing unless tracing is enabled
+struct TraceScope
+{
+    const char* m_Name;
+    const char* m_Path;
+    uint64_t    m_Bytes;
+    double      m_Start;
+
+    TraceScope(const char* name, uint64_t bytes, const char* path = 0)
+    : m_Name(name), m_Path(path), m_Bytes(bytes), m_Start(g_Trace ? getTime() : 0.0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (!g_Trace)
+            return;
+        TraceEvent event;
+        event.name = m_Name;
+        event.tid = getTraceThreadId();
+        event.start = m_Start;
+        event.duration = getTime() - m_Start;
+        event.bytes = m_Bytes;
+        if (m_Path)
+            event.path = m_Path;
+        std::lock_guard<std::mutex> lock(g_Trace->m_Mutex);
+        g_Trace->m_Events.push_back(event);
+    }
+};
+
+static void traceBegin()
+{
+    g_Trace = new Trace;
+    g_Trace->m_Start = getTime();
+    getTraceThreadId(); // the main thread is thread 0
+}
+
+static void writeJsonString(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((uint8_t)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static bool traceEnd(const char* path)
+{
+    Trace* trace = g_Trace;
+    g_Trace = 0;
+    FILE* f = fopen(path, "wb");
+    if (!f)
+    {
+        delete trace;
+        return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    uint32_t num_threads = g_TraceNextThreadId;
+    for (uint32_t i = 0; i < num_threads; ++i)
+    {
+        char name[32] = "main";
+        if (i > 0)
+            snprintf(name, sizeof(name), "worker %u", i);
+        fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}},\n", i, name);
+    }
+    for (size_t i = 0; i < trace->m_Events.size(); ++i)
+    {
+        const TraceEvent& event = trace->m_Events[i];
+        fprintf(f, "  {\"name\": \"%s\", \"cat\": \"dither\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %llu",
+                    event.name, event.tid, (event.start - trace->m_Start) * 1000000.0, event.duration * 1000000.0, (unsigned long long)event.bytes);
+        if (!event.path.empty())
+        {
+            fprintf(f, ", \"path\": ");
+            writeJsonString(f, event.path.c_str());
+        }
+        fprintf(f, "}}%s\n", i + 1 < trace->m_Events.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    delete trace;
+    return fclose(f) == 0;
+}
+
+struct PngTask
+{
+    stbi_write_parallel_task* m_Task;
+    void*                     m_Data;
+};
+
+static void pngTaskTrampoline(void* data, uint32_t index)
+{
+    const PngTask* task = (const PngTask*)data;
+    task->m_Task(task->m_Data, (int)index);
+}
+
+// Lets the png encoder run on the threads of the dither context
+static void pngParallelFor(void* context, int count, stbi_write_parallel_task* task, void* data)
+{
+    PngTask args = { task, data };
+    dither_parallel_for((dither_context*)context, (uint32_t)count, pngTaskTrampoline, &args);
+}
+
+struct PngWriter
+{
+    FILE* m_File;
+    bool  m_Ok;
+};
+
+static void pngWrite(void* context, void* data, int size)
+{
+    PngWriter* writer = (PngWriter*)context;
+    writer->m_Ok = writer->m_Ok && writeData(writer->m_File, data, (size_t)size);
+}
+
+// Dithers the RGB8/RGBA8 image and packs it to rgb565 (3 channels) or rgba4444 (4 channels)
+static bool ditherAndPack(const DitherOptions& options, dither_context* ctx, const uint8_t* image, uint32_t width, uint32_t height, uint32_t numchannels, uint16_t* dst)
+{
+    TraceScope trace("dither", (uint64_t)width * height * numchannels);
+    dither_dst_format format = numchannels == 4 ? DITHER_DST_RGBA4444 : DITHER_DST_RGB565;
+    return dither_image(ctx, image, width, height, width * numchannels, (dither_src_format)numchannels, format, &options.params, dst) == DITHER_RESULT_OK;
+}
+
+// Dithers and packs the image (and its mip chain) and writes it to a texture container, without the 8888 expansion.
+// On failure, *error is set to what went wrong
+static bool ditherTexture(const DitherOptions& options, dither_context* ctx, uint8_t* image_input, uint32_t width, uint32_t height, uint32_t numchannels,
+                            const char* output_path, const char** error)
+{
+    TextureFormat format = numchannels == 4 ? TEXTURE_FORMAT_RGBA4444 : TEXTURE_FORMAT_RGB565;
+    uint32_t num_levels = options.mipmaps ? getMipCount(width, height) : 1;
+
+    size_t total_pixels = 0;
+    TextureLevel* levels = (TextureLevel*)malloc(sizeof(TextureLevel) * num_levels);
+    for (uint32_t i = 0; i < num_levels; ++i)
+    {
+        levels[i].width = i == 0 ? width : (levels[i-1].width > 1 ? levels[i-1].width / 2 : 1);
+        levels[i].height = i == 0 ? height : (levels[i-1].height > 1 ? levels[i-1].height / 2 : 1);
+        total_pixels += (size_t)levels[i].width * levels[i].height;
+    }
+    uint16_t* data = (uint16_t*)malloc(total_pixels * 2);
+
+    // Each level is filtered from the undithered level above it, and then dithered
+    uint8_t* level_input = image_input;
+    uint8_t* next_input = 0;
+    uint16_t* level_data = data;
+    bool ok = true;
+    for (uint32_t i = 0; i < num_levels; ++i)
+    {
+        const uint32_t w = levels[i].width;
+        const uint32_t h = levels[i].height;
+        levels[i].data = level_data;
+        level_data += (size_t)w * h;
+
+        if (i + 1 < num_levels)
+        {
+            TraceScope trace("downsample", (uint64_t)w * h * numchannels);
+            next_input = (uint8_t*)malloc((size_t)levels[i+1].width * levels[i+1].height * numchannels);
+            downsample2x2(level_input, w, h, numchannels, next_input, levels[i+1].width, levels[i+1].height);
+        }
+
+        ok = ditherAndPack(options, ctx, level_input, w, h, numchannels, levels[i].data) && ok;
+
+        if (level_input != image_input)
+            free(level_input);
+        level_input = next_input;
+        next_input = 0;
+    }
+
+    if (!ok)
+        *error = "failed to dither";
+    else
+    {
+        TraceScope trace("write", total_pixels * 2);
+        ok = writeTexture(output_path, options.output_format, format, levels, num_levels);
+        if (!ok)
+            *error = "failed to write output";
+    }
+    free(data);
+    free(levels);
+    return ok;
+}
+
+// Buffers reused between the images processed by one thread
+struct DitherBuffers
+{
+    std::vector<uint8_t>    m_Input;    // the decoded RGB8/RGBA8 image
+    std::vector<uint16_t>   m_Packed;   // rgb565/rgba4444
+    std::vector<uint8_t>    m_Preview;  // the packed pixels expanded to RGBA8
+};
+
+// Dithers the rows of the image as the decoder finishes them, while they are still in the cache.
+// This runs in the decode callback, so decoding waits for each band to be dithered
+struct DitherStream
+{
+    const DitherOptions*    m_Options;
+    dither_context*         m_Ctx;
+    std::vector<uint16_t>*  m_Packed;   // rgb565/rgba4444
+    const uint8_t*          m_Image;
+    uint32_t                m_Stride;
+    bool                    m_Ok;
+};
+
+static void ditherDecodedRows(void* user, int y_begin, int y_end)
+{
+    DitherStream* stream = (DitherStream*)user;
+    const uint8_t* rows = stream->m_Image + (size_t)y_begin * stream->m_Stride;
+    stream->m_Ok = stream->m_Ok && dither_rows(stream->m_Ctx, rows, stream->m_Stride, (uint32_t)(y_end - y_begin)) == DITHER_RESULT_OK;
+}
+
+// Decodes the image (from file_data if set, else from path) into buffer as RGB8 or RGBA8.
+// If stream is set, the image is also dithered into it a band at a time, from the decode callback.
+// Returns the number of channels, which the caller checks, or 0 if the image can't be loaded
+static int decodeImage(const uint8_t* file_data, size_t file_size, const char* path, std::vector<uint8_t>& buffer, int* width, int* height,
+                        DitherStream* stream)
+{
+    if (file_size > INT_MAX)
+        file_data = 0; // stb_image takes the size as an int, so it reads big files itself
+
+    int numchannels;
+    int ok = file_data ? stbi_info_from_memory(file_data, (int)file_size, width, height, &numchannels)
+                       : stbi_info(path, width, height, &numchannels);
+    if (!ok)
+        return 0;
+
+    // stbi_info has the final number of channels (also for a png with a transparent color key).
+    // If a decoder still reports another number, the image is decoded again with it
+    for (int channels = numchannels; channels == 3 || channels == 4; channels = numchannels)
+    {
+        size_t size = (size_t)*width * *height * channels;
+        if (buffer.size() < size)
+            buffer.resize(size);
+        stbi_rows_func* rows_fn = 0;
+        if (stream)
+        {
+            size_t num_pixels = (size_t)*width * *height;
+            if (stream->m_Packed->size() < num_pixels)
+                stream->m_Packed->resize(num_pixels);
+            dither_dst_format format = channels == 4 ? DITHER_DST_RGBA4444 : DITHER_DST_RGB565;
+            stream->m_Image = buffer.data();
+            stream->m_Stride = (uint32_t)(*width * channels);
+            stream->m_Ok = dither_begin(stream->m_Ctx, *width, *height, (dither_src_format)channels, format, &stream->m_Options->params,
+                                        stream->m_Packed->data()) == DITHER_RESULT_OK;
+            rows_fn = ditherDecodedRows;
+        }
+        ok = file_data ? stbi_load_from_memory_into_rows(file_data, (int)file_size, buffer.data(), buffer.size(), 0, width, height, &numchannels, channels, rows_fn, stream)
+                       : stbi_load_into_rows(path, buffer.data(), buffer.size(), 0, width, height, &numchannels, channels, rows_fn, stream);
+        if (stream)
+            stream->m_Ok = dither_end(stream->m_Ctx) == DITHER_RESULT_OK && stream->m_Ok;
+        if (!ok)
+            return 0;
+        if (numchannels == channels)
+            break;
+    }
+    return numchannels;
+}
+
+// Loads, dithers and writes a single image
+static bool ditherFile(const DitherOptions& options, dither_context* ctx, DitherBuffers* buffers, const char* path, DitherFileResult* result)
+{
+    TraceScope trace("file", 0, path);
+    double start = getTime();
+    memset(result, 0, sizeof(*result));
+    snprintf(result->output_path, sizeof(result->output_path), "%s.dither.%s", path, getOutputFormatExtension(options.output_format));
+    // The output may be hard linked to a cache entry, so it's replaced rather than written in place
+    getTempPath(result->output_path, result->tmp_path, sizeof(result->tmp_path));
+
+    int width, height, numchannels;
+    char cache_path[1024] = {0};
+    // For png output the rows are dithered as they are decoded. The texture formats also need the undithered image for the mip chain
+    DitherStream stream = { &options, ctx, &buffers->m_Packed, 0, 0, false };
+    DitherStream* dither_stream = options.output_format == OUTPUT_FORMAT_PNG ? &stream : 0;
+    if (options.cache_dir)
+    {
+        size_t file_size;
+        uint8_t* file_data;
+        {
+            TraceScope trace("read", 0);
+            file_data = readFile(path, &file_size);
+            trace.m_Bytes = file_data ? file_size : 0;
+        }
+        if (!file_data) {
+            result->error = "can't fopen";
+            return false;
+        }
+        uint64_t key;
+        {
+            TraceScope trace("hash", file_size);
+            key = getCacheKey(options, file_data, file_size);
+        }
+        getCachePath(options, key, cache_path, sizeof(cache_path));
+        bool hit;
+        {
+            TraceScope trace("cache_lookup", 0);
+            hit = linkOrCopyFile(cache_path, result->output_path);
+        }
+        if (hit)
+        {
+            free(file_data);
+            result->ok = true;
+            result->cached = true;
+            result->seconds = getTime() - start;
+            return true;
+        }
+        TraceScope trace("decode", file_size);
+        numchannels = decodeImage(file_data, file_size, path, buffers->m_Input, &width, &height, dither_stream);
+        free(file_data);
+    }
+    else
+    {
+        TraceScope trace("load", 0); // read + decode (+ dither for png output), bytes decoded
+        numchannels = decodeImage(0, 0, path, buffers->m_Input, &width, &height, dither_stream);
+        trace.m_Bytes = numchannels ? (uint64_t)width * height * numchannels : 0;
+    }
+    if (!numchannels) {
+        result->error = stbi_failure_reason();
+        return false;
+    }
+    result->width = width;
+    result->height = height;
+    result->numchannels = numchannels;
+
+    if (numchannels != 3 && numchannels != 4)
+    {
+        result->error = "unsupported number of channels";
+        return false;
+    }
+    uint8_t* image_input = buffers->m_Input.data();
+
+    if (options.output_format != OUTPUT_FORMAT_PNG)
+    {
+        result->ok = ditherTexture(options, ctx, image_input, width, height, numchannels, result->tmp_path, &result->error);
+    }
+    else
+    {
+        size_t num_pixels = (size_t)width * height;
+        if (buffers->m_Preview.size() < num_pixels * 4)
+            buffers->m_Preview.resize(num_pixels * 4);
+        uint16_t* image_output_16bit = buffers->m_Packed.data();
+        uint8_t* image_output_32bit = buffers->m_Preview.data();
+
+        result->ok = stream.m_Ok; // dithered by decodeImage
+        if (!result->ok)
+            result->error = "failed to dither";
+        if (result->ok)
+        {
+            TraceScope trace("expand", (uint64_t)width * height * 2);
+            result->ok = dither_expand_rgba8(ctx, image_output_16bit, width, height, numchannels == 4 ? DITHER_DST_RGBA4444 : DITHER_DST_RGB565,
+                                                image_output_32bit) == DITHER_RESULT_OK;
+            if (!result->ok)
+                result->error = "failed to expand the preview";
+        }
+        if (result->ok)
+        {
+            // the png is written to the file as it's compressed
+            TraceScope trace("png_encode", (uint64_t)width * height * 4);
+            FILE* f = fopen(result->tmp_path, "wb");
+            PngWriter writer = { f, true };
+            result->ok = f && stbi_write_png_to_func_parallel(pngWrite, &writer, width, height, 4, image_output_32bit, width*4, pngParallelFor, ctx);
+            result->ok = f && fclose(f) == 0 && result->ok && writer.m_Ok;
+            if (!result->ok)
+            {
+                result->error = f ? "failed to write output" : "can't open the output";
+                if (f)
+                    remove(result->tmp_path); // don't leave a truncated png behind
+            }
+        }
+    }
+
+    if (result->ok && !replaceFile(result->tmp_path, result->output_path))
+    {
+        remove(result->tmp_path);
+        result->ok = false;
+        result->error = "can't replace the output";
+    }
+    if (result->ok && cache_path[0])
+    {
+        TraceScope trace("cache_store", 0);
+        linkOrCopyFile(result->output_path, cache_path); // a failure here only means a cache miss next time
+    }
+
+    result->seconds = getTime() - start;
+    return result->ok;
+}
+
+// *****************************************************************************************************
+// Batch mode
+
+static bool isImagePath(const char* path)
+{
+    if (strstr(path, ".dither."))
+        return false; // our own output
+
+    const char* ext = strrchr(path, '.');
+    if (!ext)
+        return false;
+    const char* supported[] = { ".png", ".jpg", ".jpeg", ".tga", ".bmp", ".psd", ".gif", ".hdr", ".pic", ".pnm", ".ppm", ".pgm" };
+    for (size_t i = 0; i < sizeof(supported)/sizeof(supported[0]); ++i)
+    {
+        if (strcasecmp(ext, supported[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Creates the directory and any missing parents
+static bool createDirectories(const char* path)
+{
+    std::string dir(path);
+    for (size_t i = 1; i <= dir.size(); ++i)
+    {
+        if (i == dir.size() || dir[i] == '/' || dir[i] == '\\')
+        {
+            std::string parent = dir.substr(0, i);
+            if (!isDirectory(parent.c_str()))
+                makeDirectory(parent.c_str());
+        }
+    }
+    return isDirectory(path);
+}
+
+// Adds all images in a directory (recursively), sorted by name
+static void collectDirectory(const char* dir_path, std::vector<std::string>& paths)
+{
+    std::vector<std::string> entries;
+    if (!listDirectory(dir_path, entries))
+    {
+        fprintf(stderr, "Failed to open directory '%s'\n", dir_path);
+        return;
+    }
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        entries[i] = std::string(dir_path) + "/" + entries[i];
+    }
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        if (isDirectory(entries[i].c_str()))
+            collectDirectory(entries[i].c_str(), paths);
+        else if (isImagePath(entries[i].c_str()))
+            paths.push_back(entries[i]);
+    }
+}
+
+static void collectStdin(std::vector<std::string>& paths)
+{
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin))
+    {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+        if (len > 0)
+            paths.push_back(line);
+    }
+}
+
+// A work stealing queue of file indices: each worker pops from the front of its own
+// queue, and when that is empty it steals from the back of the other queues.
+// Large and small files are then balanced automatically between the workers.
+struct WorkStealingQueue
+{
+    std::mutex            m_Mutex;
+    std::deque<uint32_t>  m_Items;
+};
+
+struct BatchContext
+{
+    const DitherOptions*             m_Options;
+    const std::vector<std::string>*  m_Paths;
+    std::vector<DitherFileResult>*   m_Results;
+    std::vector<WorkStealingQueue*>  m_Queues;
+};
+
+static bool batchPopLocal(WorkStealingQueue* queue, uint32_t* item)
+{
+    std::lock_guard<std::mutex> lock(queue->m_Mutex);
+    if (queue->m_Items.empty())
+        return false;
+    *item = queue->m_Items.front();
+    queue->m_Items.pop_front();
+    return true;
+}
+
+static bool batchSteal(WorkStealingQueue* queue, uint32_t* item)
+{
+    std::lock_guard<std::mutex> lock(queue->m_Mutex);
+    if (queue->m_Items.empty())
+        return false;
+    *item = queue->m_Items.back();
+    queue->m_Items.pop_back();
+    return true;
+}
+
+static void batchWorker(BatchContext* ctx, uint32_t worker_index)
+{
+    // The files are processed concurrently, so each image is dithered on a single thread
+    dither_context* dither_ctx = dither_create(1);
+    DitherBuffers buffers;
+    uint32_t num_queues = (uint32_t)ctx->m_Queues.size();
+    while (true)
+    {
+        uint32_t item;
+        bool found = batchPopLocal(ctx->m_Queues[worker_index], &item);
+        for (uint32_t i = 1; !found && i < num_queues; ++i)
+        {
+            found = batchSteal(ctx->m_Queues[(worker_index + i) % num_queues], &item);
+        }
+        if (!found)
+            break; // no new work is ever added, so all queues are empty
+
+        ditherFile(*ctx->m_Options, dither_ctx, &buffers, (*ctx->m_Paths)[item].c_str(), &(*ctx->m_Results)[item]);
+    }
+    dither_destroy(dither_ctx);
+}
+
+// Images with at least this many pixels are enough work to split between all the threads
+static const uint64_t LARGE_IMAGE_PIXELS = 4 * 1024 * 1024;
+
+static int ditherBatch(const DitherOptions& options, const std::vector<std::string>& paths)
+{
+    uint32_t num_threads = options.num_threads ? options.num_threads : std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+
+    double start = getTime();
+    TraceScope trace("batch", 0);
+
+    // The large images are dithered one at a time on all the threads, with the rows split between them.
+    // The others are dithered concurrently, one per thread
+    std::vector<uint32_t> large_items;
+    std::vector<uint32_t> small_items;
+    for (uint32_t i = 0; i < (uint32_t)paths.size(); ++i)
+    {
+        int width, height, numchannels;
+        bool large = num_threads > 1 && stbi_info(paths[i].c_str(), &width, &height, &numchannels) && (uint64_t)width * height >= LARGE_IMAGE_PIXELS;
+        (large ? large_items : small_items).push_back(i);
+    }
+
+    std::vector<DitherFileResult> results(paths.size());
+    if (!large_items.empty())
+    {
+        dither_context* dither_ctx = dither_create(num_threads);
+        DitherBuffers buffers;
+        for (size_t i = 0; i < large_items.size(); ++i)
+        {
+            uint32_t item = large_items[i];
+            ditherFile(options, dither_ctx, &buffers, paths[item].c_str(), &results[item]);
+        }
+        dither_destroy(dither_ctx);
+    }
+
+    uint32_t num_workers = num_threads < small_items.size() ? num_threads : (uint32_t)small_items.size();
+    BatchContext ctx;
+    ctx.m_Options = &options;
+    ctx.m_Paths = &paths;
+    ctx.m_Results = &results;
+    for (uint32_t i = 0; i < num_workers; ++i)
+    {
+        ctx.m_Queues.push_back(new WorkStealingQueue);
+    }
+    for (uint32_t i = 0; i < (uint32_t)small_items.size(); ++i)
+    {
+        ctx.m_Queues[i % num_workers]->m_Items.push_back(small_items[i]);
+    }
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < num_workers; ++i)
+    {
+        workers.push_back(std::thread(batchWorker, &ctx, i));
+    }
+    if (num_workers)
+        batchWorker(&ctx, 0);
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+    for (uint32_t i = 0; i < num_workers; ++i)
+    {
+        delete ctx.m_Queues[i];
+    }
+    if (large_items.empty())
+        num_threads = num_workers;
+
+    uint32_t num_failed = 0;
+    uint32_t num_cached = 0;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        const DitherFileResult& r = results[i];
+        char size[32] = "";
+        if (r.width)
+            snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+        if (r.ok)
+            printf("  %-6s  %8.2f ms  %-11s  '%s'\n", r.cached ? "CACHED" : "OK", r.seconds * 1000.0, size, r.output_path);
+        else
+            printf("  %-6s  %8s     %-11s  '%s': %s\n", "FAIL", "", size, paths[i].c_str(), r.error ? r.error : "unknown error");
+        num_failed += r.ok ? 0 : 1;
+        num_cached += r.cached ? 1 : 0;
+    }
+    printf("Processed %u files (%u ok, %u cached, %u failed) in %.2f s using %u threads\n",
+                (uint32_t)paths.size(), (uint32_t)paths.size() - num_failed, num_cached, num_failed, getTime() - start, num_threads);
+    return num_failed ? 1 : 0;
+}
+
+static int ditherSingle(const DitherOptions& options, const char* path)
+{
+    dither_context* ctx;
+    {
+        TraceScope trace("create_context", 0);
+        ctx = dither_create(options.num_threads);
+    }
+    DitherBuffers buffers;
+    DitherFileResult result;
+    bool ok = ditherFile(options, ctx, &buffers, path, &result);
+    dither_destroy(ctx);
+
+    if (!ok) {
+        if (result.width == 0)
+            fprintf(stderr, "Failed to load '%s': %s", path, result.error ? result.error : "unknown error");
+        else
+            fprintf(stderr, "Failed to dither '%s': %s", path, result.error);
+        return 1;
+    }
+    printf("Wrote '%s'%s\n", result.output_path, result.cached ? " (cached)" : "");
+    return 0;
+}
+
+static void printUsage()
+{
+    fprintf(stderr, "Usage: dither [options] <image|directory|->...\n");
+    fprintf(stderr, "  -j, --threads <n>    Number of threads to use (default: one per hardware thread)\n");
+    fprintf(stderr, "  -d, --dither <mode>  Dither mode: ign (interleaved gradient noise, default), bayer, bluenoise\n");
+    fprintf(stderr, "                       or error diffusion: fs (Floyd-Steinberg), jjn (Jarvis-Judice-Ninke), stucki, sierra\n");
+    fprintf(stderr, "  --bayer-size <n>     Size of the Bayer matrix, a power of two from 2 to 256 (default: 8)\n");
+    fprintf(stderr, "  --bluenoise-size <n> Size of the blue noise tile: 64, 128 or 256 (default: 64)\n");
+    fprintf(stderr, "  -f, --format <fmt>   Output format: png (8 bit preview, default), ktx, ktx2 or dds\n");
+    fprintf(stderr, "  --mipmaps            Generate a full mip chain (ktx, ktx2 and dds)\n");
+    fprintf(stderr, "  --cache <dir>        Cache the results by content hash in <dir>\n");
+    fprintf(stderr, "  --trace <file>       Write the timings of each stage as Chrome trace-event JSON\n");
+    fprintf(stderr, "  -                    Read a newline separated list of image paths from stdin\n");
+}
+
+// The options that are followed by a value
+static bool takesValue(const char* arg)
+{
+    const char* options[] = { "-j", "--threads", "-d", "--dither", "--bayer-size", "--bluenoise-size", "-f", "--format", "--cache", "--trace" };
+    for (size_t i = 0; i < sizeof(options)/sizeof(options[0]); ++i)
+    {
+        if (strcmp(arg, options[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Parses a whole decimal number in [min, max]
+static bool parseNumber(const char* s, long min, long max, uint32_t* value)
+{
+    char* end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != 0 || errno == ERANGE || v < min || v > max)
+        return false;
+    *value = (uint32_t)v;
+    return true;
+}
+
+int main(int argc, char const *argv[])
+{
+    DitherOptions options;
+    memset(&options, 0, sizeof(options));
+    dither_default_params(&options.params);
+
+    // the previews only hold 16 bit colors, so write them as palette or rgb pngs when that's exact
+    stbi_write_png_reduce = 1;
+
+    std::vector<std::string> paths;
+    const char* trace_path = 0;
+    bool batch = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (takesValue(argv[i]) && i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for '%s'\n", argv[i]);
+            printUsage();
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0)
+        {
+            const char* value = argv[++i];
+            if (!parseNumber(value, 0, 1024, &options.num_threads))
+            {
+                fprintf(stderr, "The number of threads must be from 0 to 1024, not '%s'\n", value);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dither") == 0)
+        {
+            const char* mode = argv[++i];
+            options.params.mode = dither_mode_from_name(mode);
+            if (options.params.mode == DITHER_MODE_COUNT)
+            {
+                fprintf(stderr, "Unknown dither mode '%s'\n", mode);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bayer-size") == 0)
+        {
+            if (!parseNumber(argv[++i], 2, 256, &options.params.bayer_size) || (options.params.bayer_size & (options.params.bayer_size - 1)) != 0)
+            {
+                fprintf(stderr, "The Bayer size must be a power of two from 2 to 256\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bluenoise-size") == 0)
+        {
+            if (!parseNumber(argv[++i], 64, 256, &options.params.blue_noise_size)
+                || (options.params.blue_noise_size != 64 && options.params.blue_noise_size != 128 && options.params.blue_noise_size != 256))
+            {
+                fprintf(stderr, "The blue noise size must be 64, 128 or 256\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0)
+        {
+            const char* format = argv[++i];
+            if (strcmp(format, "png") == 0)
+                options.output_format = OUTPUT_FORMAT_PNG;
+            else if (strcmp(format, "ktx") == 0)
+                options.output_format = OUTPUT_FORMAT_KTX;
+            else if (strcmp(format, "ktx2") == 0)
+                options.output_format = OUTPUT_FORMAT_KTX2;
+            else if (strcmp(format, "dds") == 0)
+                options.output_format = OUTPUT_FORMAT_DDS;
+            else
+            {
+                fprintf(stderr, "Unknown output format '%s'\n", format);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--mipmaps") == 0)
+        {
+            options.mipmaps = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            options.cache_dir = argv[++i];
+            options.params.cache_dir = options.cache_dir; // the generated blue noise tiles are kept there as well
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            printUsage();
+            return 0;
+        }
+        else if (strcmp(argv[i], "-") == 0)
+        {
+            collectStdin(paths);
+            batch = true;
+        }
+        else if (isDirectory(argv[i]))
+        {
+            collectDirectory(argv[i], paths);
+            batch = true;
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (paths.empty()) {
+        if (batch) {
+            fprintf(stderr, "No images found\n");
+            return 1;
+        }
+        fprintf(stderr, "You must supply an image path");
+        return 1;
+    }
+
+    if (options.cache_dir && !createDirectories(options.cache_dir))
+    {
+        fprintf(stderr, "Failed to create the cache directory '%s'\n", options.cache_dir);
+        return 1;
+    }
+
+    if (trace_path)
+        traceBegin();
+
+    int ret = batch || paths.size() > 1 ? ditherBatch(options, paths) : ditherSingle(options, paths[0].c_str());
+
+    if (trace_path && !traceEnd(trace_path))
+    {
+        fprintf(stderr, "Failed to write trace '%s'\n", trace_path);
+        ret = 1;
+    }
+    return ret;
+}
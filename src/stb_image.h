@@ -35,8 +35,11 @@
       Animated GIF still needs a proper API, but here's one way to do it:
           http://gist.github.com/urraka/685d9a6340b26b830d49
 
-      - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
+      - decode from memory or through FILE (define STBI_NO_STDIO to remove code),
+        files are memory-mapped on Unix-like systems (define STBI_NO_MMAP to disable)
       - decode from arbitrary I/O callbacks
+      - decode into a caller-provided buffer (stbi_load_into), which PNG and JPEG write directly,
+        optionally reporting the rows as they are decoded (stbi_load_into_rows)
       - SIMD acceleration on x86/x64 (SSE2) and ARM (NEON)
 
    Full documentation under "DOCUMENTATION" below.
@@ -188,6 +191,16 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// MEMORY-MAPPED FILES:
+//
+//   On Unix-like systems stbi_load, stbi_load_16 and stbi_loadf map the file
+//   with mmap and decode it like stbi_load_from_memory, without any read calls
+//   or copies through a small I/O buffer. Files that can't be mapped (pipes,
+//   empty or huge files) are read with stdio as before. Define STBI_NO_MMAP to
+//   always use stdio. The file must not be truncated while it's being loaded.
+//
+// ===========================================================================
+//
 // Philosophy
 //
 // stb libraries are designed with the following priorities:
@@ -227,7 +240,7 @@ RECENT REVISION HISTORY:
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
 // supported by the compiler. For ARM Neon support, you must explicitly
-// request it.
+// request it. The PNG decoder uses SSE2 to unfilter 8-bit RGB and RGBA rows.
 //
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
@@ -398,6 +411,27 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+// Decodes into dst instead of allocating the result, e.g. to reuse one buffer for many images. The rows are
+// dst_stride bytes apart (0 means x*desired_channels), and desired_channels must be 1 to 4. Returns 0 on
+// failure, including when the image doesn't fit in dst_size bytes; use stbi_info to size the buffer first.
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// Same, but calls rows(rows_user, y_begin, y_end) once rows y_begin..y_end-1 of dst are final, in order, so that
+// they can be processed while they are still in the cache. The decoder doesn't read them again, so they can be
+// modified in place. Baseline JPEGs, and 8-bit non-interlaced PNGs without a
+// palette or tRNS that need at most an added alpha channel, are reported a few rows at a time as they are decoded;
+// other images all at once at the end.
+typedef void stbi_rows_func(void *user, int y_begin, int y_end);
+STBIDEF int stbi_load_from_memory_into_rows(stbi_uc const *buffer, int len, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *channels_in_file, int desired_channels,
+                                            stbi_rows_func *rows, void *rows_user);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into_rows(char const *filename, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *channels_in_file, int desired_channels,
+                                stbi_rows_func *rows, void *rows_user);
+#endif
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
@@ -460,6 +494,7 @@ STBIDEF const char *stbi_failure_reason  (void);
 STBIDEF void     stbi_image_free      (void *retval_from_stbi_load);
 
 // get image dimensions & components without fully decoding
+// (for a png, comp includes the alpha channel that a tRNS chunk adds, as stbi_load reports it)
 STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
 STBIDEF int      stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len);
@@ -563,6 +598,13 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+#if !defined(STBI_NO_MMAP) && !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #endif
 
 #ifndef STBI_ASSERT
@@ -618,6 +660,12 @@ typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
 #endif
 
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__uint64;
+#else
+typedef uint64_t stbi__uint64;
+#endif
+
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 
@@ -781,6 +829,14 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // caller-provided output buffer for the loaders that can decode in place (see stbi__into_buffer)
+   stbi_uc *into;
+   size_t into_size, into_stride;
+   int into_n;
+   stbi_rows_func *into_rows;
+   void *into_rows_user;
+   int into_rows_done;
 } stbi__context;
 
 
@@ -794,6 +850,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->into = NULL;
 }
 
 // initialize a callback-based context
@@ -807,6 +864,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
+   s->into = NULL;
 }
 
 #ifndef STBI_NO_STDIO
@@ -1080,6 +1138,33 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+// Whether x*y n-channel pixels fit in the caller's buffer, and its row stride
+static int stbi__into_fits(stbi__context *s, int x, int y, int n, size_t *stride)
+{
+   size_t row = (size_t) x * n;
+   *stride = s->into_stride ? s->into_stride : row;
+   return *stride >= row && row <= s->into_size && (s->into_size - row) / *stride >= (size_t) (y - 1);
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+// Returns the caller's buffer if the loader can write its n-channel result there,
+// or NULL if it has to allocate the result as usual
+static stbi_uc *stbi__into_buffer(stbi__context *s, int x, int y, int n, size_t *stride)
+{
+   if (!s->into || n != s->into_n || stbi__vertically_flip_on_load) return NULL;
+   return stbi__into_fits(s, x, y, n, stride) ? s->into : NULL;
+}
+#endif
+
+// Tells the caller that the rows of its buffer before y_end are final
+static void stbi__into_rows(stbi__context *s, int y_end)
+{
+   if (s->into_rows && y_end > s->into_rows_done) {
+      s->into_rows(s->into_rows_user, s->into_rows_done, y_end);
+      s->into_rows_done = y_end;
+   }
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1223,6 +1308,44 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+// The png and jpeg loaders decode straight into dst, and report the rows as they finish them;
+// the result of the others is copied there
+static int stbi__load_into(stbi__context *s, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *comp, int req_comp,
+                           stbi_rows_func *rows, void *rows_user)
+{
+   stbi_uc *result;
+   size_t row, stride;
+   int j;
+
+   if (req_comp < 1 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (dst_stride < 0) return stbi__err("bad stride", "Negative stride");
+   s->into = dst;
+   s->into_size = dst_size;
+   s->into_stride = (size_t) dst_stride;
+   s->into_n = req_comp;
+   s->into_rows = rows;
+   s->into_rows_user = rows_user;
+   s->into_rows_done = 0;
+
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result == NULL) return 0;
+   if (result == dst) {
+      stbi__into_rows(s, *y);
+      return 1;
+   }
+
+   if (!stbi__into_fits(s, *x, *y, req_comp, &stride)) {
+      STBI_FREE(result);
+      return stbi__err("buffer too small", "Destination buffer too small");
+   }
+   row = (size_t) *x * req_comp;
+   for (j=0; j < *y; ++j)
+      memcpy(dst + stride*j, result + row*j, row);
+   STBI_FREE(result);
+   stbi__into_rows(s, *y);
+   return 1;
+}
+
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -1302,17 +1425,88 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+#ifdef STBI__MMAP
+typedef struct
+{
+   void *data;
+   size_t size;
+} stbi__mapped_file;
+
+// Returns 0 if the file can't be mapped, and the caller reads it with stdio instead
+static int stbi__map_file(char const *filename, stbi__mapped_file *m)
+{
+   struct stat st;
+   int fd = open(filename, O_RDONLY);
+   m->data = NULL;
+   if (fd < 0) return 0;
+   // the memory loaders take an int length
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX) {
+      m->size = (size_t) st.st_size;
+      m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m->data == MAP_FAILED)
+         m->data = NULL;
+#ifdef MADV_SEQUENTIAL
+      else
+         madvise(m->data, m->size, MADV_SEQUENTIAL);
+#endif
+   }
+   close(fd);
+   return m->data != NULL;
+}
+
+static void stbi__unmap_file(stbi__mapped_file *m)
+{
+   munmap(m->data, m->size);
+}
+#endif
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(filename, &m)) {
+      result = stbi_load_from_memory((stbi_uc *) m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
    return result;
 }
 
+STBIDEF int stbi_load_into_rows(char const *filename, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *comp, int req_comp,
+                                stbi_rows_func *rows, void *rows_user)
+{
+   FILE *f;
+   int result;
+   stbi__context s;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(filename, &m)) {
+      result = stbi_load_from_memory_into_rows((stbi_uc *) m.data, (int) m.size, dst, dst_size, dst_stride, x, y, comp, req_comp, rows, rows_user);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s, dst, dst_size, dst_stride, x, y, comp, req_comp, rows, rows_user);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_load_into_rows(filename, dst, dst_size, dst_stride, x, y, comp, req_comp, NULL, NULL);
+}
+
 STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *result;
@@ -1341,8 +1535,17 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    stbi__uint16 *result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(filename, &m)) {
+      result = stbi_load_16_from_memory((stbi_uc *) m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file_16(f,x,y,comp,req_comp);
    fclose(f);
@@ -1380,6 +1583,19 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_from_memory_into_rows(stbi_uc const *buffer, int len, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *comp, int req_comp,
+                                            stbi_rows_func *rows, void *rows_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s, dst, dst_size, dst_stride, x, y, comp, req_comp, rows, rows_user);
+}
+
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *dst, size_t dst_size, int dst_stride, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_load_from_memory_into_rows(buffer, len, dst, dst_size, dst_stride, x, y, comp, req_comp, NULL, NULL);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1433,7 +1649,16 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(filename, &m)) {
+      result = stbi_loadf_from_memory((stbi_uc *) m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1933,6 +2158,8 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   struct stbi__jpeg_output *stream; // if set, the rows are output as soon as the scan has decoded them
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
@@ -2872,6 +3099,8 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+static int stbi__jpeg_output_rows(stbi__jpeg *z, struct stbi__jpeg_output *o, stbi__uint32 rows);
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
@@ -2900,6 +3129,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            // the rows above this row of blocks are final, see below
+            if (z->stream && z->s->img_n == 1 && !stbi__jpeg_output_rows(z, z->stream, j*8)) return 0;
          }
          return 1;
       } else { // interleaved
@@ -2930,6 +3161,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            // once all the components are decoded down to this row of MCUs, the rows above it are final: the
+            // upsampling reads at most one low-res row past the one an output row is in, and that row is decoded
+            if (z->stream && z->scan_n == z->s->img_n && !stbi__jpeg_output_rows(z, z->stream, j * z->img_v_max * 8)) return 0;
          }
          return 1;
       }
@@ -3719,6 +3953,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->stream = NULL;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3761,163 +3996,227 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// The resample and color-convert state, kept between calls so that the rows can be output
+// as soon as the scan has decoded them
+typedef struct stbi__jpeg_output
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   stbi__resample res_comp[4];
+   stbi_uc *output, *last_row;
+   size_t stride;
+   int req_comp, n, decode_n, is_rgb;
+   stbi__uint32 rows; // rows output so far
+} stbi__jpeg_output;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+static int stbi__jpeg_begin_output(stbi__jpeg *z, stbi__jpeg_output *o)
+{
+   int k;
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   o->n = o->req_comp ? o->req_comp : z->s->img_n >= 3 ? 3 : 1;
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   o->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
+   if (z->s->img_n == 3 && o->n < 3 && !o->is_rgb)
+      o->decode_n = 1;
    else
-      decode_n = z->s->img_n;
-
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
+      o->decode_n = z->s->img_n;
+
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   o->output = stbi__into_buffer(z->s, z->s->img_x, z->s->img_y, o->n, &o->stride);
+   if (o->output && o->n == 3) {
+      // the rgb conversions write a 4th byte after each pixel. in the caller's buffer that byte is
+      // restored after each row, and the last row, which may have nothing after it, goes through a line buffer
+      o->last_row = (stbi_uc *) stbi__malloc(z->s->img_x * 3 + 1);
+      if (!o->last_row) o->output = NULL;
+   }
+   if (!o->output) {
+      o->stride = (size_t) o->n * z->s->img_x;
+      o->output = (stbi_uc *) stbi__malloc_mad3(o->n, z->s->img_x, z->s->img_y, 1);
+      if (!o->output) return stbi__err("outofmem", "Out of memory");
+   }
+   o->rows = 0;
+   return 1;
+}
 
+// Resamples and color-converts the rows up to (not including) rows, whose
+// components must be fully decoded. Starts the output on the first call
+static int stbi__jpeg_output_rows(stbi__jpeg *z, stbi__jpeg_output *o, stbi__uint32 rows)
+{
+   int k, n, decode_n, is_rgb;
+   unsigned int i,j;
+   stbi_uc *output, *last_row;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi__resample *res_comp = o->res_comp;
+   size_t stride;
+
+   if (!o->output && !stbi__jpeg_begin_output(z, o)) return 0;
+   n = o->n;
+   decode_n = o->decode_n;
+   is_rgb = o->is_rgb;
+   output = o->output;
+   last_row = o->last_row;
+   stride = o->stride;
+
+   for (j=o->rows; j < rows; ++j) {
+      stbi_uc *out = output + stride * j;
+      stbi_uc *row = out;
+      stbi_uc keep = 0;
+      if (last_row) {
+         if (j+1 == z->s->img_y) out = last_row;
+         else keep = row[3 * z->s->img_x];
+      }
       for (k=0; k < decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
                for (i=0; i < z->s->img_x; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
             }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
          }
       }
+      if (last_row) {
+         if (j+1 == z->s->img_y) memcpy(row, last_row, 3 * z->s->img_x);
+         else row[3 * z->s->img_x] = keep;
+      }
+   }
+   if (rows > o->rows) {
+      o->rows = rows;
+      if (output == z->s->into) stbi__into_rows(z->s, rows);
+   }
+   return 1;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi__jpeg_output o;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   o.req_comp = req_comp;
+   o.output = o.last_row = NULL;
+   // when decoding into the caller's buffer, the rows are output as the scan decodes them
+   z->stream = z->s->into ? &o : NULL;
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   // (or already resampled and color-converted when streaming)
+   if (!stbi__decode_jpeg_image(z) || !stbi__jpeg_output_rows(z, &o, z->s->img_y)) {
+      if (o.output != z->s->into) STBI_FREE(o.output);
+      STBI_FREE(o.last_row);
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return NULL;
    }
+
+   STBI_FREE(o.last_row);
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return o.output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
@@ -3977,14 +4276,19 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most codes of dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// A fast table entry has the code length in the low byte and the symbol in the top 16 bits, or is 0 for
+// longer codes. Literal/length entries can hold two literals instead (STBI__ZPAIR), with the length of
+// the first code in bits 8-11 and the literals in bits 16-23 and 24-31
+#define STBI__ZPAIR       0x8000
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+   stbi__uint32 fast[1 << STBI__ZFAST_BITS];
    stbi__uint16 firstcode[16];
    int maxcode[17];
    stbi__uint16 firstsymbol[16];
@@ -4040,7 +4344,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       int s = sizelist[i];
       if (s) {
          int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
+         stbi__uint32 fastv = (stbi__uint32) ((i << 16) | s);
          z->size [c] = (stbi_uc     ) s;
          z->value[c] = (stbi__uint16) i;
          if (s <= STBI__ZFAST_BITS) {
@@ -4056,6 +4360,22 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
+// Packs two literals into the literal/length entries whose bits hold both codes
+static void stbi__zbuild_pairs(stbi__zhuffman *z)
+{
+   int i;
+   // going down, so z->fast[i >> s] is still a single symbol
+   for (i=(1 << STBI__ZFAST_BITS)-1; i >= 0; --i) {
+      stbi__uint32 b = z->fast[i], b2;
+      int s = b & 255, s2;
+      if (!s || (b >> 16) >= 256) continue;
+      b2 = z->fast[i >> s];
+      s2 = b2 & 255;
+      if (!s2 || s + s2 > STBI__ZFAST_BITS || (b2 >> 16) >= 256) continue;
+      z->fast[i] = ((b2 >> 16) << 24) | ((b >> 16) << 16) | STBI__ZPAIR | (s << 8) | (s + s2);
+   }
+}
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -4064,15 +4384,20 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 
 typedef struct
 {
-   stbi_uc *zbuffer, *zbuffer_end;
+   stbi_uc *zbuffer, *zbuffer_end, *zbuffer_start;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
+   // if set, called with the output so far every STBI__ZFLUSH bytes or so; returns 0 on error
+   int (*flush)(void *user, stbi_uc *out, size_t len);
+   void *flush_user;
+   size_t flush_at;
+
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
@@ -4102,7 +4427,7 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4113,7 +4438,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4129,7 +4454,8 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
-   int b,s;
+   stbi__uint32 b;
+   int s;
    if (a->num_bits < 16) {
       if (stbi__zeof(a)) {
          return -1;   /* report error for unexpected end of data. */
@@ -4137,11 +4463,18 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
       stbi__fill_bits(a);
    }
    b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   if (b & STBI__ZPAIR) {
+      // just the first literal
+      s = (b >> 8) & 15;
+      a->code_buffer >>= s;
+      a->num_bits -= s;
+      return (b >> 16) & 255;
+   }
    if (b) {
-      s = b >> 9;
+      s = b & 255;
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return b & 511;
+      return (int) (b >> 16);
    }
    return stbi__zhuffman_decode_slowpath(a, z);
 }
@@ -4150,15 +4483,24 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
 {
    char *q;
    unsigned int cur, limit, old_limit;
+   stbi__uint64 want;
    z->zout = zout;
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
-   limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
+   old_limit = (unsigned) (z->zout_end - z->zout_start);
    if (UINT_MAX - cur < (unsigned) n) return stbi__err("outofmem", "Out of memory");
-   while (cur + n > limit) {
-      if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
-      limit *= 2;
-   }
+   // grow to the size the whole output will likely need, going by how much of the input has made cur
+   // bytes, rather than doubling, which reallocs large outputs several times (and overshoots by up to 2x)
+   want = (stbi__uint64) old_limit + old_limit / 8;
+   if (z->zbuffer > z->zbuffer_start) {
+      stbi__uint64 guess = (stbi__uint64) cur * (stbi__uint64) (z->zbuffer_end - z->zbuffer_start) / (stbi__uint64) (z->zbuffer - z->zbuffer_start);
+      guess += guess / 16;
+      // a ratio taken early can be far off (e.g. a long run of zeros at the start), so grow at most 4x at a time
+      if (guess > (stbi__uint64) old_limit * 4) guess = (stbi__uint64) old_limit * 4;
+      if (guess > want) want = guess;
+   }
+   if (want < (stbi__uint64) cur + n) want = (stbi__uint64) cur + n;
+   limit = want > UINT_MAX ? UINT_MAX : (unsigned int) want;
    q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
@@ -4182,11 +4524,169 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// room for the longest match, which is copied 8 bytes at a time
+#define STBI__ZFAST_OUT  (258 + 8)
+
+// how much output is decoded between calls to the flush callback
+#define STBI__ZFLUSH     65536
+
+static int stbi__zflush(stbi__zbuf *a)
+{
+   size_t len = a->zout - a->zout_start;
+   a->flush_at = len + STBI__ZFLUSH;
+   return a->flush(a->flush_user, (stbi_uc *) a->zout_start, len);
+}
+
+stbi_inline static int stbi__zflush_due(stbi__zbuf *a, char *zout)
+{
+   return a->flush && (size_t) (zout - a->zout_start) >= a->flush_at;
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   stbi__uint64 v = 0;
+   int i;
+   for (i=7; i >= 0; --i)
+      v = (v << 8) | p[i];
+   return v;
+#endif
+}
+
+// Decodes symbols while there are 8 bytes of input and room for a match, so neither needs checking.
+// Returns 1 at the end of the block, 0 on errors, and 2 when the input or output runs short
+static int stbi__parse_huffman_fast(stbi__zbuf *a)
+{
+   const stbi__uint32 *lfast = a->z_length.fast, *dfast = a->z_distance.fast;
+   stbi_uc *in = a->zbuffer, *in_last = a->zbuffer_end - 8;
+   char *zout = a->zout, *zout_last = a->zout_end - STBI__ZFAST_OUT;
+   stbi__uint64 bits = a->code_buffer;
+   int num_bits = a->num_bits, result = 2;
+
+   if (a->flush && a->flush_at < (size_t) (zout_last - a->zout_start))
+      zout_last = a->zout_start + a->flush_at;
+
+   while (in <= in_last && zout <= zout_last) {
+      stbi__uint32 b;
+      int s, z, len, dist;
+      char *end;
+      const char *p;
+
+      // tops the buffer up to 56..63 bits, enough for a length and a distance with their extra bits.
+      // the bits above num_bits are the next ones in the input, so loading them again is harmless
+      bits |= stbi__zload64(in) << num_bits;
+      in += (63 - num_bits) >> 3;
+      num_bits |= 56;
+
+      b = lfast[bits & STBI__ZFAST_MASK];
+      if (b & STBI__ZPAIR) {
+         s = b & 255;
+         bits >>= s;
+         num_bits -= s;
+         zout[0] = (char) (b >> 16);
+         zout[1] = (char) (b >> 24);
+         zout += 2;
+         continue;
+      }
+      if (b) {
+         s = b & 255;
+         bits >>= s;
+         num_bits -= s;
+         z = (int) (b >> 16);
+      } else {
+         a->code_buffer = bits; a->num_bits = num_bits;
+         z = stbi__zhuffman_decode_slowpath(a, &a->z_length);
+         bits = a->code_buffer; num_bits = a->num_bits;
+         if (z < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      }
+      if (z < 256) {
+         *zout++ = (char) z;
+         continue;
+      }
+      if (z == 256) {
+         result = 1;
+         break;
+      }
+      if (z >= 286) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      z -= 257;
+      len = stbi__zlength_base[z];
+      s = stbi__zlength_extra[z];
+      if (s) {
+         len += (int) (bits & ((1 << s) - 1));
+         bits >>= s;
+         num_bits -= s;
+      }
+
+      b = dfast[bits & STBI__ZFAST_MASK];
+      if (b) {
+         s = b & 255;
+         bits >>= s;
+         num_bits -= s;
+         z = (int) (b >> 16);
+      } else {
+         a->code_buffer = bits; a->num_bits = num_bits;
+         z = stbi__zhuffman_decode_slowpath(a, &a->z_distance);
+         bits = a->code_buffer; num_bits = a->num_bits;
+      }
+      if (z < 0 || z >= 30) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      dist = stbi__zdist_base[z];
+      s = stbi__zdist_extra[z];
+      if (s) {
+         dist += (int) (bits & ((1 << s) - 1));
+         bits >>= s;
+         num_bits -= s;
+      }
+      if (zout - a->zout_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); break; }
+
+      // the copies may write up to 7 bytes past the end of the match
+      end = zout + len;
+      p = zout - dist;
+      if (dist >= 8) {
+         do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+      } else if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+      } else {
+         // the match repeats every dist bytes, so after the first step bytes (a multiple of dist
+         // of at least 8) it can be copied from step bytes back
+         int step = dist * (1 + 7 / dist);
+         char *q = end - zout < step ? end : zout + step;
+         while (zout < q) *zout++ = *p++;
+         for (p = zout - step; zout < end; zout += 8, p += 8)
+            memcpy(zout, p, 8);
+      }
+      zout = end;
+   }
+
+   // gives the whole bytes in the bit buffer back to the input, leaving the same state as stbi__fill_bits
+   in -= num_bits >> 3;
+   num_bits &= 7;
+   a->zbuffer = in;
+   a->code_buffer = bits & ((1 << num_bits) - 1);
+   a->num_bits = num_bits;
+   a->zout = zout;
+   return result;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (stbi__zflush_due(a, zout)) {
+         a->zout = zout;
+         if (!stbi__zflush(a)) return 0;
+      }
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= STBI__ZFAST_OUT) {
+         a->zout = zout;
+         z = stbi__parse_huffman_fast(a);
+         if (z != 2) return z;
+         zout = a->zout;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4201,11 +4701,12 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
             a->zout = zout;
             return 1;
          }
+         if (z >= 286) return stbi__err("bad huffman code","Corrupt PNG"); // length codes 286 and 287 must not appear
          z -= 257;
          len = stbi__zlength_base[z];
          if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
          z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+         if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG"); // neither must distance codes 30 and 31
          dist = stbi__zdist_base[z];
          if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
@@ -4368,18 +4869,25 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+         stbi__zbuild_pairs(&a->z_length);
          if (!stbi__parse_huffman_block(a)) return 0;
       }
+      if (stbi__zflush_due(a, a->zout) && !stbi__zflush(a)) return 0;
    } while (!final);
    return 1;
 }
 
-static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
+static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header,
+                         int (*flush)(void *user, stbi_uc *out, size_t len), void *flush_user)
 {
+   a->zbuffer_start = a->zbuffer;
    a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->flush = flush;
+   a->flush_user = flush_user;
+   a->flush_at = STBI__ZFLUSH;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4391,7 +4899,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
+   if (stbi__do_zlib(&a, p, initial_size, 1, 1, NULL, NULL)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
@@ -4412,7 +4920,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
+   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header, NULL, NULL)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
@@ -4426,7 +4934,7 @@ STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
-   if (stbi__do_zlib(&a, obuffer, olen, 0, 1))
+   if (stbi__do_zlib(&a, obuffer, olen, 0, 1, NULL, NULL))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -4439,7 +4947,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer+len;
-   if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
+   if (stbi__do_zlib(&a, p, 16384, 1, 0, NULL, NULL)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
@@ -4453,7 +4961,7 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
-   if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
+   if (stbi__do_zlib(&a, obuffer, olen, 0, 0, NULL, NULL))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -4499,6 +5007,8 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   size_t out_stride;        // bytes between the rows of out, when it is the caller's buffer
+   stbi__uint32 rows_done;   // rows of out unfiltered so far, when streaming
 } stbi__png;
 
 
@@ -4533,37 +5043,137 @@ static int stbi__paeth(int a, int b, int c)
    return c;
 }
 
+#ifdef STBI_SSE2
+static __m128i stbi__png_load4(const stbi_uc *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   return n == 4 ? stbi__png_load4(p) : _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+static void stbi__png_store4(stbi_uc *p, __m128i v)
+{
+   int t = _mm_cvtsi128_si32(v);
+   memcpy(p, &t, 4);
+}
+
+// floor((a+b)/2) of each byte
+static __m128i stbi__png_avg_sse2(__m128i a, __m128i b)
+{
+   __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+// stbi__paeth of the 4 low bytes, computed in 16 bits
+static __m128i stbi__png_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a16 = _mm_unpacklo_epi8(a, zero);
+   __m128i b16 = _mm_unpacklo_epi8(b, zero);
+   __m128i c16 = _mm_unpacklo_epi8(c, zero);
+   __m128i pa = _mm_sub_epi16(b16, c16); // p-a
+   __m128i pb = _mm_sub_epi16(a16, c16); // p-b
+   __m128i pc = _mm_add_epi16(pa, pb);   // p-c
+   __m128i smallest, mask, r;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+   // ties go to a, then b
+   mask = _mm_cmpeq_epi16(pb, smallest);
+   r = _mm_or_si128(_mm_and_si128(mask, b16), _mm_andnot_si128(mask, c16));
+   mask = _mm_cmpeq_epi16(pa, smallest);
+   r = _mm_or_si128(_mm_and_si128(mask, a16), _mm_andnot_si128(mask, r));
+   return _mm_packus_epi16(r, r);
+}
+
+// Unfilters count pixels, one pixel per register since each depends on the one to its left. *a and *c are the
+// pixels to the left of cur and prior. Reads and writes 4 bytes per pixel, the caller handles the last one
+static void stbi__png_unfilter_run_sse2(int filter, const stbi_uc *raw, stbi_uc *cur, const stbi_uc *prior, int img_n, int out_n,
+                                        stbi__uint32 count, __m128i *a, __m128i *c)
+{
+   __m128i alpha = _mm_cvtsi32_si128(img_n != out_n ? (int) 0xff000000 : 0);
+   __m128i x = *a, b, d;
+   stbi__uint32 i;
+   #define STBI__CASE(f) \
+      case f: \
+         for (i=0; i < count; ++i, raw += img_n, cur += out_n, prior += out_n)
+   switch (filter) {
+      STBI__CASE(STBI__F_none)         { x = stbi__png_load4(raw); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      STBI__CASE(STBI__F_sub)          { x = _mm_add_epi8(stbi__png_load4(raw), x); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      STBI__CASE(STBI__F_up)           { x = _mm_add_epi8(stbi__png_load4(raw), stbi__png_load4(prior)); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      STBI__CASE(STBI__F_avg)          { x = _mm_add_epi8(stbi__png_load4(raw), stbi__png_avg_sse2(x, stbi__png_load4(prior))); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      STBI__CASE(STBI__F_avg_first)    { x = _mm_add_epi8(stbi__png_load4(raw), stbi__png_avg_sse2(x, _mm_setzero_si128())); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      STBI__CASE(STBI__F_paeth)        { b = stbi__png_load4(prior); d = stbi__png_paeth_sse2(x, b, *c); x = _mm_add_epi8(stbi__png_load4(raw), d); *c = b; stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+      // paeth(a,0,0) is a
+      STBI__CASE(STBI__F_paeth_first)  { x = _mm_add_epi8(stbi__png_load4(raw), x); stbi__png_store4(cur, _mm_or_si128(x, alpha)); } break;
+   }
+   #undef STBI__CASE
+   *a = x;
+}
+
+// Unfilters the x pixels after the first one of a row of 8 bit pixels with 3 or 4 channels,
+// adding an opaque alpha channel if out_n is img_n+1
+static void stbi__png_unfilter_row_sse2(int filter, const stbi_uc *raw, stbi_uc *cur, const stbi_uc *prior, int img_n, int out_n, stbi__uint32 x)
+{
+   stbi_uc last_raw[4] = { 0 }, last_cur[4];
+   __m128i a, c = _mm_setzero_si128();
+   stbi__uint32 k, nk;
+
+   if (x == 0) return;
+   if (filter == STBI__F_up && img_n == out_n) {
+      // no dependency between the pixels
+      nk = x*img_n;
+      for (k=0; k+16 <= nk; k += 16) {
+         __m128i d = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw + k)), _mm_loadu_si128((const __m128i *) (prior + k)));
+         _mm_storeu_si128((__m128i *) (cur + k), d);
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return;
+   }
+
+   // the first pixel, which has been unfiltered already
+   a = stbi__png_load_px(cur - out_n, out_n);
+   if (filter == STBI__F_paeth)
+      c = stbi__png_load_px(prior - out_n, out_n);
+   stbi__png_unfilter_run_sse2(filter, raw, cur, prior, img_n, out_n, x-1, &a, &c);
+
+   // reading 4 bytes of the last pixel could go past the end of raw, and writing 4 bytes past the end of the image
+   raw += (x-1)*img_n;
+   cur += (x-1)*out_n;
+   prior += (x-1)*out_n;
+   memcpy(last_raw, raw, img_n);
+   stbi__png_unfilter_run_sse2(filter, last_raw, last_cur, prior, img_n, out_n, 1, &a, &c);
+   memcpy(cur, last_cur, out_n);
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// unfilters rows j0..j1 of the post-deflated data into a->out, whose rows are row_stride bytes apart.
+// raw points at the filter byte of row j0
+static int stbi__unfilter_png_rows(stbi__png *a, stbi_uc *raw, int out_n, stbi__uint32 x, stbi__uint32 j0, stbi__uint32 j1, int depth, size_t row_stride)
 {
    int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
+   stbi__uint32 i,j;
+   stbi__uint32 img_width_bytes;
    int k;
-   int img_n = s->img_n; // copy it into a local for later
+   int img_n = a->s->img_n; // copy it into a local for later
 
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-   if (!a->out) return stbi__err("outofmem", "Out of memory");
-
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
    img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
 
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
-
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *cur = a->out + row_stride*j;
       stbi_uc *prior;
       int filter = *raw++;
 
@@ -4576,7 +5186,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          filter_bytes = 1;
          width = img_width_bytes;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      prior = cur - row_stride; // bugfix: need to compute this after 'cur +=' computation above
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
@@ -4614,6 +5224,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          prior += 1;
       }
 
+      #ifdef STBI_SSE2
+      if (depth == 8 && img_n >= 3 && (filter != STBI__F_none || img_n != out_n)) {
+         stbi__png_unfilter_row_sse2(filter, raw, cur, prior, img_n, out_n, x-1);
+         raw += (x-1)*img_n;
+         continue;
+      }
+      #endif
+
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;
@@ -4652,13 +5270,42 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          // the loop above sets the high byte of the pixels' alpha, but for
          // 16 bit png files we also need the low byte set. we'll do that here.
          if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
+            cur = a->out + row_stride*j; // start at the beginning of the row again
             for (i=0; i < x; ++i,cur+=output_bytes) {
                cur[filter_bytes+1] = 255;
             }
          }
       }
    }
+   return 1;
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+   stbi__context *s = a->s;
+   stbi__uint32 i,j,stride = x*out_n*bytes;
+   stbi__uint32 img_len, img_width_bytes;
+   int k;
+   int img_n = s->img_n; // copy it into a local for later
+
+   int output_bytes = out_n*bytes;
+
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+
+   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   img_len = (img_width_bytes + 1) * y;
+
+   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
+   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
+   // so just check for raw_len < img_len always.
+   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+
+   if (!stbi__unfilter_png_rows(a, raw, out_n, x, 0, y, depth, stride)) return 0;
 
    // we make a separate pass to expand bits to pixels; for performance,
    // this could run two scanlines behind the above code, so it won't
@@ -4792,6 +5439,47 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
+// unfilters the rows that have been inflated so far straight into the caller's buffer. the last of
+// them isn't reported until the next one is unfiltered, since that reads it
+static int stbi__png_flush_rows(void *user, stbi_uc *raw, size_t len)
+{
+   stbi__png *z = (stbi__png *) user;
+   stbi__context *s = z->s;
+   size_t row_bytes = (size_t) s->img_x * s->img_n + 1;
+   size_t rows = len / row_bytes;
+   if (rows > s->img_y) rows = s->img_y;
+   if (rows > z->rows_done) {
+      if (!stbi__unfilter_png_rows(z, raw + z->rows_done*row_bytes, s->img_out_n, s->img_x, z->rows_done, (stbi__uint32) rows, 8, z->out_stride))
+         return 0;
+      z->rows_done = (stbi__uint32) rows;
+      stbi__into_rows(s, rows == s->img_y ? z->rows_done : z->rows_done - 1);
+   }
+   return 1;
+}
+
+// inflates an 8-bit non-interlaced image into z->out, unfiltering the rows as they are decoded
+static int stbi__png_inflate_rows(stbi__png *z, stbi__uint32 ioff, stbi__uint32 initial_size)
+{
+   stbi__context *s = z->s;
+   stbi__zbuf a;
+   char *p;
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, 8, 7)) return stbi__err("too large", "Corrupt PNG");
+   p = (char *) stbi__malloc(initial_size);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + ioff;
+   z->rows_done = 0;
+   if (!stbi__do_zlib(&a, p, initial_size, 1, 1, stbi__png_flush_rows, z)) {
+      STBI_FREE(a.zout_start);
+      return 0;
+   }
+   z->expanded = (stbi_uc *) a.zout_start;
+   STBI_FREE(z->idata); z->idata = NULL;
+   if ((size_t) (a.zout - a.zout_start) < ((size_t) s->img_x * s->img_n + 1) * s->img_y)
+      return stbi__err("not enough pixels","Corrupt PNG");
+   return stbi__png_flush_rows(z, z->expanded, a.zout - a.zout_start);
+}
+
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 {
    stbi__context *s = z->s;
@@ -4981,7 +5669,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
-               if (scan == STBI__SCAN_header) return 1;
+               // grey and rgb images can have a tRNS, which adds an alpha channel, so those scan on to IDAT
+               if (scan == STBI__SCAN_header && !(s->img_n & 1)) return 1;
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
@@ -5019,6 +5708,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
+               if (scan == STBI__SCAN_header) { ++s->img_n; return 1; }
                has_trans = 1;
                if (z->depth == 16) {
                   for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
@@ -5032,7 +5722,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
-            if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (scan == STBI__SCAN_header) { if (pal_img_n) s->img_n = pal_img_n; return 1; }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -5057,14 +5747,21 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            // when the unfiltered rows are the final result, they go straight to the caller's buffer
+            if (z->depth == 8 && !interlace && !pal_img_n && !has_trans && !is_iphone && s->img_out_n == req_comp)
+               z->out = stbi__into_buffer(s, s->img_x, s->img_y, s->img_out_n, &z->out_stride);
+            if (z->out) {
+               if (!stbi__png_inflate_rows(z, ioff, raw_len)) return 0;
+            } else {
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+               STBI_FREE(z->idata); z->idata = NULL;
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            }
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -5138,7 +5835,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
+   if (p->out != p->s->into) STBI_FREE(p->out);
+   p->out      = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
    STBI_FREE(p->idata);    p->idata    = NULL;
 
@@ -5395,7 +6093,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
    if (psize == 0) {
       STBI_ASSERT(info.offset == s->callback_already_read + (int) (s->img_buffer - s->img_buffer_original));
-      if (info.offset != s->callback_already_read + (s->img_buffer - s->buffer_start)) {
+      if (info.offset != s->callback_already_read + (s->img_buffer - s->img_buffer_original)) {
         return stbi__errpuc("bad offset", "Corrupt BMP");
       }
    }
@@ -68,6 +68,7 @@ USAGE:
       int stbi_write_tga_with_rle;             // defaults to true; set to 0 to disable RLE
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
+      int stbi_write_png_reduce;               // defaults to 0; set to 1 to write pngs in the smallest exact format
 
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
@@ -97,7 +98,16 @@ USAGE:
    at the end of the line.)
 
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). Levels below
+   8 use a single fixed huffman block, which is faster but larger.
+
+   With 'stbi_write_png_reduce' set, RGB(A) images with at most 256 colors
+   are written as 8-bit paletted pngs (with a tRNS chunk for the translucent
+   colors), and an alpha channel that is opaque everywhere is left out. The
+   pixels are unchanged. PNG has no 16-bit rgb565/rgba4444 formats, so other
+   images keep 8 bits per channel: an rgb565 preview only gets 10-15% smaller
+   (from leaving out the alpha), and an rgba4444 one doesn't shrink at all.
+   Paletted previews were 1.5-2x smaller on our test images.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -169,6 +179,7 @@ LICENSE
 extern int stbi_write_tga_with_rle;
 extern int stbi_write_png_compression_level;
 extern int stbi_write_force_png_filter;
+extern int stbi_write_png_reduce;
 #endif
 
 #ifndef STBI_WRITE_NO_STDIO
@@ -191,6 +202,18 @@ STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
 
+// Png encoding that filters and compresses bands of the image on several threads. parallel(context, count,
+// task, data) must call task(data, i) for each i in [0, count) and return once they have all finished.
+// Large images are split into fixed size bands, so the output doesn't depend on the number of threads.
+// The _to_func version streams the png through func, and only keeps a few bands in memory.
+typedef void stbi_write_parallel_task(void *data, int index);
+typedef void stbi_write_parallel_func(void *context, int count, stbi_write_parallel_task *task, void *data);
+
+STBIWDEF unsigned char *stbi_write_png_to_mem_parallel(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len,
+                                                       stbi_write_parallel_func *parallel, void *parallel_context);
+STBIWDEF int stbi_write_png_to_func_parallel(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes,
+                                             stbi_write_parallel_func *parallel, void *parallel_context);
+
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #endif//INCLUDE_STB_IMAGE_WRITE_H
@@ -215,6 +238,25 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #include <string.h>
 #include <math.h>
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// The checksums also have SSSE3, AVX2 and PCLMUL versions, selected at runtime
+#if defined(STBIW_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define STBIW_X86_DISPATCH
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define STBIW_TARGET(x)
+#else
+#define STBIW_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
 #if defined(STBIW_MALLOC) && defined(STBIW_FREE) && (defined(STBIW_REALLOC) || defined(STBIW_REALLOC_SIZED))
 // ok
 #elif !defined(STBIW_MALLOC) && !defined(STBIW_FREE) && !defined(STBIW_REALLOC) && !defined(STBIW_REALLOC_SIZED)
@@ -250,10 +292,12 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
+static int stbi_write_png_reduce = 0;
 #else
 int stbi_write_png_compression_level = 8;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
+int stbi_write_png_reduce = 0;
 #endif
 
 static int stbi__flip_vertically_on_write = 0;
@@ -843,24 +887,98 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
+#ifdef STBIW_X86_DISPATCH
+enum
+{
+   STBIW__CPU_SSSE3  = 1,
+   STBIW__CPU_AVX2   = 2,
+   STBIW__CPU_PCLMUL = 4
+};
+
+static int stbiw__detect_cpu_features(void)
+{
+   int f = 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+   int info[4], max_leaf;
+   __cpuid(info, 0);
+   max_leaf = info[0];
+   __cpuid(info, 1);
+   if (info[2] & (1 << 9)) f |= STBIW__CPU_SSSE3;
+   if (info[2] & (1 << 1)) f |= STBIW__CPU_PCLMUL;
+   if (max_leaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      if (info[1] & (1 << 5)) f |= STBIW__CPU_AVX2;
+   }
+#else
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("ssse3")) f |= STBIW__CPU_SSSE3;
+   if (__builtin_cpu_supports("avx2")) f |= STBIW__CPU_AVX2;
+   if (__builtin_cpu_supports("pclmul")) f |= STBIW__CPU_PCLMUL;
+#endif
+   return f;
+}
+
+// The features are detected on first use and cached in an atomic, since the checksums
+// are computed from several threads at once (the png bands, or several images being written)
+static int stbiw__cpu_features(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+   static long features = -1;
+   long f = _InterlockedCompareExchange(&features, -1, -1);
+   if (f == -1) {
+      f = stbiw__detect_cpu_features();
+      _InterlockedExchange(&features, f);
+   }
+   return (int) f;
+#else
+   static int features = -1;
+   int f = __atomic_load_n(&features, __ATOMIC_RELAXED);
+   if (f == -1) {
+      f = stbiw__detect_cpu_features();
+      __atomic_store_n(&features, f, __ATOMIC_RELAXED);
+   }
+   return f;
+#endif
+}
+#endif // STBIW_X86_DISPATCH
+
+static int stbiw__ctz(unsigned int v)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+   unsigned long i;
+   _BitScanForward(&i, v);
+   return (int) i;
+#elif defined(__GNUC__) || defined(__clang__)
+   return __builtin_ctz(v);
+#else
+   int i=0;
+   while (!(v & 1)) { v >>= 1; ++i; }
+   return i;
+#endif
+}
+
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i=0;
+   if (limit > 258) limit = 258;
+#ifdef STBIW_SSE2
+   // compare 16 bytes at a time, the first mismatch is the lowest zero bit of the mask
+   for (; i+16 <= limit; i += 16) {
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (a+i)), _mm_loadu_si128((__m128i *) (b+i)))) ^ 0xffff;
+      if (mask) return i + stbiw__ctz(mask);
+   }
+#endif
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
 
+// Hashes 4 bytes rather than the minimum match length of 3: with 3 and 4 channel pixels this keeps
+// the chains much shorter, and the candidates that are skipped would rarely be the longest match.
 static unsigned int stbiw__zhash(unsigned char *data)
 {
-   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
+   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16) + ((stbiw_uint32) data[3] << 24);
+   return (hash * 2654435761u) >> 17; // 15 bits, stbiw__ZHASH
 }
 
 #define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
@@ -875,115 +993,665 @@ static unsigned int stbiw__zhash(unsigned char *data)
 #define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
 #define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
 
-#define stbiw__ZHASH   16384
+static unsigned short stbiw__zlib_lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static unsigned char  stbiw__zlib_lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static unsigned short stbiw__zlib_distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+static unsigned char  stbiw__zlib_disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
 
-#endif // STBIW_ZLIB_COMPRESS
+#define stbiw__ZHASH   32768
+#define stbiw__ZWINDOW 32768   // must be a power of two
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// zlib style hash chains: head[h] is the most recent position with hash h, and prev[] links each
+// position to the previous one with the same hash. Both are flat arrays allocated once.
+typedef struct
+{
+   int *head;
+   int *prev;    // indexed by position & (stbiw__ZWINDOW-1), only valid inside the window
+   int max_chain;
+   int nice_length;
+} stbiw__zmatcher;
+
+// Search effort per quality level, from 5 to 15 (like zlib's configuration_table):
+// max_chain candidates are followed, a match of nice_length stops the search, matches shorter than
+// max_lazy are compared with the match at the next byte (with max_chain/4 candidates if they are at
+// least good_length long), and their positions are all added to the hash chains.
+static struct { unsigned short max_chain, good_length, nice_length, max_lazy; } stbiw__zlib_levels[] =
+{
+   {    4,   4,  16,   8 },
+   {    6,   6,  24,  12 },
+   {    8,   8,  32,  16 },
+   {   12,   8,  48,  24 }, // default
+   {   16,   8,  64,  32 },
+   {   32,  32, 128, 128 },
+   {   64,  32, 258, 258 },
+   {  128,  32, 258, 258 },
+   {  256,  64, 258, 258 },
+   { 1024,  64, 258, 258 },
+   { 4096, 128, 258, 258 },
+};
+
+static void stbiw__zmatcher_insert(stbiw__zmatcher *m, unsigned char *data, int pos)
+{
+   int h = stbiw__zhash(data+pos)&(stbiw__ZHASH-1);
+   m->prev[pos & (stbiw__ZWINDOW-1)] = m->head[h];
+   m->head[h] = pos;
+}
+
+// Longest match for data+pos among the previous positions in the window. Returns 0 if there is
+// none of at least 3 bytes. The position itself must not be inserted yet.
+static int stbiw__zmatcher_find(stbiw__zmatcher *m, unsigned char *data, int data_len, int pos, int *match_pos)
+{
+   int limit = pos - (stbiw__ZWINDOW-1); // distances are at most 32767
+   int cur = m->head[stbiw__zhash(data+pos)&(stbiw__ZHASH-1)];
+   int chain = m->max_chain, best = 2, max_len = data_len - pos;
+   while (cur >= 0 && cur >= limit && chain-- > 0) {
+      // the match can only be longer if it also matches at the current best length
+      if (data[cur+best] == data[pos+best]) {
+         int d = stbiw__zlib_countm(data+cur, data+pos, max_len);
+         if (d > best) {
+            best = d;
+            *match_pos = cur;
+            if (d >= m->nice_length || d >= max_len) break;
+         }
+      }
+      cur = m->prev[cur & (stbiw__ZWINDOW-1)];
+   }
+   return best >= 3 ? best : 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Dynamic huffman blocks (quality >= stbiw__ZDYNAMIC)
+//
+// The matches are buffered, and the stream is cut into chunks of stbiw__ZCHUNK symbols. A chunk
+// starts a new block when its statistics differ enough from the current block that coding them
+// separately (with the cost of a new header) is estimated to be cheaper. Each block is then written
+// as a dynamic, fixed or stored block, whichever is smallest.
+
+#define stbiw__ZDYNAMIC     8
+#define stbiw__ZCHUNK       4096
+#define stbiw__ZMAX_SYMS    65536    // longest block
+// symbols buffered at most: a full block, a chunk that isn't part of it yet, and the 3 trailing literals
+#define stbiw__ZBUF_SYMS    (stbiw__ZMAX_SYMS + stbiw__ZCHUNK + 3)
+#define stbiw__ZSPLIT_COST  (96*8)   // estimated cost in bits of a block header
+
+typedef struct
+{
+   unsigned short *litlen;    // literal byte, or 256 + match length
+   unsigned short *dist;      // 0 for literals
+   int num_syms;
+   int chunk_start;           // first symbol of the chunk that isn't part of the block yet
+   int block_pos, chunk_pos;  // input position of the first symbol of the block and of the chunk
+   unsigned int lfreq[286], dfreq[30];                 // block
+   unsigned int chunk_lfreq[286], chunk_dfreq[30];
+   unsigned char lcode[259];  // length -> length code - 257
+   unsigned char dcode[512];  // see stbiw__zlib_dcode
+} stbiw__zblock;
+
+static int stbiw__zlib_dcode(stbiw__zblock *b, int d)
+{
+   return d <= 256 ? b->dcode[d-1] : b->dcode[256 + ((d-1) >> 7)];
+}
+
+// Huffman code lengths for the symbols with a non zero frequency, no longer than max_bits
+static void stbiw__zlib_huffman_lengths(const unsigned int *freq, int num, int max_bits, unsigned char *lengths)
+{
+   int sym[288], parent[2*288], depth[2*288], bl_count[16];
+   unsigned int w[2*288];
+   int i, j, n=0, leaf, node, next, total;
+
+   for (i=0; i < num; ++i) {
+      lengths[i] = 0;
+      if (freq[i]) sym[n++] = i;
+   }
+   // decoders expect at least two codes
+   for (i=0; n < 2; ++i)
+      if (!freq[i]) sym[n++] = i;
+
+   // sort by frequency, rarest first (the unused padding symbols count as 1)
+   for (i=1; i < n; ++i) {
+      int s = sym[i];
+      unsigned int f = freq[s] ? freq[s] : 1;
+      for (j=i; j > 0 && (freq[sym[j-1]] ? freq[sym[j-1]] : 1) > f; --j)
+         sym[j] = sym[j-1];
+      sym[j] = s;
+   }
+   for (i=0; i < n; ++i)
+      w[i] = freq[sym[i]] ? freq[sym[i]] : 1;
+
+   // the leaves are sorted, and the internal nodes are created in increasing weight order,
+   // so the two lightest nodes are always at the front of one of the two queues
+   leaf = 0; node = n;
+   for (next=n; next < 2*n-1; ++next) {
+      int a, b;
+      a = (leaf < n && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+      b = (leaf < n && (node >= next || w[leaf] <= w[node])) ? leaf++ : node++;
+      w[next] = w[a] + w[b];
+      parent[a] = parent[b] = next;
+   }
+   depth[2*n-2] = 0;
+   for (i=2*n-3; i >= 0; --i)
+      depth[i] = depth[parent[i]] + 1;
+
+   // limit the lengths, then fix the kraft sum by lengthening the shortest codes that can be
+   for (i=0; i <= max_bits; ++i) bl_count[i] = 0;
+   for (i=0; i < n; ++i) bl_count[depth[i] < max_bits ? depth[i] : max_bits]++;
+   total = 0;
+   for (i=1; i <= max_bits; ++i) total += bl_count[i] << (max_bits - i);
+   while (total > (1 << max_bits)) {
+      bl_count[max_bits]--;
+      for (i=max_bits-1; i > 0; --i) {
+         if (bl_count[i]) {
+            bl_count[i]--;
+            bl_count[i+1] += 2;
+            break;
+         }
+      }
+      total--;
+   }
+
+   // the rarest symbols get the longest codes
+   j = 0;
+   for (i=max_bits; i > 0; --i) {
+      int k;
+      for (k=0; k < bl_count[i]; ++k)
+         lengths[sym[j++]] = (unsigned char) i;
+   }
+}
+
+// Canonical codes, bit reversed since deflate writes them lsb first
+static void stbiw__zlib_huffman_codes(const unsigned char *lengths, int num, unsigned short *codes)
+{
+   int bl_count[16], next_code[16], i, code=0;
+   for (i=0; i < 16; ++i) bl_count[i] = 0;
+   for (i=0; i < num; ++i) bl_count[lengths[i]]++;
+   bl_count[0] = 0;
+   for (i=1; i < 16; ++i) {
+      code = (code + bl_count[i-1]) << 1;
+      next_code[i] = code;
+   }
+   for (i=0; i < num; ++i)
+      codes[i] = lengths[i] ? (unsigned short) stbiw__zlib_bitrev(next_code[lengths[i]]++, lengths[i]) : 0;
+}
+
+// Estimated size in bits of the symbols with an ideal entropy coder (the extra bits are left out,
+// they are the same however the blocks are split)
+static double stbiw__zlib_entropy(const unsigned int *lfreq, const unsigned int *dfreq, const unsigned int *lfreq2, const unsigned int *dfreq2)
+{
+   double bits = 0, total_l = 0, total_d = 0;
+   int i;
+   for (i=0; i < 286; ++i) {
+      double f = lfreq[i] + (lfreq2 ? lfreq2[i] : 0);
+      if (f) { bits -= f * log(f); total_l += f; }
+   }
+   for (i=0; i < 30; ++i) {
+      double f = dfreq[i] + (dfreq2 ? dfreq2[i] : 0);
+      if (f) { bits -= f * log(f); total_d += f; }
+   }
+   if (total_l) bits += total_l * log(total_l);
+   if (total_d) bits += total_d * log(total_d);
+   return bits / log(2.0);
+}
+
+static unsigned char *stbiw__zlib_write_symbols(unsigned char *out, unsigned int *pbitbuf, int *pbitcount, stbiw__zblock *b, int num_syms,
+                                                const unsigned char *llen, const unsigned short *lcodes, const unsigned char *dlen, const unsigned short *dcodes)
+{
+   unsigned int bitbuf = *pbitbuf;
+   int bitcount = *pbitcount, i;
+   for (i=0; i < num_syms; ++i) {
+      int v = b->litlen[i];
+      if (v < 256) {
+         stbiw__zlib_add(lcodes[v], llen[v]);
+      } else {
+         int len = v - 256, d = b->dist[i];
+         int lc = b->lcode[len], dc = stbiw__zlib_dcode(b, d);
+         stbiw__zlib_add(lcodes[257+lc], llen[257+lc]);
+         if (stbiw__zlib_lengtheb[lc]) stbiw__zlib_add(len - stbiw__zlib_lengthc[lc], stbiw__zlib_lengtheb[lc]);
+         stbiw__zlib_add(dcodes[dc], dlen[dc]);
+         if (stbiw__zlib_disteb[dc]) stbiw__zlib_add(d - stbiw__zlib_distc[dc], stbiw__zlib_disteb[dc]);
+      }
+   }
+   stbiw__zlib_add(lcodes[256], llen[256]);
+   *pbitbuf = bitbuf;
+   *pbitcount = bitcount;
+   return out;
+}
+
+// Writes the first num_syms symbols of the block, covering data[b->block_pos, end_pos)
+static unsigned char *stbiw__zlib_write_block(unsigned char *out, unsigned int *pbitbuf, int *pbitcount, stbiw__zblock *b, int num_syms,
+                                              unsigned char *data, int end_pos, int final)
+{
+   static unsigned char clen_order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+   unsigned char llen[286], dlen[30], fixed_llen[288], fixed_dlen[30], clen[19], lens[286+30];
+   unsigned short lcodes[288], dcodes[30], ccodes[19];
+   unsigned int cfreq[19];
+   unsigned char rle[286+30];  // code length symbols
+   unsigned char rle_extra[286+30];
+   int num_rle=0, hlit, hdist, hclen, i, j;
+   unsigned int bitbuf = *pbitbuf;
+   int bitcount = *pbitcount;
+   double extra_bits=0, dynamic_bits, fixed_bits, stored_bits;
+   int stored_len = end_pos - b->block_pos;
+
+   b->lfreq[256] = 1;
+   stbiw__zlib_huffman_lengths(b->lfreq, 286, 15, llen);
+   stbiw__zlib_huffman_lengths(b->dfreq, 30, 15, dlen);
+
+   for (hlit=286; hlit > 257 && !llen[hlit-1]; --hlit);
+   for (hdist=30; hdist > 1 && !dlen[hdist-1]; --hdist);
+   for (i=0; i < hlit; ++i) lens[i] = llen[i];
+   for (i=0; i < hdist; ++i) lens[hlit+i] = dlen[i];
+
+   // run length encode the code lengths
+   for (i=0; i < 19; ++i) cfreq[i] = 0;
+   for (i=0; i < hlit+hdist; i += j) {
+      int v = lens[i];
+      for (j=1; i+j < hlit+hdist && lens[i+j] == v; ++j);
+      if (v == 0 && j >= 11) {
+         if (j > 138) j = 138;
+         rle[num_rle] = 18; rle_extra[num_rle++] = (unsigned char) (j - 11);
+      } else if (v == 0 && j >= 3) {
+         rle[num_rle] = 17; rle_extra[num_rle++] = (unsigned char) (j - 3);
+      } else if (v != 0 && j >= 4) {
+         if (j > 7) j = 7;
+         rle[num_rle++] = (unsigned char) v;
+         rle[num_rle] = 16; rle_extra[num_rle++] = (unsigned char) (j - 4);
+      } else {
+         j = 1;
+         rle[num_rle++] = (unsigned char) v;
+      }
+   }
+   for (i=0; i < num_rle; ++i) cfreq[rle[i]]++;
+   stbiw__zlib_huffman_lengths(cfreq, 19, 7, clen);
+   for (hclen=19; hclen > 4 && !clen[clen_order[hclen-1]]; --hclen);
+
+   // size of each block type
+   for (i=0; i < 288; ++i) fixed_llen[i] = (unsigned char) (i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8);
+   for (i=0; i < 30; ++i) fixed_dlen[i] = 5;
+   for (i=0; i < 29; ++i) extra_bits += (double) b->lfreq[257+i] * stbiw__zlib_lengtheb[i];
+   for (i=0; i < 30; ++i) extra_bits += (double) b->dfreq[i] * stbiw__zlib_disteb[i];
+   dynamic_bits = 3 + 14 + 3*hclen + extra_bits;
+   for (i=0; i < 19; ++i) dynamic_bits += (double) cfreq[i] * (clen[i] + (i == 16 ? 2 : i == 17 ? 3 : i == 18 ? 7 : 0));
+   fixed_bits = 3 + extra_bits;
+   for (i=0; i < 286; ++i) {
+      dynamic_bits += (double) b->lfreq[i] * llen[i];
+      fixed_bits += (double) b->lfreq[i] * fixed_llen[i];
+   }
+   for (i=0; i < 30; ++i) {
+      dynamic_bits += (double) b->dfreq[i] * dlen[i];
+      fixed_bits += (double) b->dfreq[i] * fixed_dlen[i];
+   }
+   stored_bits = ((stored_len + 65534) / 65535) * (3 + 7 + 32) + 8.0 * stored_len;
+   if (stored_len == 0) stored_bits = 1e30;
+
+   if (stored_bits < dynamic_bits && stored_bits < fixed_bits) {
+      unsigned char *p = data + b->block_pos;
+      do {
+         int len = stored_len < 65535 ? stored_len : 65535;
+         stored_len -= len;
+         stbiw__zlib_add(final && stored_len == 0, 1);
+         stbiw__zlib_add(0, 2);  // BTYPE = 0 -- stored
+         while (bitcount)
+            stbiw__zlib_add(0, 1);
+         stbiw__sbpush(out, STBIW_UCHAR(len));
+         stbiw__sbpush(out, STBIW_UCHAR(len >> 8));
+         stbiw__sbpush(out, STBIW_UCHAR(~len));
+         stbiw__sbpush(out, STBIW_UCHAR(~len >> 8));
+         stbiw__sbmaybegrow(out, len);
+         STBIW_MEMMOVE(out + stbiw__sbn(out), p, len);
+         stbiw__sbn(out) += len;
+         p += len;
+      } while (stored_len > 0);
+   } else if (fixed_bits <= dynamic_bits) {
+      stbiw__zlib_add(final, 1);
+      stbiw__zlib_add(1, 2);  // BTYPE = 1 -- fixed huffman
+      stbiw__zlib_huffman_codes(fixed_llen, 288, lcodes);
+      stbiw__zlib_huffman_codes(fixed_dlen, 30, dcodes);
+      out = stbiw__zlib_write_symbols(out, &bitbuf, &bitcount, b, num_syms, fixed_llen, lcodes, fixed_dlen, dcodes);
+   } else {
+      stbiw__zlib_add(final, 1);
+      stbiw__zlib_add(2, 2);  // BTYPE = 2 -- dynamic huffman
+      stbiw__zlib_add(hlit - 257, 5);
+      stbiw__zlib_add(hdist - 1, 5);
+      stbiw__zlib_add(hclen - 4, 4);
+      for (i=0; i < hclen; ++i)
+         stbiw__zlib_add(clen[clen_order[i]], 3);
+      stbiw__zlib_huffman_codes(clen, 19, ccodes);
+      for (i=0; i < num_rle; ++i) {
+         int c = rle[i];
+         stbiw__zlib_add(ccodes[c], clen[c]);
+         if (c == 16) stbiw__zlib_add(rle_extra[i], 2);
+         if (c == 17) stbiw__zlib_add(rle_extra[i], 3);
+         if (c == 18) stbiw__zlib_add(rle_extra[i], 7);
+      }
+      stbiw__zlib_huffman_codes(llen, 286, lcodes);
+      stbiw__zlib_huffman_codes(dlen, 30, dcodes);
+      out = stbiw__zlib_write_symbols(out, &bitbuf, &bitcount, b, num_syms, llen, lcodes, dlen, dcodes);
+   }
+   *pbitbuf = bitbuf;
+   *pbitcount = bitcount;
+   return out;
+}
+
+// Called when the pending chunk is complete (or at the end of the data, with last set): either
+// adds it to the block, or writes the block and starts a new one with the chunk
+static unsigned char *stbiw__zlib_end_chunk(unsigned char *out, unsigned int *pbitbuf, int *pbitcount, stbiw__zblock *b,
+                                            unsigned char *data, int pos, int last, int final)
+{
+   int i, split = 0;
+   if (b->chunk_start > 0) {
+      double separate = stbiw__zlib_entropy(b->lfreq, b->dfreq, 0, 0) + stbiw__zlib_entropy(b->chunk_lfreq, b->chunk_dfreq, 0, 0) + stbiw__ZSPLIT_COST;
+      double merged = stbiw__zlib_entropy(b->lfreq, b->dfreq, b->chunk_lfreq, b->chunk_dfreq);
+      split = separate < merged || b->num_syms > stbiw__ZMAX_SYMS;
+   }
+   if (split) {
+      int chunk_syms = b->num_syms - b->chunk_start;
+      out = stbiw__zlib_write_block(out, pbitbuf, pbitcount, b, b->chunk_start, data, b->chunk_pos, 0);
+      STBIW_MEMMOVE(b->litlen, b->litlen + b->chunk_start, chunk_syms * sizeof(b->litlen[0]));
+      STBIW_MEMMOVE(b->dist, b->dist + b->chunk_start, chunk_syms * sizeof(b->dist[0]));
+      b->num_syms = chunk_syms;
+      b->block_pos = b->chunk_pos;
+      for (i=0; i < 286; ++i) b->lfreq[i] = b->chunk_lfreq[i];
+      for (i=0; i < 30; ++i) b->dfreq[i] = b->chunk_dfreq[i];
+   } else {
+      for (i=0; i < 286; ++i) b->lfreq[i] += b->chunk_lfreq[i];
+      for (i=0; i < 30; ++i) b->dfreq[i] += b->chunk_dfreq[i];
+   }
+   for (i=0; i < 286; ++i) b->chunk_lfreq[i] = 0;
+   for (i=0; i < 30; ++i) b->chunk_dfreq[i] = 0;
+   b->chunk_start = b->num_syms;
+   b->chunk_pos = pos;
+
+   if (last) {
+      out = stbiw__zlib_write_block(out, pbitbuf, pbitcount, b, b->num_syms, data, pos, final);
+      b->num_syms = b->chunk_start = 0;
+   }
+   return out;
+}
+
+static void stbiw__zblock_init(stbiw__zblock *b, int pos)
+{
+   int i, j;
+   b->num_syms = b->chunk_start = 0;
+   b->block_pos = b->chunk_pos = pos;
+   for (i=0; i < 286; ++i) b->lfreq[i] = b->chunk_lfreq[i] = 0;
+   for (i=0; i < 30; ++i) b->dfreq[i] = b->chunk_dfreq[i] = 0;
+   for (i=0; i < 29; ++i)
+      for (j=stbiw__zlib_lengthc[i]; j < stbiw__zlib_lengthc[i+1] && j <= 258; ++j)
+         b->lcode[j] = (unsigned char) i;
+   // distances up to 256 are looked up directly, longer ones by steps of 128
+   for (i=0; i < 30; ++i) {
+      for (j=stbiw__zlib_distc[i]; j < stbiw__zlib_distc[i+1]; ++j) {
+         if (j <= 256) b->dcode[j-1] = (unsigned char) i;
+         else b->dcode[256 + ((j-1) >> 7)] = (unsigned char) i;
+      }
+   }
+}
+
+#define stbiw__zblock_literal(b,c) \
+      ((b)->litlen[(b)->num_syms] = (c), (b)->dist[(b)->num_syms++] = 0, (b)->chunk_lfreq[c]++)
+#define stbiw__zblock_match(b,len,d) \
+      ((b)->litlen[(b)->num_syms] = (unsigned short) (256 + (len)), (b)->dist[(b)->num_syms++] = (unsigned short) (d), \
+       (b)->chunk_lfreq[257 + (b)->lcode[len]]++, (b)->chunk_dfreq[stbiw__zlib_dcode(b, d)]++)
+
+// Appends the raw deflate blocks for data[start, data_len) to the stretchy buffer out, using the
+// preceding 32KB as the dictionary. If final isn't set the output ends with a sync flush, so that
+// it can be followed by the blocks of the next part of the data. Returns NULL if out of memory.
+static unsigned char *stbiw__zlib_deflate(unsigned char *out, unsigned char *data, int start, int data_len, int quality, int final)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
+   int max_chain, good_length, max_lazy, dynamic = quality >= stbiw__ZDYNAMIC;
+   stbiw__zmatcher m;
+   stbiw__zblock *block = NULL;
+   m.head = (int *) STBIW_MALLOC(stbiw__ZHASH * sizeof(int));
+   m.prev = (int *) STBIW_MALLOC(stbiw__ZWINDOW * sizeof(int));
+   if (dynamic) {
+      block = (stbiw__zblock *) STBIW_MALLOC(sizeof(stbiw__zblock));
+      if (block) {
+         block->litlen = (unsigned short *) STBIW_MALLOC(stbiw__ZBUF_SYMS * sizeof(unsigned short));
+         block->dist = (unsigned short *) STBIW_MALLOC(stbiw__ZBUF_SYMS * sizeof(unsigned short));
+      }
+   }
+   if (m.head == NULL || m.prev == NULL || (dynamic && (block == NULL || block->litlen == NULL || block->dist == NULL))) {
+      STBIW_FREE(m.head);
+      STBIW_FREE(m.prev);
+      if (block) {
+         STBIW_FREE(block->litlen);
+         STBIW_FREE(block->dist);
+         STBIW_FREE(block);
+      }
+      stbiw__sbfree(out);
       return NULL;
+   }
    if (quality < 5) quality = 5;
-
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+   if (quality > 15) quality = 15;
+   max_chain = stbiw__zlib_levels[quality-5].max_chain;
+   good_length = stbiw__zlib_levels[quality-5].good_length;
+   max_lazy = stbiw__zlib_levels[quality-5].max_lazy;
+   m.max_chain = max_chain;
+   m.nice_length = stbiw__zlib_levels[quality-5].nice_length;
+
+   if (dynamic) {
+      stbiw__zblock_init(block, start);
+   } else {
+      stbiw__zlib_add(final,1);  // BFINAL
+      stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+   }
 
    for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
+      m.head[i] = -1;
+   for (i=start > stbiw__ZWINDOW ? start - stbiw__ZWINDOW : 0; i < start && i < data_len-3; ++i)
+      stbiw__zmatcher_insert(&m, data, i);
 
-   i=0;
+   i=start;
    while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) { best=d; bestloc=hlist[j]; }
-         }
-      }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
+      int match_pos = 0, next_pos;
+      int best = stbiw__zmatcher_find(&m, data, data_len, i, &match_pos);
+      stbiw__zmatcher_insert(&m, data, i);
 
-      if (bestloc) {
+      if (best && best < max_lazy && i+1 < data_len-3) {
          // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
-         }
+         m.max_chain = best >= good_length ? max_chain >> 2 : max_chain;
+         if (stbiw__zmatcher_find(&m, data, data_len, i+1, &next_pos) > best)
+            best = 0;
+         m.max_chain = max_chain;
       }
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
+      if (best) {
+         int d = i - match_pos; // distance back
          STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbiw__zlib_huff(j+257);
-         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         if (dynamic) {
+            stbiw__zblock_match(block, best, d);
+         } else {
+            for (j=0; best > stbiw__zlib_lengthc[j+1]-1; ++j);
+            stbiw__zlib_huff(j+257);
+            if (stbiw__zlib_lengtheb[j]) stbiw__zlib_add(best - stbiw__zlib_lengthc[j], stbiw__zlib_lengtheb[j]);
+            for (j=0; d > stbiw__zlib_distc[j+1]-1; ++j);
+            stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
+            if (stbiw__zlib_disteb[j]) stbiw__zlib_add(d - stbiw__zlib_distc[j], stbiw__zlib_disteb[j]);
+         }
+         // the positions inside short matches are candidates for later matches too
+         if (best <= max_lazy)
+            for (j=1; j < best && i+j < data_len-3; ++j)
+               stbiw__zmatcher_insert(&m, data, i+j);
          i += best;
+      } else if (dynamic) {
+         stbiw__zblock_literal(block, data[i]);
+         ++i;
       } else {
          stbiw__zlib_huffb(data[i]);
          ++i;
       }
+      if (dynamic && block->num_syms - block->chunk_start >= stbiw__ZCHUNK)
+         out = stbiw__zlib_end_chunk(out, &bitbuf, &bitcount, block, data, i, 0, 0);
    }
    // write out final bytes
-   for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
-   stbiw__zlib_huff(256); // end of block
+   if (dynamic) {
+      for (;i < data_len; ++i)
+         stbiw__zblock_literal(block, data[i]);
+      out = stbiw__zlib_end_chunk(out, &bitbuf, &bitcount, block, data, i, 1, final);
+   } else {
+      for (;i < data_len; ++i)
+         stbiw__zlib_huffb(data[i]);
+      stbiw__zlib_huff(256); // end of block
+   }
+   if (!final) {
+      // sync flush: an empty stored block ends the output on a byte boundary
+      stbiw__zlib_add(0,1);
+      stbiw__zlib_add(0,2);
+   }
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!final) {
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
+   STBIW_FREE(m.head);
+   STBIW_FREE(m.prev);
+   if (block) {
+      STBIW_FREE(block->litlen);
+      STBIW_FREE(block->dist);
+      STBIW_FREE(block);
+   }
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+   return out;
+}
+
+#ifdef STBIW_X86_DISPATCH
+// Adler-32 of len bytes, a multiple of 32. Each sum is split into lanes: s1 is accumulated with
+// psadbw, and s2 with the byte weights 32..1, plus 32 times s1 before each block (v_ps).
+STBIW_TARGET("ssse3")
+static unsigned int stbiw__adler32_ssse3(unsigned int adler, unsigned char *data, int len)
+{
+   unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+   __m128i tap1 = _mm_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17);
+   __m128i tap2 = _mm_setr_epi8(16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+   __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+   int blocks = len / 32;
+   while (blocks) {
+      int n = blocks < 5552/32 ? blocks : 5552/32;
+      __m128i v_ps = _mm_setzero_si128(), v_s1 = _mm_setzero_si128(), v_s2 = _mm_setzero_si128();
+      blocks -= n;
+      s2 += s1 * n * 32;
+      do {
+         __m128i b1 = _mm_loadu_si128((const __m128i *) data);
+         __m128i b2 = _mm_loadu_si128((const __m128i *) (data + 16));
+         v_ps = _mm_add_epi32(v_ps, v_s1);
+         v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(b1, zero), _mm_sad_epu8(b2, zero)));
+         v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+         v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+         data += 32;
+      } while (--n);
+      v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+      v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1,0,3,2)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1,0,3,2)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2,3,0,1)));
+      s1 += (unsigned int) _mm_cvtsi128_si32(v_s1);
+      s2 += (unsigned int) _mm_cvtsi128_si32(v_s2);
+      s1 %= 65521; s2 %= 65521;
+   }
+   return (s2 << 16) | s1;
+}
+
+STBIW_TARGET("avx2")
+static unsigned int stbiw__adler32_avx2(unsigned int adler, unsigned char *data, int len)
+{
+   unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+   __m256i tap = _mm256_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+   __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+   int blocks = len / 32;
+   while (blocks) {
+      int n = blocks < 5552/32 ? blocks : 5552/32;
+      __m256i v_ps = _mm256_setzero_si256(), v_s1 = _mm256_setzero_si256(), v_s2 = _mm256_setzero_si256();
+      __m128i h1, h2;
+      blocks -= n;
+      s2 += s1 * n * 32;
+      do {
+         __m256i b = _mm256_loadu_si256((const __m256i *) data);
+         v_ps = _mm256_add_epi32(v_ps, v_s1);
+         v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(b, zero));
+         v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(b, tap), ones));
+         data += 32;
+      } while (--n);
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+      h1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+      h2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+      h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1,0,3,2)));
+      h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1,0,3,2)));
+      h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2,3,0,1)));
+      s1 += (unsigned int) _mm_cvtsi128_si32(h1);
+      s2 += (unsigned int) _mm_cvtsi128_si32(h2);
+      s1 %= 65521; s2 %= 65521;
+   }
+   return (s2 << 16) | s1;
+}
+#endif // STBIW_X86_DISPATCH
+
+static unsigned int stbiw__adler32(unsigned int adler, unsigned char *data, int len)
+{
+   unsigned int s1, s2;
+   int i, j=0, blocklen;
+#ifdef STBIW_X86_DISPATCH
+   if (len >= 64 && (stbiw__cpu_features() & (STBIW__CPU_AVX2 | STBIW__CPU_SSSE3))) {
+      int simd_len = len & ~31;
+      if (stbiw__cpu_features() & STBIW__CPU_AVX2)
+         adler = stbiw__adler32_avx2(adler, data, simd_len);
+      else
+         adler = stbiw__adler32_ssse3(adler, data, simd_len);
+      data += simd_len;
+      len -= simd_len;
    }
+#endif
+   s1 = adler & 0xffff; s2 = adler >> 16;
+   blocklen = (int) (len % 5552);
+   while (j < len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   return (s2 << 16) | s1;
+}
+
+// Adler-32 of the concatenation of two buffers, from their checksums and the length of the second one
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem = (unsigned int) (len2 % 65521);
+   unsigned int s1 = adler1 & 0xffff, s2 = (rem * s1) % 65521;
+   s1 += (adler2 & 0xffff) + 65521 - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 65521*2) s2 -= 65521*2;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned char *out = NULL;
+   unsigned int adler;
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate(out, data, 0, data_len, quality, 1);
+   if (out == NULL) return NULL;
+
+   adler = stbiw__adler32(1, data, data_len);
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
@@ -991,51 +1659,167 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+#ifndef STBIW_CRC32
+static unsigned int stbiw__crc_table[256] =
+{
+   0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+   0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+   0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+   0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+   0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+   0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+   0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+   0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+   0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+   0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+   0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+   0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+   0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+   0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+   0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+   0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+   0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+   0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+   0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+   0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+   0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+   0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+   0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+   0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+   0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+   0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+   0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+   0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+   0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+   0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+   0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+   0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+// Slice-by-8: t[k] is the crc of a byte followed by k zero bytes, so eight bytes are folded per step
+static unsigned int stbiw__crc_slice8_table[8][256];
+
+static void stbiw__crc32_build_slice8(void)
+{
+   unsigned int (*t)[256] = stbiw__crc_slice8_table;
+   int i, k;
+   for (i=0; i < 256; ++i) t[0][i] = stbiw__crc_table[i];
+   for (k=1; k < 8; ++k)
+      for (i=0; i < 256; ++i)
+         t[k][i] = (t[k-1][i] >> 8) ^ stbiw__crc_table[t[k-1][i] & 0xff];
+}
+
+// The tables are built once, by the first thread that needs them. Returns 0 while another thread is
+// building them (the caller then uses the bytewise loop), so no thread waits or reads a partial table
+static int stbiw__crc32_slice8_ready(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+   static long state = 0; // 0: not built, 1: being built, 2: ready
+   if (_InterlockedCompareExchange(&state, 1, 0) == 0) {
+      stbiw__crc32_build_slice8();
+      _InterlockedExchange(&state, 2);
+   }
+   return _InterlockedCompareExchange(&state, 2, 2) == 2;
+#elif defined(__GNUC__) || defined(__clang__)
+   static int state = 0; // 0: not built, 1: being built, 2: ready
+   int expected = 0;
+   if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2)
+      return 1;
+   if (__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      stbiw__crc32_build_slice8();
+      __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+      return 1;
+   }
+   return 0;
+#else
+   return 0; // no portable atomics in C89, so always bytewise
+#endif
+}
+
+static unsigned int stbiw__crc32_slice8(unsigned int crc, unsigned char *buffer, int len)
+{
+   unsigned int (*t)[256] = stbiw__crc_slice8_table;
+   int i;
+   for (; len >= 8; len -= 8, buffer += 8) {
+      unsigned int lo = crc ^ (buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int) buffer[3] << 24));
+      unsigned int hi = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((unsigned int) buffer[7] << 24);
+      crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+   }
+   for (i=0; i < len; ++i)
+      crc = (crc >> 8) ^ stbiw__crc_table[buffer[i] ^ (crc & 0xff)];
+   return crc;
+}
+
+#ifdef STBIW_X86_DISPATCH
+// Folds 64 bytes at a time with carry-less multiplies, then reduces to 32 bits (Barrett reduction). From
+// Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", as in the Linux kernel and zlib.
+// len is at least 64 and a multiple of 16.
+STBIW_TARGET("pclmul")
+static unsigned int stbiw__crc32_pclmul(unsigned int crc, unsigned char *buffer, int len)
+{
+   __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+   __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+   __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+   __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+   __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+   __m128i x0, x1, x2, x3, x4;
+
+   x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) buffer), _mm_cvtsi32_si128((int) crc));
+   x2 = _mm_loadu_si128((const __m128i *) (buffer + 16));
+   x3 = _mm_loadu_si128((const __m128i *) (buffer + 32));
+   x4 = _mm_loadu_si128((const __m128i *) (buffer + 48));
+   buffer += 64;
+   len -= 64;
+
+   for (; len >= 64; len -= 64, buffer += 64) {
+      x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), _mm_clmulepi64_si128(x1, k1k2, 0x11)), _mm_loadu_si128((const __m128i *) buffer));
+      x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), _mm_clmulepi64_si128(x2, k1k2, 0x11)), _mm_loadu_si128((const __m128i *) (buffer + 16)));
+      x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), _mm_clmulepi64_si128(x3, k1k2, 0x11)), _mm_loadu_si128((const __m128i *) (buffer + 32)));
+      x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x00), _mm_clmulepi64_si128(x4, k1k2, 0x11)), _mm_loadu_si128((const __m128i *) (buffer + 48)));
+   }
+
+   // fold the four lanes, and the remaining 16 byte blocks, into one
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+   for (; len >= 16; len -= 16, buffer += 16)
+      x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), _mm_loadu_si128((const __m128i *) buffer));
+
+   // 128 -> 64 bits
+   x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), x2);
+
+   // 64 -> 32 bits
+   x0 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+   x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x00);
+   x1 = _mm_xor_si128(x1, x0);
+   return (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif // STBIW_X86_DISPATCH
+#endif // STBIW_CRC32
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
     return STBIW_CRC32(buffer, len);
 #else
-   static unsigned int crc_table[256] =
-   {
-      0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-      0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-      0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-      0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-      0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-      0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-      0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-      0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-      0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-      0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-      0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-      0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-      0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-      0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-      0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-      0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-      0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-      0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-      0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-      0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-      0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-      0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-      0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-      0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-      0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-      0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-      0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-      0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-      0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-      0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-      0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-      0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-   };
-
    unsigned int crc = ~0u;
    int i;
+#ifdef STBIW_X86_DISPATCH
+   if (len >= 64 && (stbiw__cpu_features() & STBIW__CPU_PCLMUL)) {
+      int simd_len = len & ~15;
+      crc = stbiw__crc32_pclmul(crc, buffer, simd_len);
+      buffer += simd_len;
+      len -= simd_len;
+   }
+#endif
+   if (len >= 64 && stbiw__crc32_slice8_ready())
+      return ~stbiw__crc32_slice8(crc, buffer, len);
    for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
+      crc = (crc >> 8) ^ stbiw__crc_table[buffer[i] ^ (crc & 0xff)];
    return ~crc;
 #endif
 }
@@ -1058,113 +1842,360 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
-// @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+// The prediction of png filter type 0..4 for a byte, from the byte to the left (a), above (b) and above left (c).
+// Outside of the image they are 0, which also covers the variants of the filters on the first row.
+static unsigned char stbiw__png_predict(int type, int a, int b, int c)
+{
+   switch (type) {
+      case 1: return STBIW_UCHAR(a);
+      case 2: return STBIW_UCHAR(b);
+      case 3: return STBIW_UCHAR((a + b) >> 1);
+      case 4: return stbiw__paeth(a, b, c);
+   }
+   return 0;
+}
+
+#ifdef STBIW_SSE2
+// paeth predictor on 16 bit lanes
+static __m128i stbiw__paeth_sse2_16(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i pmin, not_b, not_a;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   pmin = _mm_min_epi16(pb, pc);
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   not_a = _mm_cmpgt_epi16(pa, pmin);
+   b = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+   return _mm_or_si128(_mm_and_si128(not_a, b), _mm_andnot_si128(not_a, a));
+}
+
+static __m128i stbiw__paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i lo = stbiw__paeth_sse2_16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+   __m128i hi = stbiw__paeth_sse2_16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+   return _mm_packus_epi16(lo, hi);
+}
+
+// (a + b) >> 1, _mm_avg_epu8 rounds up
+static __m128i stbiw__avg_sse2(__m128i a, __m128i b)
+{
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+#endif
+
+// Sum of the absolute values of the residuals of the row z (len bytes, n per pixel) for each filter type,
+// with p the prior row. All five are computed in one pass.
+static void stbiw__png_filter_costs(const unsigned char *z, const unsigned char *p, int n, int len, int *est)
+{
+   int i, t;
+   for (t=0; t < 5; ++t) est[t] = 0;
+   for (i=0; i < n && i < len; ++i)
+      for (t=0; t < 5; ++t)
+         est[t] += abs((signed char) (z[i] - stbiw__png_predict(t, 0, p[i], 0)));
+#ifdef STBIW_SSE2
+   {
+      __m128i zero = _mm_setzero_si128();
+      __m128i sum0 = zero, sum1 = zero, sum2 = zero, sum3 = zero, sum4 = zero;
+      for (; i+16 <= len; i += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (z+i));
+         __m128i a = _mm_loadu_si128((const __m128i *) (z+i-n));
+         __m128i b = _mm_loadu_si128((const __m128i *) (p+i));
+         __m128i c = _mm_loadu_si128((const __m128i *) (p+i-n));
+         __m128i r;
+         // |(signed char) r| is min(r, -r) as unsigned bytes
+         sum0 = _mm_add_epi64(sum0, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+         r = _mm_sub_epi8(x, a);
+         sum1 = _mm_add_epi64(sum1, _mm_sad_epu8(_mm_min_epu8(r, _mm_sub_epi8(zero, r)), zero));
+         r = _mm_sub_epi8(x, b);
+         sum2 = _mm_add_epi64(sum2, _mm_sad_epu8(_mm_min_epu8(r, _mm_sub_epi8(zero, r)), zero));
+         r = _mm_sub_epi8(x, stbiw__avg_sse2(a, b));
+         sum3 = _mm_add_epi64(sum3, _mm_sad_epu8(_mm_min_epu8(r, _mm_sub_epi8(zero, r)), zero));
+         r = _mm_sub_epi8(x, stbiw__paeth_sse2(a, b, c));
+         sum4 = _mm_add_epi64(sum4, _mm_sad_epu8(_mm_min_epu8(r, _mm_sub_epi8(zero, r)), zero));
+      }
+      est[0] += _mm_cvtsi128_si32(sum0) + _mm_cvtsi128_si32(_mm_srli_si128(sum0, 8));
+      est[1] += _mm_cvtsi128_si32(sum1) + _mm_cvtsi128_si32(_mm_srli_si128(sum1, 8));
+      est[2] += _mm_cvtsi128_si32(sum2) + _mm_cvtsi128_si32(_mm_srli_si128(sum2, 8));
+      est[3] += _mm_cvtsi128_si32(sum3) + _mm_cvtsi128_si32(_mm_srli_si128(sum3, 8));
+      est[4] += _mm_cvtsi128_si32(sum4) + _mm_cvtsi128_si32(_mm_srli_si128(sum4, 8));
+   }
+#endif
+   for (; i < len; ++i)
+      for (t=0; t < 5; ++t)
+         est[t] += abs((signed char) (z[i] - stbiw__png_predict(t, z[i-n], p[i], p[i-n])));
+}
+
+// Writes the residuals of the row z for the filter type to out
+static void stbiw__png_filter_row(const unsigned char *z, const unsigned char *p, int n, int len, int type, unsigned char *out)
 {
-   static int mapping[] = { 0,1,2,3,4 };
-   static int firstmap[] = { 0,1,0,5,6 };
-   int *mymap = (y != 0) ? mapping : firstmap;
    int i;
-   int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   if (type == 0) {
+      memcpy(out, z, len);
+      return;
+   }
+   for (i=0; i < n && i < len; ++i)
+      out[i] = STBIW_UCHAR(z[i] - stbiw__png_predict(type, 0, p[i], 0));
+#ifdef STBIW_SSE2
+   for (; i+16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (z+i));
+      __m128i a = _mm_loadu_si128((const __m128i *) (z+i-n));
+      __m128i b = _mm_loadu_si128((const __m128i *) (p+i));
+      __m128i pred;
+      switch (type) {
+         case 1: pred = a; break;
+         case 2: pred = b; break;
+         case 3: pred = stbiw__avg_sse2(a, b); break;
+         default: pred = stbiw__paeth_sse2(a, b, _mm_loadu_si128((const __m128i *) (p+i-n))); break;
+      }
+      _mm_storeu_si128((__m128i *) (out+i), _mm_sub_epi8(x, pred));
+   }
+#endif
+   for (; i < len; ++i)
+      out[i] = STBIW_UCHAR(z[i] - stbiw__png_predict(type, z[i-n], p[i], p[i-n]));
+}
+
+// The format the pixels are written in, see stbi_write_png_reduce
+typedef struct
+{
+   int n;                  // bytes per pixel of the written rows
+   int color_type;
+   int convert;            // the rows are converted from the source pixels (to palette indices, or without alpha)
+   int num_colors;         // palette size, 0 if not paletted
+   int num_trns;           // palette entries that aren't opaque, they come first
+   unsigned char palette[256][4];
+   stbiw_uint32 keys[1024];
+   unsigned short slots[1024];   // palette index + 1 of the color in keys, 0 if the slot is empty
+} stbiw__png_format;
+
+static stbiw_uint32 stbiw__png_color(const unsigned char *p, int n)
+{
+   stbiw_uint32 alpha = n == 4 ? p[3] : 255;
+   return p[0] | (p[1] << 8) | (p[2] << 16) | (alpha << 24);
+}
+
+static int stbiw__png_palette_slot(const stbiw__png_format *f, stbiw_uint32 color)
+{
+   int h = (int) ((color * 2654435761u) >> 22);
+   while (f->slots[h] && f->keys[h] != color)
+      h = (h + 1) & 1023;
+   return h;
+}
 
-   if (type==0) {
-      memcpy(line_buffer, z, width*n);
+static void stbiw__png_analyze(const unsigned char *pixels, int stride_bytes, int x, int y, int n, stbiw__png_format *f)
+{
+   static int ctype[5] = { -1, 0, 4, 2, 6 };
+   int i, j, k, opaque = 1, palette = n >= 3, colors = 0;
+   unsigned char alpha[256], order[256];
+   stbiw_uint32 last = 0;
+
+   f->n = n;
+   f->color_type = ctype[n];
+   f->convert = 0;
+   f->num_colors = f->num_trns = 0;
+   if (!stbi_write_png_reduce)
       return;
+
+   memset(f->slots, 0, sizeof(f->slots));
+   for (j=0; j < y && (palette || opaque); ++j) {
+      const unsigned char *row = pixels + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      if (n == 2 || n == 4)
+         for (i=0; i < x && opaque; ++i)
+            opaque = row[i*n + n-1] == 255;
+      for (i=0; i < x && palette; ++i) {
+         stbiw_uint32 color = stbiw__png_color(row + i*n, n);
+         if ((i == 0 && j == 0) || color != last) {
+            int h = stbiw__png_palette_slot(f, color);
+            if (!f->slots[h]) {
+               if (colors == 256) {
+                  palette = 0;
+                  break;
+               }
+               f->keys[h] = color;
+               f->slots[h] = (unsigned short) (++colors);
+            }
+            last = color;
+         }
+      }
    }
 
-   // first loop isn't optimized since it's just one pixel
-   for (i = 0; i < n; ++i) {
-      switch (type) {
-         case 1: line_buffer[i] = z[i]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - (z[i-signed_stride]>>1); break;
-         case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-signed_stride],0)); break;
-         case 5: line_buffer[i] = z[i]; break;
-         case 6: line_buffer[i] = z[i]; break;
+   if (palette) {
+      // the colors are numbered in the order they first appear, with the translucent ones moved to the front so the tRNS chunk is short
+      for (i=0; i < 1024; ++i) {
+         if (f->slots[i]) {
+            alpha[f->slots[i] - 1] = STBIW_UCHAR(f->keys[i] >> 24);
+            if ((f->keys[i] >> 24) != 255) ++f->num_trns;
+         }
+      }
+      j = 0; k = f->num_trns;
+      for (i=0; i < colors; ++i)
+         order[i] = (unsigned char) (alpha[i] != 255 ? j++ : k++);
+      for (i=0; i < 1024; ++i) {
+         if (f->slots[i]) {
+            stbiw_uint32 c = f->keys[i];
+            k = order[f->slots[i] - 1];
+            f->slots[i] = (unsigned short) (k + 1);
+            f->palette[k][0] = STBIW_UCHAR(c); f->palette[k][1] = STBIW_UCHAR(c >> 8);
+            f->palette[k][2] = STBIW_UCHAR(c >> 16); f->palette[k][3] = STBIW_UCHAR(c >> 24);
+         }
       }
+      f->n = 1;
+      f->color_type = 3;
+      f->convert = 1;
+      f->num_colors = colors;
+   } else if ((n == 2 || n == 4) && opaque) {
+      f->n = n-1;
+      f->color_type = ctype[n-1];
+      f->convert = 1;
    }
-   switch (type) {
-      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
-      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
-      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
-      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+}
+
+// Converts a row of x source pixels to the written format
+static void stbiw__png_convert_row(const stbiw__png_format *f, const unsigned char *src, int x, int n, unsigned char *dst)
+{
+   int i, c;
+   if (f->num_colors) {
+      stbiw_uint32 last = 0;
+      unsigned char index = 0;
+      for (i=0; i < x; ++i) {
+         stbiw_uint32 color = stbiw__png_color(src + i*n, n);
+         if (i == 0 || color != last) {
+            index = (unsigned char) (f->slots[stbiw__png_palette_slot(f, color)] - 1);
+            last = color;
+         }
+         dst[i] = index;
+      }
+   } else {
+      for (i=0; i < x; ++i)
+         for (c=0; c < n-1; ++c)
+            dst[i*(n-1) + c] = src[i*n + c];
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// Filters the rows [y0, y1) of the image into filt
+static int stbiw__filter_png_rows(const unsigned char *pixels, int stride_bytes, int x, int y, int n, const stbiw__png_format *f,
+                                  int y0, int y1, unsigned char *filt)
 {
    int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   unsigned char *zero_row = NULL, *rows = NULL;
+   int j, len = x*f->n;
 
    if (force_filter >= 5) {
       force_filter = -1;
    }
+   // the differences between palette indices mean little, so paletted images aren't filtered
+   if (force_filter < 0 && f->num_colors) {
+      force_filter = 0;
+   }
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
+   // the first row is filtered against a row of zeroes
+   if (y0 == 0) {
+      zero_row = (unsigned char *) STBIW_MALLOC(len); if (!zero_row) return 0;
+      memset(zero_row, 0, len);
+   }
+   // the converted current and previous rows
+   if (f->convert) {
+      rows = (unsigned char *) STBIW_MALLOC(2 * len); if (!rows) { STBIW_FREE(zero_row); return 0; }
+   }
+   for (j=y0; j < y1; ++j) {
+      const unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      const unsigned char *p = j == 0 ? zero_row : z - signed_stride;
+      unsigned char *out = filt + (j-y0)*(len+1);
+      int filter_type = force_filter;
+      if (f->convert) {
+         unsigned char *cur = rows + (j & 1) * len, *prev = rows + ((j & 1) ^ 1) * len;
+         if (j == y0 && j > 0)
+            stbiw__png_convert_row(f, p, x, n, prev);
+         stbiw__png_convert_row(f, z, x, n, cur);
+         z = cur;
+         if (j > 0) p = prev;
       }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      if (filter_type < 0) {
+         // Estimate the entropy of the line with each filter; the less, the better.
+         int est[5], i;
+         stbiw__png_filter_costs(z, p, f->n, len, est);
+         filter_type = 0;
+         for (i=1; i < 5; ++i)
+            if (est[i] < est[filter_type])
+               filter_type = i;
+      }
+      out[0] = (unsigned char) filter_type;
+      stbiw__png_filter_row(z, p, f->n, len, filter_type, out+1);
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
+   STBIW_FREE(zero_row);
+   STBIW_FREE(rows);
+   return 1;
+}
 
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+// Size of the signature and the chunks before the image data
+static int stbiw__wpng_header_size(const stbiw__png_format *f)
+{
+   return 8 + 12+13 + (f->num_colors ? 12 + 3*f->num_colors : 0) + (f->num_trns ? 12 + f->num_trns : 0);
+}
 
-   o=out;
+// Writes the signature, the IHDR chunk, and the PLTE and tRNS chunks of paletted images
+static unsigned char *stbiw__wpng_header(unsigned char *o, int x, int y, const stbiw__png_format *f)
+{
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   int i;
    STBIW_MEMMOVE(o,sig,8); o+= 8;
    stbiw__wp32(o, 13); // header length
    stbiw__wptag(o, "IHDR");
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
    *o++ = 8;
-   *o++ = STBIW_UCHAR(ctype[n]);
+   *o++ = STBIW_UCHAR(f->color_type);
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
 
+   if (f->num_colors) {
+      stbiw__wp32(o, 3*f->num_colors);
+      stbiw__wptag(o, "PLTE");
+      for (i=0; i < f->num_colors; ++i) {
+         *o++ = f->palette[i][0];
+         *o++ = f->palette[i][1];
+         *o++ = f->palette[i][2];
+      }
+      stbiw__wpcrc(&o, 3*f->num_colors);
+   }
+   if (f->num_trns) {
+      stbiw__wp32(o, f->num_trns);
+      stbiw__wptag(o, "tRNS");
+      for (i=0; i < f->num_trns; ++i)
+         *o++ = f->palette[i][3];
+      stbiw__wpcrc(&o, f->num_trns);
+   }
+   return o;
+}
+
+// Writes the IEND chunk, 12 bytes
+static unsigned char *stbiw__wpng_end(unsigned char *o)
+{
+   stbiw__wp32(o,0);
+   stbiw__wptag(o, "IEND");
+   stbiw__wpcrc(&o,0);
+   return o;
+}
+
+// Wraps the zlib stream in the png chunks, and frees it
+static unsigned char *stbiw__write_png_chunks(unsigned char *zlib, int zlen, int x, int y, const stbiw__png_format *f, int *out_len)
+{
+   unsigned char *out,*o;
+
+   // each tag requires 12 bytes of overhead
+   out = (unsigned char *) STBIW_MALLOC(stbiw__wpng_header_size(f) + 12+zlen + 12);
+   if (!out) { STBIW_FREE(zlib); return 0; }
+   *out_len = stbiw__wpng_header_size(f) + 12+zlen + 12;
+
+   o = stbiw__wpng_header(out, x, y, f);
+
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
    STBIW_MEMMOVE(o, zlib, zlen);
@@ -1172,40 +2203,249 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    STBIW_FREE(zlib);
    stbiw__wpcrc(&o, zlen);
 
-   stbiw__wp32(o,0);
-   stbiw__wptag(o, "IEND");
-   stbiw__wpcrc(&o,0);
+   o = stbiw__wpng_end(o);
 
    STBIW_ASSERT(o == out + *out_len);
 
    return out;
 }
 
-#ifndef STBI_WRITE_NO_STDIO
-STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
 {
-   FILE *f;
-   int len;
-   unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
-   if (png == NULL) return 0;
+   stbiw__png_format f;
+   unsigned char *filt, *zlib;
+   int zlen;
 
-   f = stbiw__fopen(filename, "wb");
-   if (!f) { STBIW_FREE(png); return 0; }
-   fwrite(png, 1, len, f);
-   fclose(f);
-   STBIW_FREE(png);
-   return 1;
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   stbiw__png_analyze(pixels, stride_bytes, x, y, n, &f);
+   filt = (unsigned char *) STBIW_MALLOC((x*f.n+1) * y); if (!filt) return 0;
+   if (!stbiw__filter_png_rows(pixels, stride_bytes, x, y, n, &f, 0, y, filt)) { STBIW_FREE(filt); return 0; }
+   zlib = stbi_zlib_compress(filt, y*( x*f.n+1), &zlen, stbi_write_png_compression_level);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+   return stbiw__write_png_chunks(zlib, zlen, x, y, &f, out_len);
 }
-#endif
 
-STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+#ifndef STBIW_ZLIB_COMPRESS
+// Streaming png writer. The image is split into bands of about stbiw__PNG_BAND_BYTES of filtered data.
+// Like pigz, each band is compressed with the end of the previous one as its dictionary, and all but the
+// last end with a sync flush, so the compressed bands can be concatenated, and their Adler-32 checksums
+// combined. Each band is written as an IDAT chunk as soon as it's compressed, and only the bands of the
+// current group (and the 32KB before them) are kept in memory. With a parallel function, the bands of
+// a group are filtered and compressed concurrently.
+#define stbiw__PNG_BAND_BYTES   (512*1024)
+#define stbiw__PNG_GROUP_BANDS  32
+
+typedef struct
+{
+   const unsigned char *pixels;
+   int stride_bytes, x, y, n, band_rows, quality;
+   const stbiw__png_format *format;
+   int y0;                 // first row of the group
+   int dict_len;           // bytes of the previous group at the start of filt
+   unsigned char *filt;
+   unsigned char **out;    // IDAT chunk of each band of the group, as stretchy buffers
+   unsigned int *adler;
+   int *ok;
+} stbiw__png_stream;
+
+static void stbiw__png_filter_band(void *data, int band)
+{
+   stbiw__png_stream *s = (stbiw__png_stream *) data;
+   int y0 = s->y0 + band * s->band_rows, y1 = s->y - y0 < s->band_rows ? s->y : y0 + s->band_rows;
+   unsigned char *filt = s->filt + s->dict_len + band * s->band_rows * (s->x * s->format->n + 1);
+   s->ok[band] = stbiw__filter_png_rows(s->pixels, s->stride_bytes, s->x, s->y, s->n, s->format, y0, y1, filt);
+}
+
+static void stbiw__png_deflate_band(void *data, int band)
+{
+   stbiw__png_stream *s = (stbiw__png_stream *) data;
+   int y0 = s->y0 + band * s->band_rows, y1 = s->y - y0 < s->band_rows ? s->y : y0 + s->band_rows;
+   int row_bytes = s->x * s->format->n + 1;
+   int start = s->dict_len + band * s->band_rows * row_bytes;
+   s->out[band] = stbiw__zlib_deflate(s->out[band], s->filt, start, start + (y1 - y0) * row_bytes, s->quality, y1 == s->y);
+   s->adler[band] = stbiw__adler32(1, s->filt + start, (y1 - y0) * row_bytes);
+}
+
+static void stbiw__run_tasks(stbi_write_parallel_func *parallel, void *parallel_context, int count, stbi_write_parallel_task *task, void *data)
+{
+   int i;
+   if (parallel)
+      parallel(parallel_context, count, task, data);
+   else
+      for (i=0; i < count; ++i)
+         task(data, i);
+}
+
+static int stbiw__write_png_stream(stbi_write_func *func, void *context, const unsigned char *pixels, int stride_bytes, int x, int y, int n,
+                                   stbi_write_parallel_func *parallel, void *parallel_context)
+{
+   stbiw__png_stream s;
+   stbiw__png_format f;
+   unsigned char header[8 + 12+13 + 12+3*256 + 12+256], *o;
+   int row_bytes, group_bands = parallel ? stbiw__PNG_GROUP_BANDS : 1;
+   int num_bands, i, ok = 1;
+   unsigned int adler = 1;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   stbiw__png_analyze(pixels, stride_bytes, x, y, n, &f);
+   row_bytes = x*f.n+1;
+
+   s.band_rows = (stbiw__PNG_BAND_BYTES + row_bytes - 1) / row_bytes;
+   num_bands = (y + s.band_rows - 1) / s.band_rows;
+   if (group_bands > num_bands)
+      group_bands = num_bands;
+
+   s.pixels = pixels;
+   s.stride_bytes = stride_bytes;
+   s.x = x;
+   s.y = y;
+   s.n = n;
+   s.format = &f;
+   s.quality = stbi_write_png_compression_level;
+   s.dict_len = 0;
+   s.filt = (unsigned char *) STBIW_MALLOC(stbiw__ZWINDOW + group_bands * s.band_rows * row_bytes);
+   s.out = (unsigned char **) STBIW_MALLOC(group_bands * sizeof(unsigned char *));
+   s.adler = (unsigned int *) STBIW_MALLOC(group_bands * sizeof(unsigned int));
+   s.ok = (int *) STBIW_MALLOC(group_bands * sizeof(int));
+   if (!s.filt || !s.out || !s.adler || !s.ok) {
+      STBIW_FREE(s.filt); STBIW_FREE(s.out); STBIW_FREE(s.adler); STBIW_FREE(s.ok);
+      return 0;
+   }
+   for (i=0; i < group_bands; ++i)
+      s.out[i] = NULL;
+
+   o = stbiw__wpng_header(header, x, y, &f);
+   func(context, header, (int) (o - header));
+
+   for (s.y0 = 0; ok && s.y0 < y; s.y0 += group_bands * s.band_rows) {
+      int count = (y - s.y0 + s.band_rows - 1) / s.band_rows, group_len = 0;
+      if (count > group_bands) count = group_bands;
+
+      // each chunk starts with its length and tag, which are filled in below
+      for (i=0; i < count; ++i) {
+         if (s.out[i]) stbiw__sbn(s.out[i]) = 0;
+         stbiw__sbpush(s.out[i], 0); stbiw__sbpush(s.out[i], 0); stbiw__sbpush(s.out[i], 0); stbiw__sbpush(s.out[i], 0);
+         stbiw__sbpush(s.out[i], 'I'); stbiw__sbpush(s.out[i], 'D'); stbiw__sbpush(s.out[i], 'A'); stbiw__sbpush(s.out[i], 'T');
+      }
+      if (s.y0 == 0) {
+         stbiw__sbpush(s.out[0], 0x78);   // DEFLATE 32K window
+         stbiw__sbpush(s.out[0], 0x5e);   // FLEVEL = 1
+      }
+
+      stbiw__run_tasks(parallel, parallel_context, count, stbiw__png_filter_band, &s);
+      for (i=0; i < count; ++i)
+         ok = ok && s.ok[i];
+      if (!ok) break;
+      stbiw__run_tasks(parallel, parallel_context, count, stbiw__png_deflate_band, &s);
+      for (i=0; i < count; ++i)
+         ok = ok && s.out[i];
+      if (!ok) break;
+
+      for (i=0; i < count; ++i) {
+         int band_y0 = s.y0 + i * s.band_rows;
+         int band_len = (y - band_y0 < s.band_rows ? y - band_y0 : s.band_rows) * row_bytes;
+         unsigned char *chunk, *p;
+         int len;
+         adler = band_y0 ? stbiw__adler32_combine(adler, s.adler[i], band_len) : s.adler[i];
+         if (band_y0 + s.band_rows >= y) {
+            stbiw__sbpush(s.out[i], STBIW_UCHAR(adler >> 24));
+            stbiw__sbpush(s.out[i], STBIW_UCHAR(adler >> 16));
+            stbiw__sbpush(s.out[i], STBIW_UCHAR(adler >> 8));
+            stbiw__sbpush(s.out[i], STBIW_UCHAR(adler));
+         }
+         stbiw__sbmaybegrow(s.out[i], 4);
+         chunk = s.out[i];
+         len = stbiw__sbn(chunk) - 8;
+         p = chunk;
+         stbiw__wp32(p, len);
+         p = chunk + 8 + len;
+         stbiw__wpcrc(&p, len);
+         func(context, chunk, len + 12);
+         group_len += band_len;
+      }
+
+      // the end of the group is the dictionary of the next one
+      group_len += s.dict_len;
+      s.dict_len = group_len < stbiw__ZWINDOW ? group_len : stbiw__ZWINDOW;
+      STBIW_MEMMOVE(s.filt, s.filt + group_len - s.dict_len, s.dict_len);
+   }
+
+   if (ok) {
+      o = stbiw__wpng_end(header);
+      func(context, header, (int) (o - header));
+   }
+
+   for (i=0; i < group_bands; ++i)
+      stbiw__sbfree(s.out[i]);
+   STBIW_FREE(s.filt); STBIW_FREE(s.out); STBIW_FREE(s.adler); STBIW_FREE(s.ok);
+   return ok;
+}
+
+static void stbiw__sbwrite(void *context, void *data, int size)
+{
+   unsigned char **sb = (unsigned char **) context;
+   stbiw__sbmaybegrow(*sb, size);
+   STBIW_MEMMOVE(*sb + stbiw__sbn(*sb), data, size);
+   stbiw__sbn(*sb) += size;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char *stbi_write_png_to_mem_parallel(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len,
+                                                       stbi_write_parallel_func *parallel, void *parallel_context)
 {
+#ifdef STBIW_ZLIB_COMPRESS
+   // the bands can only be joined with the builtin compressor
+   (void) parallel; (void) parallel_context;
+   return stbi_write_png_to_mem(pixels, stride_bytes, x, y, n, out_len);
+#else
+   unsigned char *out = NULL;
+   if (!stbiw__write_png_stream(stbiw__sbwrite, &out, pixels, stride_bytes, x, y, n, parallel, parallel_context)) {
+      stbiw__sbfree(out);
+      return 0;
+   }
+   *out_len = stbiw__sbn(out);
+   // make returned pointer freeable
+   STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
+   return (unsigned char *) stbiw__sbraw(out);
+#endif // STBIW_ZLIB_COMPRESS
+}
+
+STBIWDEF int stbi_write_png_to_func_parallel(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes,
+                                             stbi_write_parallel_func *parallel, void *parallel_context)
+{
+#ifdef STBIW_ZLIB_COMPRESS
    int len;
    unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
+   (void) parallel; (void) parallel_context;
    if (png == NULL) return 0;
    func(context, png, len);
    STBIW_FREE(png);
    return 1;
+#else
+   return stbiw__write_png_stream(func, context, (const unsigned char *) data, stride_bytes, x, y, comp, parallel, parallel_context);
+#endif
+}
+
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   FILE *f = stbiw__fopen(filename, "wb");
+   int ok;
+   if (!f) return 0;
+   ok = stbi_write_png_to_func_parallel(stbi__stdio_write, f, x, y, comp, data, stride_bytes, NULL, NULL);
+   fclose(f);
+   return ok;
+}
+#endif
+
+STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   return stbi_write_png_to_func_parallel(func, context, x, y, comp, data, stride_bytes, NULL, NULL);
 }
 
 
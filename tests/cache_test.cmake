@@ -0,0 +1,51 @@
+# Dithers the same image twice with different settings and checks that the second run doesn't change the
+# cache entry of the first one (the output is hard linked to it on a cache hit).
+# Usage: cmake -DDITHER=<exe> -DINPUT=<image> -DWORK_DIR=<dir> -P cache_test.cmake
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+file(COPY ${INPUT} DESTINATION ${WORK_DIR})
+get_filename_component(name ${INPUT} NAME)
+set(input ${WORK_DIR}/${name})
+set(output ${input}.dither.png)
+set(cache ${WORK_DIR}/cache/dither) # a missing parent is created as well
+
+function(run_dither mode)
+    execute_process(COMMAND ${DITHER} --cache ${cache} -d ${mode} ${input} RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "dither --cache -d ${mode} failed")
+    endif()
+endfunction()
+
+run_dither(bayer)
+file(GLOB entries ${cache}/*)
+list(LENGTH entries num_entries)
+if(NOT num_entries EQUAL 1)
+    message(FATAL_ERROR "Expected one cache entry, found ${num_entries}")
+endif()
+file(SHA256 ${entries} bayer_entry)
+file(SHA256 ${output} bayer_output)
+
+# A cache hit, which links the output to the entry
+run_dither(bayer)
+file(SHA256 ${output} hash)
+if(NOT hash STREQUAL bayer_output)
+    message(FATAL_ERROR "The cached output differs from the dithered one")
+endif()
+
+# A miss, which replaces the output
+run_dither(fs)
+file(SHA256 ${output} hash)
+if(hash STREQUAL bayer_output)
+    message(FATAL_ERROR "The output wasn't replaced")
+endif()
+file(SHA256 ${entries} hash)
+if(NOT hash STREQUAL bayer_entry)
+    message(FATAL_ERROR "Writing the output changed the cache entry of another setting")
+endif()
+
+run_dither(bayer)
+file(SHA256 ${output} hash)
+if(NOT hash STREQUAL bayer_output)
+    message(FATAL_ERROR "The cached output differs from the dithered one")
+endif()
@@ -0,0 +1,292 @@
+// Checks that the SIMD kernels match the scalar ones bit for bit, and that the output of the public api
+// doesn't depend on the number of threads or on how the rows are handed to dither_rows.
+// Also run with DITHER_NO_SIMD=1, where the public api uses the scalar kernels.
+
+// The kernels are internal to the library
+#include "dither.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool g_Ok = true;
+
+static void check(bool ok, const char* what, uint32_t width, uint32_t height, uint32_t numchannels, const char* detail)
+{
+    if (ok)
+        return;
+    fprintf(stderr, "FAIL: %s, %ux%u, %u channels, %s\n", what, width, height, numchannels, detail);
+    g_Ok = false;
+}
+
+static uint32_t xorshift32(uint32_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// Noise, with some pixels at 0 and 255 to hit the clamping
+static void makeImage(uint8_t* data, size_t size, uint32_t seed)
+{
+    uint32_t x = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        uint32_t r = xorshift32(&x);
+        data[i] = (r & 0x700) == 0 ? 0 : ((r & 0x700) == 0x100 ? 255 : (uint8_t)r);
+    }
+}
+
+static const uint32_t g_Widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 63, 64, 65, 100, 257 };
+
+// *****************************************************************************************************
+// Row kernels
+
+static void testInterleavedGradientRows(uint32_t features)
+{
+    for (size_t w = 0; w < sizeof(g_Widths) / sizeof(g_Widths[0]); ++w)
+    {
+        uint32_t width = g_Widths[w];
+        std::vector<uint8_t> src(width * 4);
+        for (uint32_t y = 0; y < 70; y += 7)
+        {
+            makeImage(src.data(), src.size(), 1 + y);
+            std::vector<uint8_t> ref(src);
+            ditherInterleavedGradientRGBA4444Row_Scalar(ref.data(), 0, width, y);
+#if defined(DITHER_X86)
+            if (features & CPU_FEATURE_SSE41)
+            {
+                std::vector<uint8_t> out(src);
+                ditherInterleavedGradientRGBA4444Row_SSE41(out.data(), width, y);
+                check(out == ref, "ign rgba4444 row", width, y, 4, "sse4.1");
+            }
+            if (features & CPU_FEATURE_AVX2)
+            {
+                std::vector<uint8_t> out(src);
+                ditherInterleavedGradientRGBA4444Row_AVX2(out.data(), width, y);
+                check(out == ref, "ign rgba4444 row", width, y, 4, "avx2");
+            }
+#endif
+        }
+    }
+    (void)features;
+}
+
+static void testInterleavedGradientPackRows(uint32_t features)
+{
+    for (size_t w = 0; w < sizeof(g_Widths) / sizeof(g_Widths[0]); ++w)
+    {
+        uint32_t width = g_Widths[w];
+        for (uint32_t numchannels = 3; numchannels <= 4; ++numchannels)
+        {
+            // exactly the size of the row, so that reads past its end show up under ASan
+            std::vector<uint8_t> src(width * numchannels);
+            for (uint32_t y = 0; y < 70; y += 7)
+            {
+                makeImage(src.data(), src.size(), 2 + y);
+                std::vector<uint16_t> ref(width);
+                ditherPackInterleavedGradientRGB565Row_Scalar(src.data(), numchannels, ref.data(), 0, width, y);
+#if defined(DITHER_X86)
+                if (features & CPU_FEATURE_SSE41)
+                {
+                    std::vector<uint16_t> out(width);
+                    ditherPackInterleavedGradientRGB565Row_SSE41(src.data(), numchannels, out.data(), width, y);
+                    check(out == ref, "ign rgb565 row", width, y, numchannels, "sse4.1");
+                }
+                if (features & CPU_FEATURE_AVX2)
+                {
+                    std::vector<uint16_t> out(width);
+                    ditherPackInterleavedGradientRGB565Row_AVX2(src.data(), numchannels, out.data(), width, y);
+                    check(out == ref, "ign rgb565 row", width, y, numchannels, "avx2");
+                }
+#endif
+            }
+        }
+    }
+    (void)features;
+}
+
+static void testOrderedRows(uint32_t features)
+{
+    const uint8_t bits4444[4] = { 4, 4, 4, 4 };
+    const uint8_t bits565[4] = { 5, 6, 5, 8 };
+    const ThresholdTable* tables[] = {
+        getThresholdTable(THRESHOLD_MAP_BAYER, 2, bits4444, 0),
+        getThresholdTable(THRESHOLD_MAP_BAYER, 4, bits565, 0),
+        getThresholdTable(THRESHOLD_MAP_BAYER, 8, bits4444, 0),
+        getThresholdTable(THRESHOLD_MAP_BAYER, 256, bits565, 0),
+        getThresholdTable(THRESHOLD_MAP_BLUE_NOISE, 64, bits4444, 0),
+    };
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); ++t)
+    {
+        for (size_t w = 0; w < sizeof(g_Widths) / sizeof(g_Widths[0]); ++w)
+        {
+            uint32_t width = g_Widths[w];
+            for (uint32_t numchannels = 3; numchannels <= 4; ++numchannels)
+            {
+                std::vector<uint8_t> src(width * numchannels);
+                for (uint32_t y = 0; y < 70; y += 7)
+                {
+                    makeImage(src.data(), src.size(), 3 + y);
+                    std::vector<uint8_t> ref(src);
+                    ditherOrderedRow_Scalar(ref.data(), numchannels, 0, width, y, tables[t]);
+#if defined(DITHER_X86)
+                    if (features & CPU_FEATURE_SSE41)
+                    {
+                        std::vector<uint8_t> out(src);
+                        ditherOrderedRow_SSE41(out.data(), numchannels, width, y, tables[t]);
+                        check(out == ref, "ordered row", width, y, numchannels, "sse4.1");
+                    }
+                    if (features & CPU_FEATURE_AVX2)
+                    {
+                        std::vector<uint8_t> out(src);
+                        ditherOrderedRow_AVX2(out.data(), numchannels, width, y, tables[t]);
+                        check(out == ref, "ordered row", width, y, numchannels, "avx2");
+                    }
+#endif
+                }
+            }
+        }
+    }
+    (void)features;
+}
+
+// *****************************************************************************************************
+// Whole images through the public api
+
+struct TestSize
+{
+    uint32_t width;
+    uint32_t height;
+};
+
+static const TestSize g_Sizes[] = {
+    { 1, 1 }, { 1, 37 }, { 37, 1 }, { 2, 2 }, { 5, 3 }, { 17, 9 }, { 31, 33 }, { 67, 41 }, { 130, 7 }, { 333, 20 }, { 0, 5 }, { 5, 0 },
+};
+
+// The result of the scalar kernels, one row after the other, or false for the error diffusion modes
+static bool ditherReference(const uint8_t* src, uint32_t width, uint32_t height, uint32_t stride, uint32_t numchannels,
+                            dither_dst_format dst_format, const dither_params* params, uint16_t* dst)
+{
+    if (width == 0 || height == 0)
+        return true;
+    if (params->mode == DITHER_MODE_INTERLEAVED_GRADIENT && dst_format == DITHER_DST_RGB565)
+    {
+        for (uint32_t y = 0; y < height; ++y)
+            ditherPackInterleavedGradientRGB565Row_Scalar(src + (size_t)y * stride, numchannels, dst + (size_t)y * width, 0, width, y);
+        return true;
+    }
+    if (getDiffusionKernel(params->mode))
+        return false;
+
+    std::vector<uint8_t> rgba((size_t)width * height * 4);
+    copyRowsToRGBA8(src, stride, numchannels, width, 0, height, rgba.data());
+    const uint8_t bits4444[4] = { 4, 4, 4, 4 };
+    const uint8_t bits565[4] = { 5, 6, 5, 8 };
+    const uint8_t* bits = dst_format == DITHER_DST_RGBA4444 ? bits4444 : bits565;
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        uint8_t* row = rgba.data() + (size_t)y * width * 4;
+        if (params->mode == DITHER_MODE_INTERLEAVED_GRADIENT)
+            ditherInterleavedGradientRGBA4444Row_Scalar(row, 0, width, y);
+        else if (params->mode == DITHER_MODE_BAYER)
+            ditherOrderedRow_Scalar(row, 4, 0, width, y, getThresholdTable(THRESHOLD_MAP_BAYER, params->bayer_size, bits, 0));
+        else
+            ditherOrderedRow_Scalar(row, 4, 0, width, y, getThresholdTable(THRESHOLD_MAP_BLUE_NOISE, params->blue_noise_size, bits, 0));
+    }
+    packRows(rgba.data(), width, 0, height, dst_format, dst);
+    return true;
+}
+
+// Hands the rows to dither_rows in bands of 1, 2, 3, ... rows
+static dither_result ditherInBands(dither_context* ctx, const uint8_t* src, uint32_t width, uint32_t height, uint32_t stride,
+                                    dither_src_format src_format, dither_dst_format dst_format, const dither_params* params, uint16_t* dst)
+{
+    dither_result result = dither_begin(ctx, width, height, src_format, dst_format, params, dst);
+    uint32_t band = 1;
+    for (uint32_t y = 0; result == DITHER_RESULT_OK && y < height; y += band, ++band)
+    {
+        uint32_t count = height - y < band ? height - y : band;
+        result = dither_rows(ctx, src + (size_t)y * stride, stride, count);
+    }
+    dither_result end_result = dither_end(ctx);
+    return result != DITHER_RESULT_OK ? result : end_result;
+}
+
+static void testImages()
+{
+    dither_context* serial = dither_create(1);
+    dither_context* parallel = dither_create(4);
+
+    for (int mode = 0; mode < DITHER_MODE_COUNT; ++mode)
+    {
+        dither_params params;
+        dither_default_params(&params);
+        params.mode = (dither_mode)mode;
+        params.bayer_size = 4;
+        const char* name = dither_mode_name(params.mode);
+
+        for (size_t s = 0; s < sizeof(g_Sizes) / sizeof(g_Sizes[0]); ++s)
+        {
+            const uint32_t width = g_Sizes[s].width;
+            const uint32_t height = g_Sizes[s].height;
+            for (uint32_t numchannels = 3; numchannels <= 4; ++numchannels)
+            {
+                // padded rows, to check that the stride is used
+                const uint32_t stride = width * numchannels + 3;
+                std::vector<uint8_t> src((size_t)stride * height + 1);
+                makeImage(src.data(), src.size(), 5 + mode + width * 7 + height);
+                const size_t num_pixels = (size_t)width * height;
+
+                for (int f = 0; f < 2; ++f)
+                {
+                    dither_dst_format dst_format = f ? DITHER_DST_RGBA4444 : DITHER_DST_RGB565;
+                    char detail[64];
+                    snprintf(detail, sizeof(detail), "%s, %s", name, f ? "rgba4444" : "rgb565");
+                    dither_src_format src_format = (dither_src_format)numchannels;
+
+                    std::vector<uint16_t> out_serial(num_pixels + 1, 0xdead);
+                    dither_result r = dither_image(serial, src.data(), width, height, stride, src_format, dst_format, &params, out_serial.data());
+                    check(r == DITHER_RESULT_OK, "dither_image, 1 thread", width, height, numchannels, detail);
+                    check(out_serial[num_pixels] == 0xdead, "wrote past the end, 1 thread", width, height, numchannels, detail);
+
+                    std::vector<uint16_t> ref(num_pixels + 1, 0xdead);
+                    if (ditherReference(src.data(), width, height, stride, numchannels, dst_format, &params, ref.data()))
+                        check(out_serial == ref, "dither_image vs the scalar kernels", width, height, numchannels, detail);
+
+                    std::vector<uint16_t> out(num_pixels + 1, 0xdead);
+                    r = dither_image(parallel, src.data(), width, height, stride, src_format, dst_format, &params, out.data());
+                    check(r == DITHER_RESULT_OK && out == out_serial, "dither_image, 4 threads vs 1", width, height, numchannels, detail);
+
+                    std::fill(out.begin(), out.end(), 0xdead);
+                    r = ditherInBands(serial, src.data(), width, height, stride, src_format, dst_format, &params, out.data());
+                    check(r == DITHER_RESULT_OK && out == out_serial, "dither_rows, 1 thread vs dither_image", width, height, numchannels, detail);
+
+                    std::fill(out.begin(), out.end(), 0xdead);
+                    r = ditherInBands(parallel, src.data(), width, height, stride, src_format, dst_format, &params, out.data());
+                    check(r == DITHER_RESULT_OK && out == out_serial, "dither_rows, 4 threads vs dither_image", width, height, numchannels, detail);
+                }
+            }
+        }
+    }
+
+    dither_destroy(parallel);
+    dither_destroy(serial);
+}
+
+int main()
+{
+    // The kernels are compared on whatever the cpu has, even when DITHER_NO_SIMD makes the api use the scalar ones
+    uint32_t features = detectCpuFeatures();
+    printf("cpu features: %s%s%s\n", (features & CPU_FEATURE_SSE41) ? "sse4.1 " : "", (features & CPU_FEATURE_AVX2) ? "avx2 " : "",
+                getCpuFeatures() ? "" : "(DITHER_NO_SIMD)");
+
+    testInterleavedGradientRows(features);
+    testInterleavedGradientPackRows(features);
+    testOrderedRows(features);
+    testImages();
+
+    printf("%s\n", g_Ok ? "ok" : "FAILED");
+    return g_Ok ? 0 : 1;
+}
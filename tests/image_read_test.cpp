@@ -0,0 +1,369 @@
+// Decodes pngs and jpegs with stbi_load_from_memory and with the stbi_*_into_rows loaders, and checks that they
+// agree, and that the row callbacks report every row once, in order, and only after it is final.
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+static bool g_Ok = true;
+
+static const char* TEMP_FILE = "image_read_test.tmp";
+static const uint8_t PADDING = 0xcd;
+static const uint8_t MODIFY = 0x5a;
+
+static void check(bool ok, const char* what, const char* name, int n, const char* detail)
+{
+    if (ok)
+        return;
+    fprintf(stderr, "FAIL: %s, %s, %d channels, %s\n", what, name, n, detail);
+    g_Ok = false;
+}
+
+static uint32_t xorshift32(uint32_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static void appendData(void* context, void* data, int size)
+{
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*)context;
+    out->insert(out->end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+static void appendU32BE(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((uint8_t)(value >> shift));
+}
+
+// *****************************************************************************************************
+// Test images
+
+// Noise in runs, so that it compresses like an image
+static void makeImage(std::vector<uint8_t>& data, uint32_t seed)
+{
+    uint32_t x = seed;
+    uint32_t color = 0;
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        if ((xorshift32(&x) & 7) == 0)
+            color = xorshift32(&x);
+        data[i] = (uint8_t)(color + (xorshift32(&x) & 3));
+    }
+}
+
+// Rows that follow the row above, so that the png writer picks the filters that read it
+static void makeSmoothImage(std::vector<uint8_t>& data, size_t row_bytes, uint32_t seed)
+{
+    uint32_t x = seed;
+    makeImage(data, seed);
+    for (size_t i = row_bytes; i < data.size(); ++i)
+        data[i] = (uint8_t)(data[i - row_bytes] + (xorshift32(&x) & 3));
+}
+
+// Runs of num_colors different pixels, some of them translucent when n is 4
+static void makePalettedImage(std::vector<uint8_t>& data, int n, uint32_t seed, uint32_t num_colors)
+{
+    uint32_t x = seed;
+    uint32_t color = 0;
+    for (size_t i = 0; i + n <= data.size(); i += n)
+    {
+        if ((xorshift32(&x) & 7) == 0)
+            color = xorshift32(&x) % num_colors;
+        for (int c = 0; c < n; ++c)
+            data[i + c] = (uint8_t)(color * (37 + c * 50));
+    }
+}
+
+static void appendChunk(std::vector<uint8_t>& png, const char* type, const std::vector<uint8_t>& data)
+{
+    appendU32BE(png, (uint32_t)data.size());
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    appendU32BE(png, stbiw__crc32(png.data() + start, (int)(png.size() - start)));
+}
+
+// A png the writer doesn't make: any bit depth and color type, with an optional tRNS chunk.
+// The rows are unfiltered, and have bit_depth bit samples
+static std::vector<uint8_t> makePng(int width, int height, int color_type, int bit_depth, const std::vector<uint8_t>& rows,
+                                    const std::vector<uint8_t>& trns)
+{
+    std::vector<uint8_t> png((const uint8_t*)"\x89PNG\r\n\x1a\n", (const uint8_t*)"\x89PNG\r\n\x1a\n" + 8);
+    std::vector<uint8_t> ihdr;
+    appendU32BE(ihdr, (uint32_t)width);
+    appendU32BE(ihdr, (uint32_t)height);
+    ihdr.push_back((uint8_t)bit_depth);
+    ihdr.push_back((uint8_t)color_type);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    appendChunk(png, "IHDR", ihdr);
+    if (!trns.empty())
+        appendChunk(png, "tRNS", trns);
+
+    const int channels = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 4 ? 2 : 4;
+    const size_t row_bytes = ((size_t)width * channels * bit_depth + 7) / 8;
+    std::vector<uint8_t> filtered;
+    for (int y = 0; y < height && row_bytes; ++y)
+    {
+        filtered.push_back(0);
+        filtered.insert(filtered.end(), rows.begin() + y * row_bytes, rows.begin() + (y + 1) * row_bytes);
+    }
+    int zlen = 0;
+    unsigned char* zlib = stbi_zlib_compress(filtered.data(), (int)filtered.size(), &zlen, 8);
+    appendChunk(png, "IDAT", std::vector<uint8_t>(zlib, zlib + zlen));
+    STBIW_FREE(zlib);
+    appendChunk(png, "IEND", std::vector<uint8_t>());
+    return png;
+}
+
+// *****************************************************************************************************
+// Decoding
+
+struct RowsState
+{
+    const uint8_t*  m_Expected;     // the stbi_load_from_memory result
+    uint8_t*        m_Dst;
+    size_t          m_Stride;
+    size_t          m_RowBytes;
+    int             m_Height;
+    int             m_NextRow;
+    int             m_NumCalls;
+    bool            m_Ok;
+};
+
+// The rows must follow the ones reported before, and be final: they are checked, and then modified in place,
+// which the decoder mustn't notice
+static void onRows(void* user, int y_begin, int y_end)
+{
+    RowsState* state = (RowsState*)user;
+    state->m_NumCalls++;
+    if (y_begin != state->m_NextRow || y_end <= y_begin || y_end > state->m_Height)
+    {
+        state->m_Ok = false;
+        return;
+    }
+    state->m_NextRow = y_end;
+    for (int y = y_begin; y < y_end; ++y)
+    {
+        uint8_t* row = state->m_Dst + state->m_Stride * y;
+        if (memcmp(row, state->m_Expected + state->m_RowBytes * y, state->m_RowBytes) != 0)
+            state->m_Ok = false;
+        for (size_t i = 0; i < state->m_RowBytes; ++i)
+            row[i] ^= MODIFY;
+    }
+}
+
+// Checks one into_rows decode against the expected pixels. A stride of 0 means tightly packed
+static void decodeIntoRows(const std::vector<uint8_t>& file, bool from_path, const uint8_t* expected, int width, int height,
+                           int comp, int n, int stride, const char* name, const char* detail)
+{
+    const size_t row_bytes = (size_t)width * n;
+    const size_t real_stride = stride ? (size_t)stride : row_bytes;
+    std::vector<uint8_t> dst(real_stride * height, PADDING);
+
+    RowsState state = { expected, dst.data(), real_stride, row_bytes, height, 0, 0, true };
+    int x = 0, y = 0, c = 0;
+    int ok = from_path ? stbi_load_into_rows(TEMP_FILE, dst.data(), dst.size(), stride, &x, &y, &c, n, onRows, &state)
+                       : stbi_load_from_memory_into_rows(file.data(), (int)file.size(), dst.data(), dst.size(), stride, &x, &y, &c, n, onRows, &state);
+    check(ok != 0, "decode", name, n, detail);
+    if (!ok)
+        return;
+    check(x == width && y == height && c == comp, "size and channels", name, n, detail);
+    check(state.m_Ok, "rows reported in order and final when reported", name, n, detail);
+    check(state.m_NextRow == height, "all rows reported", name, n, detail);
+
+    bool same = true;
+    for (int j = 0; j < height; ++j)
+    {
+        const uint8_t* row = dst.data() + real_stride * j;
+        for (size_t i = 0; i < row_bytes; ++i)
+            same = same && row[i] == (uint8_t)(expected[row_bytes * j + i] ^ MODIFY);
+        for (size_t i = row_bytes; i < real_stride; ++i)
+            same = same && row[i] == PADDING;
+    }
+    check(same, "rows modified in the callback kept, padding untouched", name, n, detail);
+}
+
+// Decodes the file with every loader, for each number of desired channels
+static void testFile(const std::vector<uint8_t>& file, const char* name)
+{
+    FILE* f = fopen(TEMP_FILE, "wb");
+    bool written = f && fwrite(file.data(), 1, file.size(), f) == file.size();
+    if (f)
+        fclose(f);
+    check(written, "writing the temporary file", name, 0, "");
+
+    for (int n = 1; n <= 4; ++n)
+    {
+        int width, height, comp;
+        uint8_t* expected = stbi_load_from_memory(file.data(), (int)file.size(), &width, &height, &comp, n);
+        check(expected != 0, "stbi_load_from_memory", name, n, stbi_failure_reason() ? stbi_failure_reason() : "");
+        if (!expected)
+            continue;
+
+        int info_x, info_y, info_comp;
+        check(stbi_info_from_memory(file.data(), (int)file.size(), &info_x, &info_y, &info_comp) && info_x == width &&
+                  info_y == height && info_comp == comp,
+              "stbi_info agrees with the loader", name, n, "");
+
+        decodeIntoRows(file, false, expected, width, height, comp, n, 0, name, "packed");
+        decodeIntoRows(file, false, expected, width, height, comp, n, width * n + 7, name, "padded stride");
+        if (written)
+            decodeIntoRows(file, true, expected, width, height, comp, n, width * n + 3, name, "from the file");
+
+        // Flipped, the result is copied to the buffer and reported at the end
+        stbi_set_flip_vertically_on_load(1);
+        uint8_t* flipped = stbi_load_from_memory(file.data(), (int)file.size(), &width, &height, &comp, n);
+        stbi_set_flip_vertically_on_load(0);
+        if (flipped)
+        {
+            stbi_set_flip_vertically_on_load(1);
+            decodeIntoRows(file, false, flipped, width, height, comp, n, width * n + 1, name, "flipped");
+            stbi_set_flip_vertically_on_load(0);
+            stbi_image_free(flipped);
+        }
+
+        // One byte short, so it can't be decoded in place, and mustn't report any rows
+        std::vector<uint8_t> small((size_t)width * height * n - 1);
+        RowsState state = { expected, small.data(), (size_t)width * n, (size_t)width * n, height, 0, 0, true };
+        int x, y, c;
+        check(!stbi_load_from_memory_into_rows(file.data(), (int)file.size(), small.data(), small.size(), 0, &x, &y, &c, n, onRows, &state),
+              "fails when dst is too small", name, n, "");
+        check(state.m_NumCalls == 0, "no rows reported when dst is too small", name, n, "");
+
+        stbi_image_free(expected);
+    }
+}
+
+static void testPngs()
+{
+    // 1 row, 1 column, and one big enough to be inflated in several pieces
+    struct Size { int width, height; };
+    const Size sizes[] = { { 1, 1 }, { 300, 1 }, { 1, 300 }, { 37, 29 }, { 700, 500 } };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (int n = 1; n <= 4; ++n)
+        {
+            const int width = sizes[s].width;
+            const int height = sizes[s].height;
+            std::vector<uint8_t> pixels((size_t)width * height * n);
+            makeSmoothImage(pixels, (size_t)width * n, 3 + n + width);
+            std::vector<uint8_t> png;
+            check(stbi_write_png_to_func(appendData, &png, width, height, n, pixels.data(), width * n) != 0, "writing", "png", n, "");
+
+            char name[64];
+            snprintf(name, sizeof(name), "png %dx%d", width, height);
+            testFile(png, name);
+        }
+    }
+
+    // Paletted, with and without a tRNS chunk: the decoder makes 3 or 4 channels out of 1
+    stbi_write_png_reduce = 1;
+    for (int n = 3; n <= 4; ++n)
+    {
+        const int width = 61, height = 45;
+        std::vector<uint8_t> pixels((size_t)width * height * n);
+        makePalettedImage(pixels, n, 5 + n, 100);
+        std::vector<uint8_t> png;
+        stbi_write_png_to_func(appendData, &png, width, height, n, pixels.data(), width * n);
+        testFile(png, n == 4 ? "paletted png with tRNS" : "paletted png");
+    }
+    stbi_write_png_reduce = 0;
+
+    // Grey and rgb with a tRNS color key: an alpha channel is added to img_n
+    {
+        const int width = 23, height = 19;
+        std::vector<uint8_t> grey((size_t)width * height);
+        std::vector<uint8_t> rgb((size_t)width * height * 3);
+        makePalettedImage(grey, 1, 7, 4);
+        makePalettedImage(rgb, 3, 9, 4);
+        std::vector<uint8_t> grey_key(2, 0);
+        grey_key[1] = grey[5];
+        std::vector<uint8_t> rgb_key(6, 0);
+        rgb_key[1] = rgb[15];
+        rgb_key[3] = rgb[16];
+        rgb_key[5] = rgb[17];
+        testFile(makePng(width, height, 0, 8, grey, grey_key), "grey png with tRNS");
+        testFile(makePng(width, height, 2, 8, rgb, rgb_key), "rgb png with tRNS");
+
+        // 16 and 4 bit samples, which are converted after decoding
+        std::vector<uint8_t> rgb16((size_t)width * height * 6);
+        makeImage(rgb16, 13);
+        testFile(makePng(width, height, 2, 16, rgb16, std::vector<uint8_t>()), "16 bit rgb png");
+        std::vector<uint8_t> grey4((size_t)(width + 1) / 2 * height);
+        makeImage(grey4, 17);
+        testFile(makePng(width, height, 0, 4, grey4, std::vector<uint8_t>()), "4 bit grey png");
+    }
+
+    // A png without pixels fails with both loaders, and reports no rows
+    {
+        std::vector<uint8_t> png = makePng(0, 5, 2, 8, std::vector<uint8_t>(), std::vector<uint8_t>());
+        int x, y, c;
+        check(stbi_load_from_memory(png.data(), (int)png.size(), &x, &y, &c, 4) == 0, "0 width fails", "png", 4, "stbi_load_from_memory");
+        uint8_t dst[64];
+        RowsState state = { dst, dst, 0, 0, 5, 0, 0, true };
+        check(!stbi_load_from_memory_into_rows(png.data(), (int)png.size(), dst, sizeof(dst), 0, &x, &y, &c, 4, onRows, &state),
+              "0 width fails", "png", 4, "into_rows");
+        check(state.m_NumCalls == 0, "no rows reported for 0 width", "png", 4, "");
+    }
+}
+
+static void testJpegs()
+{
+    // Quality 90 and under subsamples the chroma 2x2, which the decoder upsamples a row late
+    struct Size { int width, height; };
+    const Size sizes[] = { { 1, 1 }, { 17, 9 }, { 1, 40 }, { 40, 1 }, { 333, 257 } };
+    const int qualities[] = { 80, 95 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); ++q)
+        {
+            for (int n = 1; n <= 3; n += 2)
+            {
+                const int width = sizes[s].width;
+                const int height = sizes[s].height;
+                std::vector<uint8_t> pixels((size_t)width * height * n);
+                makeImage(pixels, 19 + n + width);
+                std::vector<uint8_t> jpg;
+                check(stbi_write_jpg_to_func(appendData, &jpg, width, height, n, pixels.data(), qualities[q]) != 0, "writing", "jpeg", n, "");
+
+                char name[64];
+                snprintf(name, sizeof(name), "jpeg %dx%d, quality %d", width, height, qualities[q]);
+                testFile(jpg, name);
+            }
+        }
+    }
+}
+
+// Other formats are decoded as usual, and copied to the buffer
+static void testOther()
+{
+    const int width = 31, height = 7;
+    std::vector<uint8_t> pixels((size_t)width * height * 3);
+    makeImage(pixels, 23);
+    std::vector<uint8_t> bmp;
+    stbi_write_bmp_to_func(appendData, &bmp, width, height, 3, pixels.data());
+    testFile(bmp, "bmp");
+}
+
+int main()
+{
+    testPngs();
+    testJpegs();
+    testOther();
+    remove(TEMP_FILE);
+    printf("%s\n", g_Ok ? "ok" : "FAILED");
+    return g_Ok ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+// Writes pngs with every stb_image_write entry point and reads them back with stb_image.
+// Also checks the chunk CRCs and the zlib Adler-32 against bytewise reference versions.
+// Built a second time with STBIW_NO_SIMD, for the portable checksums.
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+static bool g_Ok = true;
+
+static void check(bool ok, const char* what, int width, int height, int n, const char* detail)
+{
+    if (ok)
+        return;
+    fprintf(stderr, "FAIL: %s, %dx%d, %d channels, %s\n", what, width, height, n, detail);
+    g_Ok = false;
+}
+
+static uint32_t xorshift32(uint32_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static uint32_t referenceCrc32(const uint8_t* data, size_t len)
+{
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static uint32_t referenceAdler32(const uint8_t* data, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+static uint32_t readU32BE(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Runs the tasks on up to 4 threads
+static void parallelFor(void* context, int count, stbi_write_parallel_task* task, void* data)
+{
+    (void)context;
+    std::vector<std::thread> threads;
+    int num_threads = count < 4 ? count : 4;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        threads.push_back(std::thread([=]() {
+            for (int i = t; i < count; i += num_threads)
+                task(data, i);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+}
+
+static void appendData(void* context, void* data, int size)
+{
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*)context;
+    out->insert(out->end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+// *****************************************************************************************************
+// Checksums
+
+static void testChecksums()
+{
+    check(stbiw__crc32((unsigned char*)"123456789", 9) == 0xCBF43926u, "crc32 of \"123456789\"", 9, 1, 1, "");
+    check(stbiw__adler32(1, (unsigned char*)"Wikipedia", 9) == 0x11E60398u, "adler32 of \"Wikipedia\"", 9, 1, 1, "");
+
+    // All lengths around the vector sizes, from unaligned starts, and some long ones for the folding loops
+    std::vector<uint8_t> data(300000);
+    uint32_t x = 7;
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)xorshift32(&x);
+    std::vector<int> lengths;
+    for (int len = 0; len <= 300; ++len)
+        lengths.push_back(len);
+    lengths.push_back(5552);
+    lengths.push_back(5553);
+    lengths.push_back(16384);
+    lengths.push_back(65536 + 17);
+    lengths.push_back(299990);
+    for (size_t l = 0; l < lengths.size(); ++l)
+    {
+        for (int offset = 0; offset < 3; ++offset)
+        {
+            uint8_t* p = data.data() + offset;
+            int len = lengths[l];
+            check(stbiw__crc32(p, len) == referenceCrc32(p, len), "crc32", len, offset, 1, "");
+            check(stbiw__adler32(1, p, len) == referenceAdler32(p, len), "adler32", len, offset, 1, "");
+        }
+    }
+
+    // All 0xff bytes make the largest sums between the modulo reductions
+    std::vector<uint8_t> ones(100000, 0xff);
+    check(stbiw__adler32(1, ones.data(), (int)ones.size()) == referenceAdler32(ones.data(), ones.size()), "adler32 of 0xff", 100000, 1, 1, "");
+}
+
+// *****************************************************************************************************
+// Png round trips
+
+// Walks the chunks, checks their CRCs and the Adler-32 of the zlib stream, and returns the IHDR color type
+static int checkPngStructure(const std::vector<uint8_t>& png, int width, int height, int n, const char* detail, bool* has_trns)
+{
+    *has_trns = false;
+    if (png.size() < 8 + 25 || memcmp(png.data(), "\x89PNG\r\n\x1a\n", 8) != 0)
+    {
+        check(false, "png signature", width, height, n, detail);
+        return -1;
+    }
+    std::vector<uint8_t> zlib;
+    int color_type = -1;
+    size_t pos = 8;
+    bool end = false;
+    while (!end && pos + 12 <= png.size())
+    {
+        uint32_t len = readU32BE(&png[pos]);
+        if (pos + 12 + len > png.size())
+            break;
+        const uint8_t* tag = &png[pos + 4];
+        check(readU32BE(&png[pos + 8 + len]) == referenceCrc32(tag, len + 4), "chunk crc", width, height, n, detail);
+        if (memcmp(tag, "IHDR", 4) == 0)
+            color_type = tag[4 + 9];
+        else if (memcmp(tag, "tRNS", 4) == 0)
+            *has_trns = true;
+        else if (memcmp(tag, "IDAT", 4) == 0)
+            zlib.insert(zlib.end(), tag + 4, tag + 4 + len);
+        else if (memcmp(tag, "IEND", 4) == 0)
+            end = true;
+        pos += 12 + len;
+    }
+    check(end && pos == png.size(), "chunk layout", width, height, n, detail);
+
+    int filtered_len = 0;
+    char* filtered = zlib.size() > 4 ? stbi_zlib_decode_malloc((const char*)zlib.data(), (int)zlib.size(), &filtered_len) : 0;
+    check(filtered && readU32BE(&zlib[zlib.size() - 4]) == referenceAdler32((const uint8_t*)filtered, filtered_len),
+            "zlib adler32", width, height, n, detail);
+    STBI_FREE(filtered);
+    return color_type;
+}
+
+static void checkPng(const std::vector<uint8_t>& png, const uint8_t* pixels, int stride, int width, int height, int n, const char* detail)
+{
+    int w = 0, h = 0, file_n = 0;
+    stbi_uc* decoded = stbi_load_from_memory(png.data(), (int)png.size(), &w, &h, &file_n, n);
+    bool ok = decoded && w == width && h == height;
+    for (int y = 0; ok && y < height; ++y)
+        ok = memcmp(decoded + (size_t)y * width * n, pixels + (size_t)y * stride, (size_t)width * n) == 0;
+    check(ok, "decoded pixels", width, height, n, detail);
+    stbi_image_free(decoded);
+}
+
+// Noise in runs, so that the image is compressible but still takes all the paths
+static void makeImage(std::vector<uint8_t>& data, uint32_t seed)
+{
+    uint32_t x = seed;
+    uint32_t color = 0;
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        if ((xorshift32(&x) & 7) == 0)
+            color = xorshift32(&x);
+        data[i] = (uint8_t)(color + (xorshift32(&x) & 3));
+    }
+}
+
+// Runs of num_colors different pixels
+static void makePalettedImage(std::vector<uint8_t>& data, int n, uint32_t seed, uint32_t num_colors)
+{
+    uint32_t x = seed;
+    uint32_t color = 0;
+    for (size_t i = 0; i + n <= data.size(); i += n)
+    {
+        if ((xorshift32(&x) & 7) == 0)
+            color = xorshift32(&x) % num_colors;
+        for (int c = 0; c < n; ++c)
+            data[i + c] = (uint8_t)(color * (37 + c * 50));
+    }
+}
+
+// Writes the image with every entry point and checks the results. Returns the png of the banded writers
+static std::vector<uint8_t> roundTrip(const uint8_t* pixels, int stride, int width, int height, int n, const char* detail)
+{
+    bool has_trns;
+    int len = 0;
+    // compressed in one piece, so it differs from the banded writers once there are several bands
+    unsigned char* mem = stbi_write_png_to_mem(pixels, stride, width, height, n, &len);
+    check(mem != 0, "stbi_write_png_to_mem", width, height, n, detail);
+    if (mem)
+    {
+        std::vector<uint8_t> png(mem, mem + len);
+        checkPngStructure(png, width, height, n, detail, &has_trns);
+        checkPng(png, pixels, stride, width, height, n, detail);
+    }
+    STBIW_FREE(mem);
+
+    mem = stbi_write_png_to_mem_parallel(pixels, stride, width, height, n, &len, parallelFor, 0);
+    check(mem != 0, "stbi_write_png_to_mem_parallel", width, height, n, detail);
+    std::vector<uint8_t> png(mem, mem + (mem ? len : 0));
+    STBIW_FREE(mem);
+    if (png.empty())
+        return png;
+    checkPngStructure(png, width, height, n, detail, &has_trns);
+    checkPng(png, pixels, stride, width, height, n, detail);
+
+    // The bands don't depend on the number of threads, so all the banded writers make the same bytes
+
+    std::vector<uint8_t> streamed;
+    int ok = stbi_write_png_to_func(appendData, &streamed, width, height, n, pixels, stride);
+    check(ok && streamed == png, "stbi_write_png_to_func", width, height, n, detail);
+
+    streamed.clear();
+    ok = stbi_write_png_to_func_parallel(appendData, &streamed, width, height, n, pixels, stride, parallelFor, 0);
+    check(ok && streamed == png, "stbi_write_png_to_func_parallel", width, height, n, detail);
+    return png;
+}
+
+static void testRoundTrips()
+{
+    struct Size { int width, height; };
+    // 1200x600x4 is 6 bands of 512KB, 2100x2100x4 is 34 bands, more than one group of 32
+    const Size sizes[] = { { 1, 1 }, { 1, 300 }, { 300, 1 }, { 7, 5 }, { 37, 29 }, { 1200, 600 }, { 2100, 2100 } };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        const int width = sizes[s].width;
+        const int height = sizes[s].height;
+        const bool large = (size_t)width * height > 100000;
+        for (int n = 1; n <= 4; ++n)
+        {
+            if (large && n != 4 && !(n == 3 && width == 1200))
+                continue; // the large images take a while, so only some formats
+            const int stride = width * n + 5;
+            std::vector<uint8_t> pixels((size_t)stride * height);
+            makeImage(pixels, 11 + n + width);
+            for (int quality = 5; quality <= 9; quality += large ? 3 : 1)
+            {
+                if (width == 2100 && quality != 8)
+                    continue;
+                char detail[64];
+                snprintf(detail, sizeof(detail), "quality %d", quality);
+                stbi_write_png_compression_level = quality;
+                roundTrip(pixels.data(), stride, width, height, n, detail);
+            }
+        }
+    }
+    stbi_write_png_compression_level = 8;
+}
+
+// *****************************************************************************************************
+// Reduced pngs
+
+static void testReduce()
+{
+    stbi_write_png_reduce = 1;
+    struct Size { int width, height; };
+    const Size sizes[] = { { 1, 1 }, { 33, 17 }, { 1200, 600 } };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        const int width = sizes[s].width;
+        const int height = sizes[s].height;
+        for (int n = 3; n <= 4; ++n)
+        {
+            const int stride = width * n;
+            std::vector<uint8_t> pixels((size_t)stride * height);
+            bool has_trns;
+
+            // at most 256 colors: paletted, with a tRNS for the translucent ones
+            makePalettedImage(pixels, n, 21 + n, 200);
+            std::vector<uint8_t> png = roundTrip(pixels.data(), stride, width, height, n, "reduce, palette");
+            int color_type = checkPngStructure(png, width, height, n, "reduce, palette", &has_trns);
+            check(color_type == 3, "paletted color type", width, height, n, "reduce");
+            check(has_trns == (n == 4), "tRNS for translucent colors", width, height, n, "reduce");
+
+            if (n == 4)
+            {
+                // opaque: the alpha channel is left out
+                makeImage(pixels, 31);
+                for (size_t i = 3; i < pixels.size(); i += 4)
+                    pixels[i] = 255;
+                png = roundTrip(pixels.data(), stride, width, height, n, "reduce, opaque");
+                color_type = checkPngStructure(png, width, height, n, "reduce, opaque", &has_trns);
+                check(width * height < 256 || color_type == 2, "rgb color type for an opaque image", width, height, n, "reduce");
+            }
+        }
+    }
+    stbi_write_png_reduce = 0;
+}
+
+int main()
+{
+    testChecksums();
+    testRoundTrips();
+    testReduce();
+    printf("%s\n", g_Ok ? "ok" : "FAILED");
+    return g_Ok ? 0 : 1;
+}
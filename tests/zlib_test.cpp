@@ -0,0 +1,130 @@
+// Round trips data through the stb_image_write deflater and the stb_image inflater
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t xorshift32(uint32_t* x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static bool roundTrip(const char* name, const unsigned char* data, int size, int quality)
+{
+    int compressed_size = 0, decompressed_size = 0;
+    unsigned char* compressed = stbi_zlib_compress((unsigned char*)data, size, &compressed_size, quality);
+    char* decompressed = compressed ? stbi_zlib_decode_malloc((const char*)compressed, compressed_size, &decompressed_size) : 0;
+    bool ok = decompressed && decompressed_size == size && memcmp(decompressed, data, size) == 0;
+    if (!ok)
+        fprintf(stderr, "zlib round trip failed: %s, %d bytes, quality %d\n", name, size, quality);
+
+    STBIW_FREE(compressed);
+    STBI_FREE(decompressed);
+    return ok;
+}
+
+static bool roundTripAllQualities(const char* name, const unsigned char* data, int size)
+{
+    bool ok = true;
+    for (int quality = 5; quality <= 9; ++quality)
+        ok = roundTrip(name, data, size, quality) && ok;
+    return ok;
+}
+
+static void makeNoise(unsigned char* data, int size)
+{
+    uint32_t x = 2;
+    for (int i = 0; i < size; ++i)
+        data[i] = (unsigned char)xorshift32(&x);
+}
+
+// A period of noise, repeated. Periods over 32KB are out of reach of the deflate window
+static void makePeriodic(unsigned char* data, int size, int period)
+{
+    makeNoise(data, period < size ? period : size);
+    for (int i = period; i < size; ++i)
+        data[i] = data[i - period];
+}
+
+// Runs of random length and value, from 1 to 1000 bytes
+static void makeRuns(unsigned char* data, int size)
+{
+    uint32_t x = 3;
+    for (int i = 0; i < size;)
+    {
+        int len = 1 + (int)(xorshift32(&x) % 1000);
+        unsigned char value = (unsigned char)xorshift32(&x);
+        for (; len > 0 && i < size; --len)
+            data[i++] = value;
+    }
+}
+
+// Up filtered rows of a noisy rgb gradient, with the filter byte in front of each row, as in a png
+static void makePngRows(unsigned char* data, int size, int width)
+{
+    int stride = 1 + width * 3;
+    uint32_t x = 4;
+    unsigned char* prior = (unsigned char*)calloc(width * 3, 1);
+    unsigned char* row = (unsigned char*)malloc(width * 3);
+    for (int y = 0; y * stride < size; ++y)
+    {
+        for (int i = 0; i < width * 3; ++i)
+            row[i] = (unsigned char)((i / 3) * (i % 3 + 1) + y * 2 + (xorshift32(&x) & 3));
+        unsigned char* out = data + y * stride;
+        int n = size - y * stride < stride ? size - y * stride : stride;
+        for (int i = 0; i < n; ++i)
+            out[i] = i == 0 ? 2 : (unsigned char)(row[i - 1] - prior[i - 1]);
+        memcpy(prior, row, width * 3);
+    }
+    free(row);
+    free(prior);
+}
+
+int main()
+{
+    bool ok = true;
+    const int max_size = 1 << 20;
+    unsigned char* data = (unsigned char*)malloc(max_size);
+
+    // 69633 bytes of noise at quality 8 fill a dynamic block to the symbol limit, and end with 3 trailing literals
+    makeNoise(data, 69633);
+    ok = roundTrip("noise", data, 69633, 8) && ok;
+    const int sizes[] = { 1, 4, 4096, 69632, 69634, 300000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        makeNoise(data, sizes[i]);
+        ok = roundTripAllQualities("noise", data, sizes[i]) && ok;
+    }
+
+    // Compressible data, which takes the match paths and makes more than 65536 symbols per block
+    memset(data, 0, max_size);
+    ok = roundTripAllQualities("zeros", data, max_size) && ok;
+    const int periods[] = { 1, 3, 7, 258, 259, 4096, 32768, 40000 };
+    for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); ++i)
+    {
+        makePeriodic(data, max_size, periods[i]);
+        ok = roundTripAllQualities("periodic", data, max_size) && ok;
+    }
+    makeRuns(data, max_size);
+    ok = roundTripAllQualities("runs", data, max_size) && ok;
+    for (int i = 0; i < max_size; ++i)
+        data[i] = (unsigned char)(i / 4096 + (i % 4096) / 16);
+    ok = roundTripAllQualities("gradient", data, max_size) && ok;
+    makePngRows(data, max_size, 333);
+    ok = roundTripAllQualities("png rows", data, max_size) && ok;
+
+    // A long run and then noise: the inflater's first guess of the output size is far too big
+    memset(data, 0, max_size / 2);
+    makeNoise(data + max_size / 2, max_size / 2);
+    ok = roundTripAllQualities("zeros then noise", data, max_size) && ok;
+
+    free(data);
+    return ok ? 0 : 1;
+}